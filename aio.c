@@ -0,0 +1,400 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/aio_abi.h>
+
+#include "gbsim.h"
+
+/*
+ * Asynchronous I/O on the bulk endpoints, using the kernel AIO interface
+ * that FunctionFS implements for its endpoint files.
+ *
+ * Each bulk out endpoint keeps AIO_READS reads posted, so the AP never has
+ * to wait for the simulator to come back to read(). Completed reads are
+ * handed over to the dispatcher and posted again in a single io_submit().
+ *
+ * Messages sent to the AP are queued per bulk in endpoint. The sender of
+ * the endpoint submits everything queued at once, and whatever gets queued
+ * while a batch is in flight goes out with the next one.
+ */
+
+/* Number of reads kept posted on each bulk out endpoint */
+#define AIO_READS	8
+
+/* Maximum number of writes submitted at once on a bulk in endpoint */
+#define AIO_WRITES	16
+
+/* How often a thread waiting for completions checks for cancellation */
+#define AIO_POLL_NS	(100 * 1000 * 1000)
+
+struct aio_sender {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	TAILQ_HEAD(shead, gbsim_message) pending;
+	unsigned int count;
+};
+
+static struct aio_sender senders[NUM_BULKS];
+static bool aio_available;
+
+static inline int io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+			       struct io_event *events,
+			       struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, timeout);
+}
+
+static void aio_prep(struct iocb *iocb, int fd, uint16_t opcode,
+		     void *buf, size_t size, uint64_t data)
+{
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_fildes = fd;
+	iocb->aio_lio_opcode = opcode;
+	iocb->aio_buf = (uintptr_t)buf;
+	iocb->aio_nbytes = size;
+	iocb->aio_data = data;
+}
+
+/* Submit all the iocbs, retrying on partial submission */
+static int aio_submit_all(aio_context_t ctx, struct iocb **iocbs, int nr)
+{
+	int ret;
+
+	while (nr) {
+		ret = io_submit(ctx, nr, iocbs);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -errno;
+		}
+		iocbs += ret;
+		nr -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for at least min_nr completions, still honouring pthread_cancel()
+ * since io_getevents() isn't a cancellation point.
+ */
+static int aio_wait(aio_context_t ctx, long min_nr, long max_nr,
+		    struct io_event *events)
+{
+	struct timespec timeout;
+	int ret;
+
+	do {
+		pthread_testcancel();
+
+		timeout.tv_sec = 0;
+		timeout.tv_nsec = AIO_POLL_NS;
+		ret = io_getevents(ctx, min_nr, max_nr, events, &timeout);
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+	} while (ret <= 0);
+
+	return ret;
+}
+
+/*
+ * Probe for AIO support. FunctionFS has always implemented it, but the
+ * kernel may have been built without the AIO syscalls.
+ */
+int aio_init(void)
+{
+	aio_context_t ctx = 0;
+	int i;
+
+	for (i = 0; i < NUM_BULKS; i++) {
+		pthread_mutex_init(&senders[i].lock, NULL);
+		pthread_cond_init(&senders[i].cond, NULL);
+		TAILQ_INIT(&senders[i].pending);
+	}
+
+	if (io_setup(AIO_READS, &ctx) < 0) {
+		gbsim_info("AIO not available (%d), using blocking endpoint I/O\n",
+			   errno);
+		return 0;
+	}
+	io_destroy(ctx);
+
+	aio_available = true;
+	gbsim_debug("Using AIO for bulk endpoints\n");
+
+	return 0;
+}
+
+bool aio_enabled(void)
+{
+	return aio_available;
+}
+
+struct aio_reader {
+	aio_context_t ctx;
+	struct gbsim_message *msgs[AIO_READS];
+};
+
+static void aio_recv_cleanup(void *arg)
+{
+	struct aio_reader *reader = arg;
+	int i;
+
+	/* Destroying the context cancels and waits for the posted reads */
+	io_destroy(reader->ctx);
+
+	for (i = 0; i < AIO_READS; i++)
+		message_free(reader->msgs[i]);
+}
+
+/*
+ * AIO flavour of recv_thread(): keep AIO_READS reads posted on the bulk out
+ * endpoint given by param and dispatch the messages as they complete.
+ */
+void *aio_recv_thread(void *param)
+{
+	int ep = (intptr_t)param;
+	struct aio_reader reader;
+	struct iocb iocbs[AIO_READS];
+	struct iocb *submit[AIO_READS];
+	struct io_event events[AIO_READS];
+	int ret, nr, i;
+
+	memset(&reader, 0, sizeof(reader));
+	if (io_setup(AIO_READS, &reader.ctx) < 0) {
+		gbsim_error("io_setup failed on from_ap[%d] (%d)\n", ep, errno);
+		return NULL;
+	}
+
+	pthread_cleanup_push(aio_recv_cleanup, &reader);
+
+	for (i = 0; i < AIO_READS; i++) {
+		reader.msgs[i] = message_alloc();
+		if (!reader.msgs[i])
+			goto out;
+		aio_prep(&iocbs[i], from_ap[ep], IOCB_CMD_PREAD,
+			 reader.msgs[i]->data, ES1_MSG_SIZE, i);
+		submit[i] = &iocbs[i];
+	}
+
+	ret = aio_submit_all(reader.ctx, submit, AIO_READS);
+	if (ret) {
+		gbsim_error("failed to post reads on from_ap[%d] (%d)\n", ep, ret);
+		goto out;
+	}
+
+	while (1) {
+		ret = aio_wait(reader.ctx, 1, AIO_READS, events);
+		if (ret < 0) {
+			gbsim_error("io_getevents failed on from_ap[%d] (%d)\n",
+				    ep, ret);
+			break;
+		}
+
+		for (i = 0, nr = 0; i < ret; i++) {
+			int slot = events[i].data;
+			struct gbsim_message *msg = reader.msgs[slot];
+
+			if (events[i].res < 0) {
+				gbsim_error("error %lld receiving from AP\n",
+					    (long long)events[i].res);
+				goto out;
+			}
+
+			/* The dispatcher now owns the buffer, post a fresh one */
+			msg->size = events[i].res;
+			reader.msgs[slot] = message_alloc();
+			dispatch_message(msg);
+			if (!reader.msgs[slot])
+				goto out;
+
+			aio_prep(&iocbs[slot], from_ap[ep], IOCB_CMD_PREAD,
+				 reader.msgs[slot]->data, ES1_MSG_SIZE, slot);
+			submit[nr++] = &iocbs[slot];
+		}
+
+		ret = aio_submit_all(reader.ctx, submit, nr);
+		if (ret) {
+			gbsim_error("failed to post reads on from_ap[%d] (%d)\n",
+				    ep, ret);
+			break;
+		}
+	}
+
+out:
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
+/*
+ * Queue a message to be written on the bulk in endpoint ep. The segments
+ * are gathered into a message buffer, so the caller is free to reuse them
+ * right away.
+ */
+int aio_send(int ep, const struct iovec *iov, int count)
+{
+	struct aio_sender *sender = &senders[ep];
+	struct gbsim_message *msg;
+	size_t size = 0;
+	int i;
+
+	msg = message_alloc();
+	if (!msg)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		if (size + iov[i].iov_len > ES1_MSG_SIZE) {
+			message_free(msg);
+			return -EMSGSIZE;
+		}
+		memcpy(msg->data + size, iov[i].iov_base, iov[i].iov_len);
+		size += iov[i].iov_len;
+	}
+	msg->size = size;
+
+	pthread_mutex_lock(&sender->lock);
+	TAILQ_INSERT_TAIL(&sender->pending, msg, mnode);
+	if (!sender->count++)
+		pthread_cond_signal(&sender->cond);
+	pthread_mutex_unlock(&sender->lock);
+
+	return 0;
+}
+
+struct aio_writer {
+	aio_context_t ctx;
+	struct aio_sender *sender;
+	struct gbsim_message *msgs[AIO_WRITES];
+	int nr;
+};
+
+static void aio_send_cleanup(void *arg)
+{
+	struct aio_writer *writer = arg;
+	struct aio_sender *sender = writer->sender;
+	struct gbsim_message *msg;
+	int i;
+
+	io_destroy(writer->ctx);
+
+	for (i = 0; i < writer->nr; i++)
+		message_free(writer->msgs[i]);
+
+	/* Nothing queued for this session must reach the next one */
+	pthread_mutex_lock(&sender->lock);
+	while ((msg = TAILQ_FIRST(&sender->pending))) {
+		TAILQ_REMOVE(&sender->pending, msg, mnode);
+		message_free(msg);
+	}
+	sender->count = 0;
+	pthread_mutex_unlock(&sender->lock);
+}
+
+static void aio_unlock(void *arg)
+{
+	pthread_mutex_unlock(arg);
+}
+
+/* Write the messages queued on the bulk in endpoint given by param */
+void *aio_send_thread(void *param)
+{
+	int ep = (intptr_t)param;
+	struct aio_sender *sender = &senders[ep];
+	struct aio_writer writer;
+	struct iocb iocbs[AIO_WRITES];
+	struct iocb *submit[AIO_WRITES];
+	struct io_event events[AIO_WRITES];
+	int ret, done, i;
+
+	memset(&writer, 0, sizeof(writer));
+	writer.sender = sender;
+	if (io_setup(AIO_WRITES, &writer.ctx) < 0) {
+		gbsim_error("io_setup failed on to_ap[%d] (%d)\n", ep, errno);
+		return NULL;
+	}
+
+	pthread_cleanup_push(aio_send_cleanup, &writer);
+
+	while (1) {
+		pthread_mutex_lock(&sender->lock);
+		pthread_cleanup_push(aio_unlock, &sender->lock);
+		while (!sender->count)
+			pthread_cond_wait(&sender->cond, &sender->lock);
+
+		while (writer.nr < AIO_WRITES && sender->count) {
+			struct gbsim_message *msg = TAILQ_FIRST(&sender->pending);
+
+			TAILQ_REMOVE(&sender->pending, msg, mnode);
+			sender->count--;
+			writer.msgs[writer.nr++] = msg;
+		}
+		pthread_cleanup_pop(1);
+
+		for (i = 0; i < writer.nr; i++) {
+			aio_prep(&iocbs[i], to_ap[ep], IOCB_CMD_PWRITE,
+				 writer.msgs[i]->data, writer.msgs[i]->size, i);
+			submit[i] = &iocbs[i];
+		}
+
+		ret = aio_submit_all(writer.ctx, submit, writer.nr);
+		if (ret) {
+			gbsim_error("failed to submit writes on to_ap[%d] (%d)\n",
+				    ep, ret);
+			break;
+		}
+
+		for (done = 0; done < writer.nr; done += ret) {
+			ret = aio_wait(writer.ctx, 1, writer.nr - done, events);
+			if (ret < 0) {
+				gbsim_error("io_getevents failed on to_ap[%d] (%d)\n",
+					    ep, ret);
+				goto out;
+			}
+
+			for (i = 0; i < ret; i++)
+				if (events[i].res < 0)
+					gbsim_error("error %lld sending to AP\n",
+						    (long long)events[i].res);
+		}
+
+		for (i = 0; i < writer.nr; i++)
+			message_free(writer.msgs[i]);
+		writer.nr = 0;
+	}
+
+out:
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
@@ -20,13 +20,7 @@
 
 #include "gbsim.h"
 
-static char *firmware_file = "ara_firmware.fw";
-static int firmware_size;
-static int firmware_read_size;
-static int firmware_fetch_size;
-static int firmware_fd;
-
-char *bootrom_get_operation(uint8_t type)
+static char *bootrom_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -50,8 +44,6 @@ int bootrom_request_send(uint8_t type, uint16_t hd_cport_id)
 	struct op_msg msg = { };
 	struct gb_operation_msg_hdr *oph = &msg.header;
 	struct gb_bootrom_firmware_size_request *size_request;
-	struct gb_bootrom_get_firmware_request *get_fw_request;
-	struct gb_bootrom_ready_to_boot_request *rbt_request;
 	uint16_t message_size = sizeof(*oph);
 	size_t payload_size;
 
@@ -61,24 +53,6 @@ int bootrom_request_send(uint8_t type, uint16_t hd_cport_id)
 		size_request = &msg.fw_size_req;
 		size_request->stage = GB_BOOTROM_BOOT_STAGE_ONE;
 		break;
-	case GB_BOOTROM_TYPE_GET_FIRMWARE:
-		payload_size = sizeof(*get_fw_request);
-		get_fw_request = &msg.fw_get_firmware_req;
-
-		/* Calculate fetch size for remaining data */
-		firmware_fetch_size = firmware_size - firmware_read_size;
-		if (firmware_fetch_size > GB_BOOTROM_FETCH_MAX)
-			firmware_fetch_size = GB_BOOTROM_FETCH_MAX;
-
-		get_fw_request->offset = htole32(firmware_read_size);
-		get_fw_request->size = htole32(firmware_fetch_size);
-		break;
-	case GB_BOOTROM_TYPE_READY_TO_BOOT:
-		payload_size = sizeof(*rbt_request);
-		rbt_request = &msg.fw_rbt_req;
-
-		rbt_request->status = GB_BOOTROM_BOOT_STATUS_SECURE;
-		break;
 	default:
 		gbsim_error("firmware operation type %02x not supported\n",
 			    type);
@@ -86,7 +60,57 @@ int bootrom_request_send(uint8_t type, uint16_t hd_cport_id)
 	}
 
 	message_size += payload_size;
-	return send_request(hd_cport_id, &msg, message_size, 1, type);
+	return send_operation(hd_cport_id, &msg, message_size, type, NULL,
+			      NULL);
+}
+
+/* Tell the AP whether the firmware fetched checks out */
+static int bootrom_ready_to_boot_send(uint16_t hd_cport_id, uint8_t status)
+{
+	struct op_msg msg = { };
+	struct gb_bootrom_ready_to_boot_request *rbt_request;
+	uint16_t message_size = sizeof(msg.header);
+
+	rbt_request = &msg.fw_rbt_req;
+	rbt_request->status = status;
+	message_size += sizeof(*rbt_request);
+
+	return send_operation(hd_cport_id, &msg, message_size,
+			      GB_BOOTROM_TYPE_READY_TO_BOOT, NULL, NULL);
+}
+
+/* Request a chunk of the firmware, on behalf of the fetch */
+static int bootrom_get_firmware_send(uint16_t hd_cport_id, uint32_t offset,
+				     uint32_t size, uint8_t firmware_id,
+				     void *priv)
+{
+	struct op_msg msg = { };
+	struct gb_bootrom_get_firmware_request *get_fw_request;
+	uint16_t message_size = sizeof(msg.header);
+
+	get_fw_request = &msg.fw_get_firmware_req;
+	get_fw_request->offset = htole32(offset);
+	get_fw_request->size = htole32(size);
+	message_size += sizeof(*get_fw_request);
+
+	return send_operation(hd_cport_id, &msg, message_size,
+			      GB_BOOTROM_TYPE_GET_FIRMWARE, priv,
+			      fw_fetch_expired);
+}
+
+/* The fetch ended, tell the AP whether the firmware can be booted */
+static void bootrom_fetch_done(uint16_t hd_cport_id, int result, void *priv)
+{
+	uint8_t status = GB_BOOTROM_BOOT_STATUS_SECURE;
+	int ret;
+
+	if (result)
+		status = GB_BOOTROM_BOOT_STATUS_INVALID;
+
+	ret = bootrom_ready_to_boot_send(hd_cport_id, status);
+	if (ret)
+		gbsim_error("%s: Failed to send ready to boot message(%d)\n",
+			    __func__, ret);
 }
 
 /* Request from AP to Module */
@@ -134,62 +158,25 @@ static int bootrom_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 	return ret;
 }
 
-static int fetch_bootrom(uint16_t hd_cport_id)
-{
-	int ret;
-
-	ret = bootrom_request_send(GB_BOOTROM_TYPE_GET_FIRMWARE,
-				    hd_cport_id);
-	if (ret)
-		gbsim_error("%s: Failed to get firmware (%d)\n", __func__, ret);
-
-	return ret;
-}
-
-static int dump_bootrom(uint8_t *data)
-{
-	int ret;
-
-	if (!firmware_fd) {
-		firmware_fd = open(firmware_file, O_WRONLY);
-		if (firmware_fd < 0) {
-			gbsim_debug("%s: Failed to open file %s\n", __func__,
-				    firmware_file);
-			return firmware_fd;
-		}
-	}
-
-	/* dump data */
-	ret = write(firmware_fd, data, firmware_fetch_size);
-	gbsim_debug("%s: Dumped %d bytes of data\n", __func__, ret);
-
-	firmware_read_size += firmware_fetch_size;
-	if (firmware_read_size == firmware_size) {
-		close(firmware_fd);
-		firmware_fd = 0;
-		firmware_size = 0;
-		firmware_read_size = 0;
-		firmware_fetch_size = 0;
-	}
-
-	return 0;
-}
-
 /* Response from AP to Module, in response to a request Module has sent earlier */
-static int bootrom_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
+static int bootrom_handler_response(struct gbsim_connection *connection,
 				void *rbuf, size_t rsize)
 {
 	struct op_msg *op_rsp = rbuf;
 	struct gb_operation_msg_hdr *oph = &op_rsp->header;
 	struct gb_bootrom_firmware_size_response *size_response;
 	struct gb_bootrom_get_firmware_response *get_fw_response;
-	int ret = 0;
+	struct gbsim_fw_fetch *fetch = connection->priv;
+	uint16_t hd_cport_id = connection->hd_cport_id;
+	uint32_t firmware_size;
 	int type = oph->type & ~OP_RESPONSE;
 
 	/* Did the request fail? */
 	if (oph->result) {
 		gbsim_error("%s: Operation type: %s FAILED (%d)\n", __func__,
 			    bootrom_get_operation(type), oph->result);
+		if (type == GB_BOOTROM_TYPE_GET_FIRMWARE)
+			fw_fetch_fail(fetch, connection->operation);
 		return oph->result;
 	}
 
@@ -198,41 +185,26 @@ static int bootrom_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 		size_response = &op_rsp->fw_size_resp;
 		firmware_size = le32toh(size_response->size);
 
-		gbsim_debug("%s: Firmware size returned is %d bytes\n",
+		gbsim_debug("%s: Firmware size returned is %u bytes\n",
 			    __func__, firmware_size);
 
-		ret = fetch_bootrom(hd_cport_id);
-		break;
+		return fw_fetch_start(fetch, hd_cport_id, firmware_size, 0);
 	case GB_BOOTROM_TYPE_GET_FIRMWARE:
 		get_fw_response = &op_rsp->fw_get_firmware_resp;
-		ret = dump_bootrom(get_fw_response->data);
-		if (ret)
-			break;
-
-		if (firmware_read_size < firmware_size) {
-			ret = fetch_bootrom(hd_cport_id);
-			break;
-		}
-
-		ret = bootrom_request_send(GB_BOOTROM_TYPE_READY_TO_BOOT,
-					    hd_cport_id);
-		if (ret)
-			gbsim_error("%s: Failed to send ready to boot message(%d)\n",
-				    __func__, ret);
-		break;
+		return fw_fetch_receive(fetch, connection->operation,
+					get_fw_response->data,
+					rsize - sizeof(*oph));
 	case GB_BOOTROM_TYPE_READY_TO_BOOT:
 		gbsim_debug("%s: AP granted permission to boot.\n", __func__);
-		break;
+		return 0;
 	default:
 		gbsim_error("%s: Response not supported (%d)\n", __func__,
 			    type);
 		return -EINVAL;
 	}
-
-	return ret;
 }
 
-int bootrom_handler(struct gbsim_connection *connection, void *rbuf,
+static int bootrom_handler(struct gbsim_connection *connection, void *rbuf,
 		    size_t rsize, void *tbuf, size_t tsize)
 {
 	struct op_msg *op = rbuf;
@@ -241,8 +213,34 @@ int bootrom_handler(struct gbsim_connection *connection, void *rbuf,
 	uint16_t hd_cport_id = connection->hd_cport_id;
 
 	if (oph->type & OP_RESPONSE)
-		return bootrom_handler_response(cport_id, hd_cport_id, rbuf, rsize);
+		return bootrom_handler_response(connection, rbuf, rsize);
 	else
 		return bootrom_handler_request(cport_id, hd_cport_id, rbuf, rsize,
 					   tbuf, tsize);
 }
+
+static int bootrom_connection_init(struct gbsim_connection *connection)
+{
+	connection->priv = fw_fetch_create("bootrom", GB_BOOTROM_FETCH_MAX,
+					   bootrom_get_firmware_send,
+					   bootrom_fetch_done, NULL);
+	if (!connection->priv)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void bootrom_connection_exit(struct gbsim_connection *connection)
+{
+	fw_fetch_destroy(connection->priv);
+}
+
+static struct gbsim_protocol bootrom_protocol = {
+	.id		= GREYBUS_PROTOCOL_BOOTROM,
+	.name		= "BOOTROM",
+	.handler	= bootrom_handler,
+	.get_operation	= bootrom_get_operation,
+	.connection_init = bootrom_connection_init,
+	.connection_exit = bootrom_connection_exit,
+};
+GBSIM_PROTOCOL(bootrom_protocol);
@@ -0,0 +1,160 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * Binary capture of the AP <-> module traffic.
+ *
+ * Frames are written in the pcap format, with nanosecond timestamps taken
+ * from CLOCK_MONOTONIC, and the LINKTYPE_USER0 link type. Each frame is
+ * preceded by a struct gbsim_capture_hdr carrying its direction, hd cport,
+ * cport and protocol; the greybus message itself follows untouched, hd cport
+ * id in the pad byte included. tools/gbsim-capture.lua dissects it.
+ *
+ * Records are appended to an in-memory buffer which only gets written out
+ * when full, and when the capture ends.
+ */
+
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_VERSION_MAJOR	2
+#define PCAP_VERSION_MINOR	4
+#define LINKTYPE_USER0		147
+
+#define CAPTURE_SNAPLEN		(sizeof(struct gbsim_capture_hdr) + ES1_MSG_SIZE)
+#define CAPTURE_BUF_SIZE	(1024 * 1024)
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static int capture_fd = -1;
+static char capture_buf[CAPTURE_BUF_SIZE];
+static size_t capture_len;
+
+/* Must be called with capture_lock held */
+static void capture_flush(void)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	while (off < capture_len) {
+		ret = write(capture_fd, capture_buf + off, capture_len - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			gbsim_error("capture write failed (%d)\n", errno);
+			break;
+		}
+		off += ret;
+	}
+	capture_len = 0;
+}
+
+int capture_init(void)
+{
+	struct pcap_file_hdr hdr = {
+		.magic = PCAP_MAGIC_NSEC,
+		.version_major = PCAP_VERSION_MAJOR,
+		.version_minor = PCAP_VERSION_MINOR,
+		.snaplen = CAPTURE_SNAPLEN,
+		.linktype = LINKTYPE_USER0,
+	};
+
+	if (!capture_file)
+		return 0;
+
+	capture_fd = open(capture_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (capture_fd < 0) {
+		gbsim_error("can't open capture file %s (%d)\n", capture_file,
+			    errno);
+		return -errno;
+	}
+
+	memcpy(capture_buf, &hdr, sizeof(hdr));
+	capture_len = sizeof(hdr);
+
+	gbsim_info("capturing messages to %s\n", capture_file);
+
+	return 0;
+}
+
+void capture_message(int direction, uint16_t hd_cport_id, uint16_t cport_id,
+		     int protocol, void *buf, size_t size)
+{
+	struct pcap_record_hdr rec;
+	struct gbsim_capture_hdr cap;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (size > ES1_MSG_SIZE)
+		size = ES1_MSG_SIZE;
+
+	rec.ts_sec = ts.tv_sec;
+	rec.ts_nsec = ts.tv_nsec;
+	rec.incl_len = sizeof(cap) + size;
+	rec.orig_len = rec.incl_len;
+
+	memset(&cap, 0, sizeof(cap));
+	cap.direction = direction;
+	cap.protocol = protocol < 0 ? 0xff : protocol;
+	cap.hd_cport_id = htole16(hd_cport_id);
+	cap.cport_id = htole16(cport_id);
+
+	pthread_mutex_lock(&capture_lock);
+	if (capture_fd < 0)
+		goto out;
+
+	if (capture_len + sizeof(rec) + rec.incl_len > sizeof(capture_buf))
+		capture_flush();
+
+	memcpy(capture_buf + capture_len, &rec, sizeof(rec));
+	capture_len += sizeof(rec);
+	memcpy(capture_buf + capture_len, &cap, sizeof(cap));
+	capture_len += sizeof(cap);
+	memcpy(capture_buf + capture_len, buf, size);
+	capture_len += size;
+
+out:
+	pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_exit(void)
+{
+	pthread_mutex_lock(&capture_lock);
+	if (capture_fd >= 0) {
+		capture_flush();
+		close(capture_fd);
+		capture_fd = -1;
+	}
+	pthread_mutex_unlock(&capture_lock);
+}
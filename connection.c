@@ -10,17 +10,62 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <linux/types.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 
 #include "gbsim.h"
 
-#define ES1_MSG_SIZE	(2 * 1024)
+/*
+ * Handlers run concurrently on the endpoint readers or on the workers, so
+ * the transmit buffer is kept per thread.
+ */
+static __thread char cport_tbuf[ES1_MSG_SIZE];
+
+/*
+ * Where a message sent from a scatter list gets gathered, when it has to be
+ * traced, captured, or sent by a transport without vectored I/O.
+ */
+static __thread char cport_sbuf[ES1_MSG_SIZE];
+
+/*
+ * Protects the connection list, the per-connection message queues and the
+ * run queue of connections having messages waiting for a worker.
+ */
+static pthread_mutex_t connection_lock = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(chead, gbsim_connection) connections =
+	TAILQ_HEAD_INITIALIZER(connections);
+static pthread_cond_t dispatch_cond = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(rhead, gbsim_connection) run_queue =
+	TAILQ_HEAD_INITIALIZER(run_queue);
+static pthread_t *worker_pthreads;
+static pthread_t expiry_pthread;
+
+/*
+ * Lookup tables over the connections, indexed by hd cport id and by
+ * protocol. Both are protected by connection_lock.
+ */
+static struct gbsim_connection *connection_table[HD_CPORT_MAX];
+static struct gbsim_connection *protocol_table[PROTOCOL_MAX];
+
+/*
+ * Requests sent to the AP are given up on after that long without a
+ * response, and a connection can have that many of them outstanding.
+ */
+#define OPERATION_TIMEOUT_MS	1000
+#define OPERATIONS_MAX		256
+
+/* How often the connections are checked for operations timing out */
+#define OPERATION_EXPIRY_MS	(OPERATION_TIMEOUT_MS / 4)
 
-/* Receive buffer for all data arriving from the AP */
-static char cport_rbuf[ES1_MSG_SIZE];
-static char cport_tbuf[ES1_MSG_SIZE];
+/* hd cports on which the AP asked for latency tagging */
+static bool latency_tags[HD_CPORT_MAX];
+
+/* Arrival and handler start times of the message the thread is handling */
+static __thread uint64_t handler_rx_ns;
+static __thread uint64_t handler_start_ns;
 
 /*
  * We (ab)use the operation-message header pad bytes to transfer the
@@ -44,174 +89,541 @@ static uint16_t gbsim_message_cport_unpack(struct gb_operation_msg_hdr *header)
 	return (uint16_t)header->pad[0];
 }
 
+static struct gbsim_connection *_connection_find(uint16_t cport_id)
+{
+	if (cport_id >= HD_CPORT_MAX)
+		return NULL;
+
+	return connection_table[cport_id];
+}
+
 struct gbsim_connection *connection_find(uint16_t cport_id)
 {
 	struct gbsim_connection *connection;
 
-	TAILQ_FOREACH(connection, &interface.connections, cnode)
-		if (connection->hd_cport_id == cport_id)
-			return connection;
+	pthread_mutex_lock(&connection_lock);
+	connection = _connection_find(cport_id);
+	pthread_mutex_unlock(&connection_lock);
 
-	return NULL;
+	return connection;
 }
 
 uint16_t find_hd_cport_for_protocol(int protocol_id)
 {
-	struct gbsim_connection *connection;
+	struct gbsim_connection *connection = NULL;
+	uint16_t hd_cport_id = 0;
 
-	TAILQ_FOREACH(connection, &interface.connections, cnode)
-		if (connection->protocol == protocol_id)
-			return connection->hd_cport_id;
+	if (protocol_id < 0 || protocol_id >= PROTOCOL_MAX)
+		return 0;
 
-	return 0;
+	pthread_mutex_lock(&connection_lock);
+	connection = protocol_table[protocol_id];
+	if (connection)
+		hd_cport_id = connection->hd_cport_id;
+	pthread_mutex_unlock(&connection_lock);
+
+	return hd_cport_id;
+}
+
+/*
+ * Release the protocol state of the connection and free it. Called with
+ * connection_lock held, so connection_exit() must not look connections up.
+ */
+static void connection_destroy(struct gbsim_connection *connection)
+{
+	struct gbsim_protocol *p = protocol_find(connection->protocol);
+	struct gbsim_operation *operation;
+
+	if (p && p->connection_exit)
+		p->connection_exit(connection);
+
+	/* Whatever was waiting for their responses went with the connection */
+	while ((operation = TAILQ_FIRST(&connection->operations))) {
+		TAILQ_REMOVE(&connection->operations, operation, onode);
+		free(operation);
+	}
+
+	interface_put(connection->intf);
+	free(connection);
 }
 
-void allocate_connection(uint16_t cport_id, uint16_t hd_cport_id, int protocol_id)
+int allocate_connection(struct gbsim_interface *intf, uint16_t cport_id,
+			uint16_t hd_cport_id, int protocol_id)
 {
 	struct gbsim_connection *connection;
+	struct gbsim_protocol *p;
+	int ret;
 
-	connection = malloc(sizeof(*connection));
-	connection->cport_id = cport_id;
+	if (hd_cport_id >= HD_CPORT_MAX) {
+		gbsim_error("hd cport id %hu out of range\n", hd_cport_id);
+		return -ERANGE;
+	}
+
+	connection = calloc(1, sizeof(*connection));
+	if (!connection)
+		return -ENOMEM;
 
+	connection->cport_id = cport_id;
 	connection->hd_cport_id = hd_cport_id;
 	connection->protocol = protocol_id;
-	TAILQ_INSERT_TAIL(&interface.connections, connection, cnode);
+	connection->intf = intf;
+	interface_hold(intf);
+	TAILQ_INIT(&connection->messages);
+	TAILQ_INIT(&connection->operations);
+
+	p = protocol_find(protocol_id);
+	if (p && p->connection_init) {
+		ret = p->connection_init(connection);
+		if (ret) {
+			gbsim_error("failed to set up %s connection on hd cport %hu (%d)\n",
+				    p->name, hd_cport_id, ret);
+			interface_put(intf);
+			free(connection);
+			return ret;
+		}
+	}
+
+	pthread_mutex_lock(&connection_lock);
+	if (connection_table[hd_cport_id]) {
+		pthread_mutex_unlock(&connection_lock);
+		gbsim_error("hd cport id %hu already in use\n", hd_cport_id);
+		connection_destroy(connection);
+		return -EBUSY;
+	}
+
+	TAILQ_INSERT_TAIL(&connections, connection, cnode);
+	connection_table[hd_cport_id] = connection;
+	stats_reset(hd_cport_id, cport_id, protocol_id);
+
+	/* The first connection of a protocol is the one it gets resolved to */
+	if (protocol_id >= 0 && protocol_id < PROTOCOL_MAX &&
+	    !protocol_table[protocol_id])
+		protocol_table[protocol_id] = connection;
+	pthread_mutex_unlock(&connection_lock);
+
+	return 0;
+}
+
+/* Must be called with connection_lock held */
+static void connection_unindex(struct gbsim_connection *connection)
+{
+	struct gbsim_connection *other;
+	int protocol_id = connection->protocol;
+
+	connection_table[connection->hd_cport_id] = NULL;
+
+	if (protocol_id < 0 || protocol_id >= PROTOCOL_MAX ||
+	    protocol_table[protocol_id] != connection)
+		return;
+
+	/* Fall back to the next connection of the same protocol, if any */
+	protocol_table[protocol_id] = NULL;
+	TAILQ_FOREACH(other, &connections, cnode)
+		if (other->protocol == protocol_id) {
+			protocol_table[protocol_id] = other;
+			break;
+		}
+}
+
+/* Must be called with connection_lock held */
+static void _free_connection(struct gbsim_connection *connection)
+{
+	struct gbsim_message *msg;
+
+	TAILQ_REMOVE(&connections, connection, cnode);
+	connection_unindex(connection);
+
+	if (connection->queued)
+		TAILQ_REMOVE(&run_queue, connection, wnode);
+
+	while ((msg = TAILQ_FIRST(&connection->messages))) {
+		TAILQ_REMOVE(&connection->messages, msg, mnode);
+		message_free(msg);
+	}
+
+	/* A worker is still running its handler, let it free the connection */
+	if (connection->busy) {
+		connection->released = true;
+		return;
+	}
+
+	connection_destroy(connection);
 }
 
 void free_connection(struct gbsim_connection *connection)
 {
-	TAILQ_REMOVE(&interface.connections, connection, cnode);
-	free(connection);
+	pthread_mutex_lock(&connection_lock);
+	_free_connection(connection);
+	pthread_mutex_unlock(&connection_lock);
 }
 
-void free_connections(void)
+void free_interface_connections(struct gbsim_interface *intf)
 {
 	struct gbsim_connection *connection;
 
+	pthread_mutex_lock(&connection_lock);
+
 	/*
 	 * Linux doesn't have a foreach_safe version of tailq and so the dirty
 	 * trick of 'goto again'.
 	 */
 again:
-	TAILQ_FOREACH(connection, &interface.connections, cnode) {
+	TAILQ_FOREACH(connection, &connections, cnode) {
+		if (connection->intf != intf)
+			continue;
+
+		_free_connection(connection);
+		goto again;
+	}
+
+	pthread_mutex_unlock(&connection_lock);
+}
+
+/* Must be called with connection_lock held */
+static struct gbsim_operation *
+_operation_find(struct gbsim_connection *connection, uint16_t id)
+{
+	struct gbsim_operation *operation;
+
+	TAILQ_FOREACH(operation, &connection->operations, onode)
+		if (operation->id == id)
+			return operation;
+
+	return NULL;
+}
+
+/* Must be called with connection_lock held */
+static void _operation_remove(struct gbsim_connection *connection,
+			      struct gbsim_operation *operation)
+{
+	TAILQ_REMOVE(&connection->operations, operation, onode);
+	connection->operation_count--;
+}
+
+/*
+ * The AP went away: free the connections it created, and forget the
+ * requests still waiting for its responses on the SVC one, which stays for
+ * the next AP.
+ */
+void connections_reset(void)
+{
+	struct gbsim_connection *connection;
+	struct gbsim_operation *operation;
+
+	pthread_mutex_lock(&connection_lock);
+again:
+	TAILQ_FOREACH(connection, &connections, cnode) {
 		if (connection->hd_cport_id == GB_SVC_CPORT_ID)
 			continue;
 
-		free_connection(connection);
+		_free_connection(connection);
 		goto again;
 	}
-	reset_hd_cport_id();
+
+	connection = _connection_find(GB_SVC_CPORT_ID);
+	while (connection &&
+	       (operation = TAILQ_FIRST(&connection->operations))) {
+		_operation_remove(connection, operation);
+		free(operation);
+	}
+	pthread_mutex_unlock(&connection_lock);
+}
+
+/* Must be called with connection_lock held */
+static bool _operation_expired(struct gbsim_operation *operation)
+{
+	return operation && gbsim_now_ns() - operation->sent_ns >
+			    OPERATION_TIMEOUT_MS * 1000000ULL;
+}
+
+/*
+ * Give up on the operations the AP has left unanswered for too long, and
+ * tell their senders. They are kept in the order they were sent, so the
+ * stale ones come first. Must be called with connection_lock held, by
+ * whoever runs the connection's handlers; the lock is dropped around the
+ * callbacks.
+ */
+static void _operations_expire(struct gbsim_connection *connection)
+{
+	struct gbsim_operation *operation;
+	char *protocol, *name;
+
+	while (!connection->released) {
+		operation = TAILQ_FIRST(&connection->operations);
+		if (!_operation_expired(operation))
+			break;
+
+		_operation_remove(connection, operation);
+		pthread_mutex_unlock(&connection_lock);
+
+		get_protocol_operation(connection->protocol, &protocol, &name,
+				       operation->type);
+		gbsim_error("%s %s operation %hu timed out on hd cport %hu\n",
+			    protocol, name, operation->id,
+			    connection->hd_cport_id);
+		if (operation->expired)
+			operation->expired(operation);
+		free(operation);
+
+		pthread_mutex_lock(&connection_lock);
+	}
 }
 
-static void get_protocol_operation(uint16_t cport_id, char **protocol,
-				   char **operation, uint8_t type)
+/*
+ * Register a request about to be sent to the AP, giving it an operation id
+ * no other outstanding one of the connection has. 0 is left out, it is for
+ * the requests not expecting a response.
+ */
+static int operation_start(uint16_t hd_cport_id, uint8_t type, void *priv,
+			   void (*expired)(struct gbsim_operation *operation),
+			   uint16_t *id)
 {
 	struct gbsim_connection *connection;
+	struct gbsim_operation *operation;
+
+	operation = calloc(1, sizeof(*operation));
+	if (!operation)
+		return -ENOMEM;
 
-	connection = connection_find(cport_id);
+	operation->type = type;
+	operation->priv = priv;
+	operation->expired = expired;
+
+	pthread_mutex_lock(&connection_lock);
+	connection = _connection_find(hd_cport_id);
 	if (!connection) {
+		pthread_mutex_unlock(&connection_lock);
+		free(operation);
+		return -ENODEV;
+	}
+
+	if (connection->operation_count == OPERATIONS_MAX) {
+		pthread_mutex_unlock(&connection_lock);
+		gbsim_error("too many operations outstanding on hd cport %hu\n",
+			    hd_cport_id);
+		free(operation);
+		return -EBUSY;
+	}
+
+	do {
+		operation->id = ++connection->operation_id;
+	} while (!operation->id || _operation_find(connection, operation->id));
+
+	operation->sent_ns = gbsim_now_ns();
+	TAILQ_INSERT_TAIL(&connection->operations, operation, onode);
+	connection->operation_count++;
+	*id = operation->id;
+	pthread_mutex_unlock(&connection_lock);
+
+	return 0;
+}
+
+/* Drop an operation whose request couldn't be sent */
+static void operation_cancel(uint16_t hd_cport_id, uint16_t id)
+{
+	struct gbsim_connection *connection;
+	struct gbsim_operation *operation = NULL;
+
+	pthread_mutex_lock(&connection_lock);
+	connection = _connection_find(hd_cport_id);
+	if (connection)
+		operation = _operation_find(connection, id);
+	if (operation)
+		_operation_remove(connection, operation);
+	pthread_mutex_unlock(&connection_lock);
+
+	free(operation);
+}
+
+/*
+ * Take the operation a response from the AP completes out of the table.
+ * Returns -ENOENT if the response doesn't match any outstanding request.
+ */
+static int operation_complete(struct gbsim_connection *connection,
+			      struct gb_operation_msg_hdr *hdr,
+			      struct gbsim_operation **operation)
+{
+	uint16_t id = le16toh(hdr->operation_id);
+	struct gbsim_operation *op;
+
+	pthread_mutex_lock(&connection_lock);
+	_operations_expire(connection);
+	op = _operation_find(connection, id);
+	if (op && op->type == (hdr->type & ~OP_RESPONSE))
+		_operation_remove(connection, op);
+	else
+		op = NULL;
+	pthread_mutex_unlock(&connection_lock);
+
+	*operation = op;
+
+	return op ? 0 : -ENOENT;
+}
+
+void get_protocol_operation(int protocol_id, char **protocol,
+			    char **operation, uint8_t type)
+{
+	struct gbsim_protocol *p;
+
+	if (protocol_id < 0) {
 		*protocol = "N/A";
 		*operation = "N/A";
 		return;
 	}
 
-	switch (connection->protocol) {
-	case GREYBUS_PROTOCOL_CONTROL:
-		*protocol = "CONTROL";
-		*operation = control_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_SVC:
-		*protocol = "SVC";
-		*operation = svc_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_GPIO:
-		*protocol = "GPIO";
-		*operation = gpio_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_I2C:
-		*protocol = "I2C";
-		*operation = i2c_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_UART:
-		*protocol = "UART";
-		*operation = uart_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_LOOPBACK:
-		*protocol = "LOOPBACK";
-		*operation = loopback_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_PWM:
-		*protocol = "PWM";
-		*operation = pwm_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_SDIO:
-		*protocol = "SDIO";
-		*operation = sdio_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_SPI:
-		*protocol = "SPI";
-		*operation = spi_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_LIGHTS:
-		*protocol = "LIGHTS";
-		*operation = lights_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_POWER_SUPPLY:
-		*protocol = "POWER_SUPPLY";
-		*operation = power_supply_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_BOOTROM:
-		*protocol = "BOOTROM";
-		*operation = bootrom_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_FW_MANAGEMENT:
-		*protocol = "fw-mgmt";
-		*operation = fw_mgmt_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_FW_DOWNLOAD:
-		*protocol = "fw-download";
-		*operation = fw_download_get_operation(type);
-		break;
-	default:
+	p = protocol_find(protocol_id);
+	if (!p) {
 		*protocol = "(Unknown protocol)";
 		*operation = "(Unknown operation)";
-		break;
+		return;
 	}
+
+	*protocol = (char *)p->name;
+	*operation = p->get_operation ? p->get_operation(type) :
+					"(Unknown operation)";
 }
 
-static int send_msg_to_ap(uint16_t hd_cport_id,
+/*
+ * Log a message going through the connection, resolving the protocol and
+ * operation names. Only called when tracing, so the message path doesn't
+ * pay for it otherwise.
+ */
+static void trace_message(struct gbsim_connection *connection, bool inbound,
+			  void *buf, size_t size)
+{
+	struct gb_operation_msg_hdr *hdr = buf;
+	char *protocol, *operation, *type;
+
+	type = hdr->type & OP_RESPONSE ? "response" : "request";
+	get_protocol_operation(connection ? connection->protocol : -1,
+			       &protocol, &operation, hdr->type & ~OP_RESPONSE);
+
+	if (inbound)
+		gbsim_debug("AP -> Module %hhu CPort %hu %s %s %s\n",
+			    connection_module_id(connection),
+			    connection->cport_id, protocol, operation, type);
+	else
+		gbsim_debug("Module -> AP CPort %hu %s %s %s\n",
+			    gbsim_message_cport_unpack(hdr), protocol,
+			    operation, type);
+
+	gbsim_dump(buf, size);
+}
+
+/* Record a frame in the capture file, along with its connection details */
+static void capture_frame(uint16_t hd_cport_id, int direction,
+			  void *buf, size_t size)
+{
+	struct gbsim_connection *connection;
+	uint16_t cport_id = 0;
+	int protocol = -1;
+
+	pthread_mutex_lock(&connection_lock);
+	connection = _connection_find(hd_cport_id);
+	if (connection) {
+		cport_id = connection->cport_id;
+		protocol = connection->protocol;
+	}
+	pthread_mutex_unlock(&connection_lock);
+
+	capture_message(direction, hd_cport_id, cport_id, protocol, buf, size);
+}
+
+/*
+ * Hold a message back for the time it takes to go over the link of the
+ * interface, at the gear the AP negotiated.
+ */
+static void throttle_message(struct gbsim_connection *connection,
+			     bool inbound, size_t size)
+{
+	if (!connection || !connection->intf)
+		return;
+
+	unipro_link_throttle(inbound ? &connection->intf->tx :
+			     &connection->intf->rx, size);
+}
+
+/* Gather a scatter list into the thread's send buffer */
+static void *gather_message(const struct iovec *iov, int count)
+{
+	size_t off = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		memcpy(cport_sbuf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+
+	return cport_sbuf;
+}
+
+/*
+ * Send message, holding the header and fixed size part of the payload,
+ * followed by the count segments of payload, without copying them when the
+ * transport can write them out directly.
+ */
+static int send_msgv_to_ap(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
+			const struct iovec *payload, int count,
 			uint16_t operation_id, uint8_t type, uint8_t result)
 {
 	struct gb_operation_msg_hdr *header = &message->header;
-	char *protocol, *operation;
-	ssize_t nbytes;
+	struct iovec iov[GBSIM_MAX_IOV + 1];
+	size_t size = message_size;
+	void *buf = message;
+	int i, ret;
+
+	if (count > GBSIM_MAX_IOV)
+		return -EINVAL;
+
+	iov[0].iov_base = message;
+	iov[0].iov_len = message_size;
+	for (i = 0; i < count; i++) {
+		iov[i + 1] = payload[i];
+		size += payload[i].iov_len;
+	}
+
+	if (size > ES1_MSG_SIZE) {
+		gbsim_error("message of %zu bytes too large for hd cport %hu\n",
+			    size, hd_cport_id);
+		return -EMSGSIZE;
+	}
 
-	header->size = htole16(message_size);
+	header->size = htole16(size);
 	header->operation_id = operation_id;
 	header->type = type;
 	header->result = result;
 
 	gbsim_message_cport_pack(header, hd_cport_id);
 
-	get_protocol_operation(hd_cport_id, &protocol, &operation,
-			       type & ~OP_RESPONSE);
-	if (type & OP_RESPONSE)
-		gbsim_debug("Module -> AP CPort %hu %s %s response\n",
-			    hd_cport_id, protocol, operation);
-	else
-		gbsim_debug("Module -> AP CPort %hu %s %s request\n",
-			    hd_cport_id, protocol, operation);
+	if (count && (gbsim_tracing() || capture_file || !transport->sendv))
+		buf = gather_message(iov, count + 1);
+
+	if (gbsim_tracing())
+		trace_message(connection_find(hd_cport_id), false, buf, size);
+
+	if (capture_file)
+		capture_frame(hd_cport_id, GBSIM_CAPTURE_TO_AP, buf, size);
+
+	if (unipro_throttled())
+		throttle_message(connection_find(hd_cport_id), false, size);
 
 	/* Send the response to the AP */
-	if (verbose)
-		gbsim_dump(message, message_size);
+	if (transport->sendv)
+		ret = transport->sendv(hd_cport_id, iov, count + 1);
+	else
+		ret = transport->send(hd_cport_id, buf, size);
+	stats_message(hd_cport_id, false, type, size, ret);
 
-	nbytes = write(to_ap, message, message_size);
-	if (nbytes < 0)
-		return nbytes;
+	return ret;
+}
 
-	return 0;
+static int send_msg_to_ap(uint16_t hd_cport_id,
+			struct op_msg *message, uint16_t message_size,
+			uint16_t operation_id, uint8_t type, uint8_t result)
+{
+	return send_msgv_to_ap(hd_cport_id, message, message_size, NULL, 0,
+			       operation_id, type, result);
 }
 
 int send_response(uint16_t hd_cport_id,
@@ -222,6 +634,20 @@ int send_response(uint16_t hd_cport_id,
 				operation_id, type | OP_RESPONSE, result);
 }
 
+/*
+ * Like send_response(), with the payload continuing in the count segments
+ * of payload, which are referenced rather than copied.
+ */
+int send_response_iov(uint16_t hd_cport_id,
+			struct op_msg *message, uint16_t message_size,
+			const struct iovec *payload, int count,
+			uint16_t operation_id, uint8_t type, uint8_t result)
+{
+	return send_msgv_to_ap(hd_cport_id, message, message_size,
+			       payload, count, operation_id,
+			       type | OP_RESPONSE, result);
+}
+
 int send_request(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
 			uint16_t operation_id, uint8_t type)
@@ -230,118 +656,347 @@ int send_request(uint16_t hd_cport_id,
 				operation_id, type, 0);
 }
 
+/*
+ * Send a request expecting a response, under an operation id of its own.
+ * The response handler finds priv in connection->operation. If the AP
+ * doesn't respond in time, expired is called with the operation instead,
+ * from the connection's handler context as well.
+ */
+int send_operation(uint16_t hd_cport_id,
+			struct op_msg *message, uint16_t message_size,
+			uint8_t type, void *priv,
+			void (*expired)(struct gbsim_operation *operation))
+{
+	uint16_t id;
+	int ret;
+
+	ret = operation_start(hd_cport_id, type, priv, expired, &id);
+	if (ret)
+		return ret;
+
+	/* The response may be handled, and the operation freed, any time now */
+	ret = send_msg_to_ap(hd_cport_id, message, message_size, htole16(id),
+			     type, 0);
+	if (ret)
+		operation_cancel(hd_cport_id, id);
+
+	return ret;
+}
+
 static int connection_recv_handler(struct gbsim_connection *connection,
 				void *rbuf, size_t rsize)
 {
 	void *tbuf = &cport_tbuf[0];
 	size_t tsize = sizeof(cport_tbuf);
+	struct gbsim_protocol *p;
+
+	/*
+	 * Only zero the header and the fixed size part of the payloads, the
+	 * handlers fill in the variable length data they send.
+	 */
+	memset(tbuf, 0, sizeof(struct op_msg));
 
-	memset(tbuf, 0, tsize);	/* Zero buffer before use */
-
-	switch (connection->protocol) {
-	case GREYBUS_PROTOCOL_CONTROL:
-		return control_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_SVC:
-		return svc_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_GPIO:
-		return gpio_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_I2C:
-		return i2c_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_UART:
-		return uart_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_PWM:
-		return pwm_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_SDIO:
-		return sdio_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_SPI:
-		return spi_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_LIGHTS:
-		return lights_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_POWER_SUPPLY:
-		return power_supply_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_LOOPBACK:
-		return loopback_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_BOOTROM:
-		return bootrom_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_FW_MANAGEMENT:
-		return fw_mgmt_handler(connection, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_FW_DOWNLOAD:
-		return fw_download_handler(connection, rbuf, rsize, tbuf, tsize);
-	default:
+	/*
+	 * Neither are received buffers. What a short request lacks of the
+	 * fixed size part reads as zeros, the handlers check the variable
+	 * length data against rsize.
+	 */
+	if (rsize < sizeof(struct op_msg))
+		memset(rbuf + rsize, 0, sizeof(struct op_msg) - rsize);
+
+	p = protocol_find(connection->protocol);
+	if (!p) {
 		gbsim_error("handler not found for cport %u\n",
 				connection->cport_id);
 		return -EINVAL;
 	}
+
+	return p->handler(connection, rbuf, rsize, tbuf, tsize);
 }
 
-static void recv_handler(void *rbuf, size_t rsize)
+void latency_tag_enable(uint16_t hd_cport_id, bool enable)
+{
+	if (hd_cport_id >= HD_CPORT_MAX)
+		return;
+
+	__atomic_store_n(&latency_tags[hd_cport_id], enable, __ATOMIC_RELAXED);
+}
+
+bool latency_tag_enabled(uint16_t hd_cport_id)
+{
+	if (hd_cport_id >= HD_CPORT_MAX)
+		return false;
+
+	return __atomic_load_n(&latency_tags[hd_cport_id], __ATOMIC_RELAXED);
+}
+
+/*
+ * Time spent so far on the message being handled by the calling thread:
+ * since it was received from the AP, and since its handler started.
+ */
+void latency_tag_times(uint32_t *bridge_us, uint32_t *handler_us)
+{
+	uint64_t now = gbsim_now_ns();
+
+	*bridge_us = (now - handler_rx_ns) / 1000;
+	*handler_us = (now - handler_start_ns) / 1000;
+}
+
+static void recv_handler(struct gbsim_connection *connection,
+			 void *rbuf, size_t rsize, uint64_t rx_ns)
 {
 	struct gb_operation_msg_hdr *hdr = rbuf;
-	uint16_t hd_cport_id;
-	struct gbsim_connection *connection;
-	char *protocol, *operation, *type;
+	struct gbsim_operation *operation = NULL;
+	uint16_t hd_cport_id = connection->hd_cport_id;
+	uint8_t type = hdr->type;
 	int ret;
 
-	if (rsize < sizeof(*hdr)) {
-		gbsim_error("short message received\n");
+	if (gbsim_tracing())
+		trace_message(connection, true, rbuf, rsize);
+
+	gbsim_message_cport_clear(hdr);
+
+	if (unipro_throttled())
+		throttle_message(connection, true, rsize);
+
+	/*
+	 * Responses are only handed over along with the request they answer.
+	 * A replayed capture has the AP's responses to requests that weren't
+	 * sent this time, which go through regardless.
+	 */
+	if (type & OP_RESPONSE &&
+	    operation_complete(connection, hdr, &operation) &&
+	    !replay_active()) {
+		gbsim_error("response %02x, operation %hu, matches no request on hd cport %hu\n",
+			    type, le16toh(hdr->operation_id), hd_cport_id);
+		stats_message(hd_cport_id, true, type, rsize, -ENOENT);
 		return;
 	}
 
-	/* Retreive the cport id stored in the header pad bytes */
-	hd_cport_id = gbsim_message_cport_unpack(hdr);
+	handler_rx_ns = rx_ns;
+	handler_start_ns = gbsim_now_ns();
+	connection->operation = operation;
+	ret = connection_recv_handler(connection, rbuf, rsize);
+	connection->operation = NULL;
+	free(operation);
 
-	connection = connection_find(hd_cport_id);
-	if (!connection) {
-		gbsim_error("message received for unknown cport id %u\n",
-			hd_cport_id);
-		return;
+	stats_message(hd_cport_id, true, type, rsize, ret);
+	stats_handler(hd_cport_id, type, gbsim_now_ns() - handler_start_ns);
+
+	if (ret)
+		gbsim_debug("connection_recv_handler() returned %d\n", ret);
+}
+
+/*
+ * Run the handlers of connections having messages queued. A connection is
+ * only ever serviced by one worker at a time, and its messages are taken in
+ * order, so the message order within a CPort is preserved.
+ */
+static void *worker_thread(void *param)
+{
+	struct gbsim_connection *connection;
+	struct gbsim_message *msg;
+
+	pthread_mutex_lock(&connection_lock);
+	while (1) {
+		while (TAILQ_EMPTY(&run_queue))
+			pthread_cond_wait(&dispatch_cond, &connection_lock);
+
+		connection = TAILQ_FIRST(&run_queue);
+		TAILQ_REMOVE(&run_queue, connection, wnode);
+		connection->queued = false;
+
+		msg = TAILQ_FIRST(&connection->messages);
+		TAILQ_REMOVE(&connection->messages, msg, mnode);
+		connection->busy = true;
+		pthread_mutex_unlock(&connection_lock);
+
+		recv_handler(connection, msg->data, msg->size, msg->rx_ns);
+		message_free(msg);
+
+		pthread_mutex_lock(&connection_lock);
+		connection->busy = false;
+
+		if (connection->released) {
+			connection_destroy(connection);
+		} else if (!TAILQ_EMPTY(&connection->messages)) {
+			/* Go to the back of the queue to be fair to others */
+			TAILQ_INSERT_TAIL(&run_queue, connection, wnode);
+			connection->queued = true;
+		}
 	}
 
-	type = hdr->type & OP_RESPONSE ? "response" : "request";
-	get_protocol_operation(hd_cport_id, &protocol, &operation,
-			       hdr->type & ~OP_RESPONSE);
+	return NULL;
+}
+
+/*
+ * Without workers, the endpoint reader that finds a connection idle runs
+ * its handlers, one message at a time and in order, as a worker would.
+ * Messages for the connection arriving on other readers meanwhile are
+ * queued for it. Called with connection_lock held.
+ */
+static void connection_drain(struct gbsim_connection *connection)
+{
+	struct gbsim_message *msg;
 
-	/* FIXME: can identify module from our cport connection */
-	gbsim_debug("AP -> Module %hhu CPort %hu %s %s %s\n",
-		    cport_to_module_id(hd_cport_id), connection->cport_id,
-		    protocol, operation, type);
+	connection->busy = true;
+	while ((msg = TAILQ_FIRST(&connection->messages))) {
+		TAILQ_REMOVE(&connection->messages, msg, mnode);
+		pthread_mutex_unlock(&connection_lock);
 
-	if (verbose)
-		gbsim_dump(rbuf, rsize);
+		recv_handler(connection, msg->data, msg->size, msg->rx_ns);
+		message_free(msg);
 
-	gbsim_message_cport_clear(hdr);
+		pthread_mutex_lock(&connection_lock);
+	}
+	connection->busy = false;
 
-	ret = connection_recv_handler(connection, rbuf, rsize);
-	if (ret)
-		gbsim_debug("connection_recv_handler() returned %d\n", ret);
+	if (connection->released)
+		connection_destroy(connection);
 }
 
-void recv_thread_cleanup(void *arg)
+/*
+ * Pass on the messages that came in for a connection while it was busy with
+ * something other than a worker or a reader. Called with connection_lock
+ * held.
+ */
+static void connection_resume(struct gbsim_connection *connection)
 {
-	cleanup_endpoint(to_ap, "to_ap");
-	cleanup_endpoint(from_ap, "from_ap");
+	if (TAILQ_EMPTY(&connection->messages))
+		return;
+
+	if (!worker_count) {
+		connection_drain(connection);
+		return;
+	}
+
+	TAILQ_INSERT_TAIL(&run_queue, connection, wnode);
+	connection->queued = true;
+	pthread_cond_signal(&dispatch_cond);
 }
 
 /*
- * Repeatedly perform blocking reads to receive messages arriving
- * from the AP.
+ * Expire the operations of the connections the AP doesn't send anything
+ * to anymore, which would otherwise wait for their next response. A
+ * connection is taken as a worker would, so that the callbacks run in turn
+ * with its handlers.
  */
-void *recv_thread(void *param)
+static void *expiry_thread(void *param)
 {
-	void *rbuf = &cport_rbuf[0];
-	size_t rbuf_size = sizeof(cport_rbuf);
+	struct gbsim_connection *connection;
+	struct gbsim_operation *operation;
 
+	pthread_mutex_lock(&connection_lock);
 	while (1) {
-		ssize_t rsize;
+		pthread_mutex_unlock(&connection_lock);
+		usleep(OPERATION_EXPIRY_MS * 1000);
+		pthread_mutex_lock(&connection_lock);
 
-		memset(rbuf, 0, rbuf_size);	/* Zero buffer before use */
-
-		rsize = read(from_ap, rbuf, rbuf_size);
-		if (rsize < 0) {
-			gbsim_error("error %zd receiving from AP\n", rsize);
-			return NULL;
+again:
+		TAILQ_FOREACH(connection, &connections, cnode) {
+			operation = TAILQ_FIRST(&connection->operations);
+			if (connection->busy || connection->queued ||
+			    !_operation_expired(operation))
+				continue;
+
+			connection->busy = true;
+			_operations_expire(connection);
+			connection->busy = false;
+
+			if (connection->released)
+				connection_destroy(connection);
+			else
+				connection_resume(connection);
+
+			/* The list may have changed while the lock was dropped */
+			goto again;
 		}
+	}
 
-		recv_handler(rbuf, rsize);
+	return NULL;
+}
+
+/*
+ * Hand a message over to its connection. Without workers the handler runs
+ * right away on the endpoint reader, unless another one is running the
+ * connection's handlers already.
+ */
+void dispatch_message(struct gbsim_message *msg)
+{
+	struct gb_operation_msg_hdr *hdr = (struct gb_operation_msg_hdr *)msg->data;
+	struct gbsim_connection *connection;
+	uint16_t hd_cport_id;
+
+	msg->rx_ns = gbsim_now_ns();
+
+	if (msg->size < sizeof(*hdr)) {
+		gbsim_error("short message received\n");
+		message_free(msg);
+		return;
+	}
+
+	/* Retreive the cport id stored in the header pad bytes */
+	hd_cport_id = gbsim_message_cport_unpack(hdr);
+
+	if (capture_file)
+		capture_frame(hd_cport_id, GBSIM_CAPTURE_FROM_AP, msg->data,
+			      msg->size);
+
+	pthread_mutex_lock(&connection_lock);
+	connection = _connection_find(hd_cport_id);
+	if (!connection) {
+		pthread_mutex_unlock(&connection_lock);
+		gbsim_error("message received for unknown cport id %u\n",
+			hd_cport_id);
+		message_free(msg);
+		return;
 	}
+
+	TAILQ_INSERT_TAIL(&connection->messages, msg, mnode);
+
+	if (!worker_count) {
+		if (!connection->busy)
+			connection_drain(connection);
+		pthread_mutex_unlock(&connection_lock);
+		return;
+	}
+
+	/* A busy connection is put back on the run queue by its worker */
+	if (!connection->queued && !connection->busy) {
+		TAILQ_INSERT_TAIL(&run_queue, connection, wnode);
+		connection->queued = true;
+		pthread_cond_signal(&dispatch_cond);
+	}
+	pthread_mutex_unlock(&connection_lock);
+}
+
+int dispatch_init(void)
+{
+	int ret, i;
+
+	ret = pthread_create(&expiry_pthread, NULL, expiry_thread, NULL);
+	if (ret) {
+		gbsim_error("can't create operation expiry thread (%d)\n", ret);
+		return -ret;
+	}
+
+	if (!worker_count)
+		return 0;
+
+	worker_pthreads = calloc(worker_count, sizeof(*worker_pthreads));
+	if (!worker_pthreads)
+		return -ENOMEM;
+
+	for (i = 0; i < worker_count; i++) {
+		ret = pthread_create(&worker_pthreads[i], NULL, worker_thread,
+				     NULL);
+		if (ret) {
+			gbsim_error("can't create worker thread (%d)\n", ret);
+			return -ret;
+		}
+	}
+
+	gbsim_debug("%d protocol handler workers started\n", worker_count);
+
+	return 0;
 }
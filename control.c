@@ -26,15 +26,18 @@
 #define GBSIM_CONTROL_VERSION_MINOR	1
 
 
-int control_handler(struct gbsim_connection *connection, void *rbuf,
+static int control_handler(struct gbsim_connection *connection, void *rbuf,
 		    size_t rsize, void *tbuf, size_t tsize)
 {
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp = tbuf;
 	struct gb_operation_msg_hdr *oph = &op_req->header;
+	struct iovec manifest;
 	size_t payload_size;
 	uint16_t message_size = sizeof(*oph);
 	uint16_t hd_cport_id = connection->hd_cport_id;
+	struct gbsim_manifest *m = connection->intf ?
+				   connection->intf->manifest : NULL;
 
 	switch (oph->type) {
 	case GB_REQUEST_TYPE_PROTOCOL_VERSION:
@@ -44,16 +47,18 @@ int control_handler(struct gbsim_connection *connection, void *rbuf,
 		break;
 	case GB_CONTROL_TYPE_GET_MANIFEST_SIZE:
 		payload_size = sizeof(op_rsp->control_msize_rsp);
-		op_rsp->control_msize_rsp.size =
-				htole16(interface.manifest_size);
+		op_rsp->control_msize_rsp.size = htole16(m ? m->size : 0);
 		break;
 	case GB_CONTROL_TYPE_GET_MANIFEST:
-		payload_size = interface.manifest_size;
-		memcpy(&op_rsp->control_manifest_rsp.data, interface.manifest,
-		       payload_size);
-		break;
+		/* The whole payload is the manifest, send it from where it is */
+		manifest.iov_base = m ? m->data : NULL;
+		manifest.iov_len = m ? m->size : 0;
+		return send_response_iov(hd_cport_id, op_rsp, message_size,
+					 &manifest, 1, oph->operation_id,
+					 oph->type, PROTOCOL_STATUS_SUCCESS);
 	case GB_CONTROL_TYPE_CONNECTED:
 		payload_size = 0;
+		storm_cport_connected(connection_module_id(connection));
 		break;
 	case GB_CONTROL_TYPE_DISCONNECTED:
 		payload_size = 0;
@@ -69,7 +74,7 @@ int control_handler(struct gbsim_connection *connection, void *rbuf,
 				PROTOCOL_STATUS_SUCCESS);
 }
 
-char *control_get_operation(uint8_t type)
+static char *control_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -90,3 +95,11 @@ char *control_get_operation(uint8_t type)
 		return "(Unknown operation)";
 	}
 }
+
+static struct gbsim_protocol control_protocol = {
+	.id		= GREYBUS_PROTOCOL_CONTROL,
+	.name		= "CONTROL",
+	.handler	= control_handler,
+	.get_operation	= control_get_operation,
+};
+GBSIM_PROTOCOL(control_protocol);
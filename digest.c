@@ -0,0 +1,207 @@
+/*
+ * Greybus Simulator: SHA-256 and CRC32 digests
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gbsim.h"
+
+/*
+ * Digests of the firmware fetched from the AP, computed as it comes in so
+ * that it can be checked against the expected one.
+ *
+ * SHA-256 follows FIPS 180-4. CRC32 is the reflected IEEE 802.3 one of
+ * zlib and cksum -a crc32b, computed eight bytes at a time with slicing
+ * tables.
+ */
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror32(uint32_t x, unsigned int n)
+{
+	return x >> n | x << (32 - n);
+}
+
+static void sha256_block(uint32_t *state, const uint8_t *block)
+{
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	uint32_t w[64];
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)block[i * 4] << 24 |
+			(uint32_t)block[i * 4 + 1] << 16 |
+			(uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	for (; i < 64; i++)
+		w[i] = (ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^
+			w[i - 2] >> 10) + w[i - 7] +
+			(ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^
+			 w[i - 15] >> 3) + w[i - 16];
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void sha256_init(struct gbsim_sha256 *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->count = 0;
+}
+
+void sha256_update(struct gbsim_sha256 *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t used = ctx->count % SHA256_BLOCK_SIZE, n;
+
+	ctx->count += len;
+
+	/* Top up a partial block first */
+	if (used) {
+		n = SHA256_BLOCK_SIZE - used;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < SHA256_BLOCK_SIZE)
+			return;
+		sha256_block(ctx->state, ctx->buf);
+	}
+
+	for (; len >= SHA256_BLOCK_SIZE; p += SHA256_BLOCK_SIZE,
+	     len -= SHA256_BLOCK_SIZE)
+		sha256_block(ctx->state, p);
+
+	memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(struct gbsim_sha256 *ctx, uint8_t *digest)
+{
+	uint64_t bits = ctx->count * 8;
+	size_t used = ctx->count % SHA256_BLOCK_SIZE;
+	unsigned int i;
+
+	ctx->buf[used++] = 0x80;
+	if (used > SHA256_BLOCK_SIZE - 8) {
+		memset(ctx->buf + used, 0, SHA256_BLOCK_SIZE - used);
+		sha256_block(ctx->state, ctx->buf);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, SHA256_BLOCK_SIZE - 8 - used);
+	for (i = 0; i < 8; i++)
+		ctx->buf[SHA256_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+	sha256_block(ctx->state, ctx->buf);
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		digest[i] = ctx->state[i / 4] >> (24 - i % 4 * 8);
+}
+
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_table_init(void)
+{
+	unsigned int i, j;
+	uint32_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc >> 1 ^ (crc & 1 ? 0xedb88320 : 0);
+		crc32_table[0][i] = crc;
+	}
+
+	/* Table n gives the CRC of a byte followed by n zero bytes */
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32_table[j][i] = crc32_table[j - 1][i] >> 8 ^
+				crc32_table[0][crc32_table[j - 1][i] & 0xff];
+}
+
+/* Carry on the CRC32 of what came before, starting from 0 */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t lo, hi;
+
+	pthread_once(&crc32_once, crc32_table_init);
+
+	crc = ~crc;
+	for (; len >= 8; p += 8, len -= 8) {
+		lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+			    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+			(uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = crc32_table[7][lo & 0xff] ^
+			crc32_table[6][lo >> 8 & 0xff] ^
+			crc32_table[5][lo >> 16 & 0xff] ^
+			crc32_table[4][lo >> 24] ^
+			crc32_table[3][hi & 0xff] ^
+			crc32_table[2][hi >> 8 & 0xff] ^
+			crc32_table[1][hi >> 16 & 0xff] ^
+			crc32_table[0][hi >> 24];
+	}
+	while (len--)
+		crc = crc >> 8 ^ crc32_table[0][(crc ^ *p++) & 0xff];
+
+	return ~crc;
+}
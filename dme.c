@@ -0,0 +1,263 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gbsim.h"
+
+/*
+ * UniPro attributes of the interfaces, read and written by the AP with the
+ * SVC DME peer get and set requests.
+ *
+ * Each interface has its own table, seeded with what a Toshiba GP bridge
+ * reports, so that the AP identifies it and finds it booted, and keeping
+ * the values the AP sets. Attributes are keyed by their id and selector in
+ * an open addressing hash table, probed linearly and never shrunk, as
+ * attributes are never removed.
+ */
+
+/* Load factor the table grows past, in quarters */
+#define DME_LOAD_MAX		3
+#define DME_ORDER_MIN		5
+
+struct dme_attr {
+	uint32_t key;
+	uint32_t value;
+	bool used;
+};
+
+struct gbsim_dme {
+	pthread_mutex_t lock;
+	struct dme_attr *attrs;
+	unsigned int order;
+	unsigned int count;
+	uint64_t gets;
+	uint64_t sets;
+	uint64_t misses;
+};
+
+static inline uint32_t dme_key(uint16_t attr, uint16_t selector)
+{
+	return (uint32_t)attr << 16 | selector;
+}
+
+/* Multiplicative hashing, keeping the best mixed top bits */
+static inline unsigned int dme_hash(uint32_t key, unsigned int order)
+{
+	return (uint32_t)(key * 2654435761U) >> (32 - order);
+}
+
+static struct dme_attr *dme_lookup(struct dme_attr *attrs,
+				   unsigned int order, uint32_t key)
+{
+	unsigned int mask = (1U << order) - 1;
+	unsigned int i = dme_hash(key, order);
+
+	while (attrs[i].used && attrs[i].key != key)
+		i = (i + 1) & mask;
+
+	return &attrs[i];
+}
+
+static int dme_grow(struct gbsim_dme *dme)
+{
+	unsigned int order = dme->order + 1;
+	struct dme_attr *attrs, *attr;
+	unsigned int i;
+
+	attrs = calloc(1U << order, sizeof(*attrs));
+	if (!attrs)
+		return -ENOMEM;
+
+	for (i = 0; i < 1U << dme->order; i++) {
+		if (!dme->attrs[i].used)
+			continue;
+
+		attr = dme_lookup(attrs, order, dme->attrs[i].key);
+		*attr = dme->attrs[i];
+	}
+
+	free(dme->attrs);
+	dme->attrs = attrs;
+	dme->order = order;
+
+	return 0;
+}
+
+static int _dme_set(struct gbsim_dme *dme, uint32_t key, uint32_t value)
+{
+	struct dme_attr *attr;
+	int ret;
+
+	attr = dme_lookup(dme->attrs, dme->order, key);
+	if (!attr->used) {
+		if ((dme->count + 1) * 4 > DME_LOAD_MAX << dme->order) {
+			ret = dme_grow(dme);
+			if (ret)
+				return ret;
+			attr = dme_lookup(dme->attrs, dme->order, key);
+		}
+
+		attr->used = true;
+		attr->key = key;
+		dme->count++;
+	}
+	attr->value = value;
+
+	return 0;
+}
+
+int dme_get(struct gbsim_dme *dme, uint16_t attr_id, uint16_t selector,
+	    uint32_t *value)
+{
+	struct dme_attr *attr;
+	int ret = 0;
+
+	pthread_mutex_lock(&dme->lock);
+	dme->gets++;
+	attr = dme_lookup(dme->attrs, dme->order, dme_key(attr_id, selector));
+	if (attr->used) {
+		*value = attr->value;
+	} else {
+		dme->misses++;
+		ret = -ENOENT;
+	}
+	pthread_mutex_unlock(&dme->lock);
+
+	return ret;
+}
+
+int dme_set(struct gbsim_dme *dme, uint16_t attr_id, uint16_t selector,
+	    uint32_t value)
+{
+	int ret;
+
+	pthread_mutex_lock(&dme->lock);
+	dme->sets++;
+	ret = _dme_set(dme, dme_key(attr_id, selector), value);
+	pthread_mutex_unlock(&dme->lock);
+
+	return ret;
+}
+
+/*
+ * Attributes of a freshly booted bridge. Modules having a bootrom CPort
+ * are still waiting for their firmware, and report so in their init
+ * status.
+ */
+static int dme_seed(struct gbsim_dme *dme, struct gbsim_interface *intf)
+{
+	uint32_t init_status = DME_INIT_TRUSTED_SPI_BOOT_FINISHED;
+	unsigned int i;
+	int ret = 0;
+
+	if (intf->manifest)
+		for (i = 0; i < intf->manifest->cport_count; i++)
+			if (intf->manifest->cports[i].protocol ==
+			    GREYBUS_PROTOCOL_BOOTROM)
+				init_status = DME_INIT_BOOTROM_UNIPRO_BOOT_STARTED;
+
+	ret |= _dme_set(dme, dme_key(DME_DDBL1_MANUFACTURERID, 0),
+			DME_TOSHIBA_DMID);
+	ret |= _dme_set(dme, dme_key(DME_DDBL1_PRODUCTID, 0),
+			DME_TOSHIBA_ES3_GBPHY_DPID);
+	ret |= _dme_set(dme, dme_key(DME_TOSHIBA_GMP_VID, 0),
+			DME_GMP_VID);
+	ret |= _dme_set(dme, dme_key(DME_TOSHIBA_GMP_PID, 0),
+			DME_GMP_PID);
+	/* Serial numbers only need to tell the interfaces apart */
+	ret |= _dme_set(dme, dme_key(DME_TOSHIBA_GMP_SN0, 0), intf->id);
+	ret |= _dme_set(dme, dme_key(DME_TOSHIBA_GMP_SN1, 0), 0);
+	ret |= _dme_set(dme, dme_key(DME_TOSHIBA_GMP_INIT_STATUS, 0),
+			init_status << 24);
+	ret |= _dme_set(dme, dme_key(DME_T_TST_SRC_INCREMENT, 0), 0);
+
+	ret |= _dme_set(dme, dme_key(PA_CONNECTED_TX_DATA_LANES, 0),
+			UNIPRO_LANES_MAX);
+	ret |= _dme_set(dme, dme_key(PA_CONNECTED_RX_DATA_LANES, 0),
+			UNIPRO_LANES_MAX);
+	ret |= _dme_set(dme, dme_key(PA_MAX_RX_HS_GEAR, 0),
+			UNIPRO_HS_GEAR_MAX);
+	ret |= _dme_set(dme, dme_key(PA_MAX_RX_PWM_GEAR, 0),
+			UNIPRO_PWM_GEAR_MAX);
+
+	return ret ? -ENOMEM : 0;
+}
+
+struct gbsim_dme *dme_create(struct gbsim_interface *intf)
+{
+	struct gbsim_dme *dme;
+
+	dme = calloc(1, sizeof(*dme));
+	if (!dme)
+		return NULL;
+
+	pthread_mutex_init(&dme->lock, NULL);
+	dme->order = DME_ORDER_MIN;
+	dme->attrs = calloc(1U << dme->order, sizeof(*dme->attrs));
+	if (!dme->attrs || dme_seed(dme, intf)) {
+		dme_destroy(dme);
+		return NULL;
+	}
+
+	return dme;
+}
+
+void dme_destroy(struct gbsim_dme *dme)
+{
+	if (!dme)
+		return;
+
+	pthread_mutex_destroy(&dme->lock);
+	free(dme->attrs);
+	free(dme);
+}
+
+static int dme_attr_cmp(const void *a, const void *b)
+{
+	const struct dme_attr *attr_a = a, *attr_b = b;
+
+	return attr_a->key < attr_b->key ? -1 : attr_a->key > attr_b->key;
+}
+
+void dme_dump(struct gbsim_dme *dme, FILE *f)
+{
+	struct dme_attr *attrs;
+	unsigned int i, count = 0;
+
+	pthread_mutex_lock(&dme->lock);
+
+	fprintf(f, "  dme: %u attributes, %llu gets (%llu misses), %llu sets\n",
+		dme->count, (unsigned long long)dme->gets,
+		(unsigned long long)dme->misses,
+		(unsigned long long)dme->sets);
+
+	/* In attribute order, rather than hash order */
+	attrs = malloc(dme->count * sizeof(*attrs));
+	if (attrs)
+		for (i = 0; i < 1U << dme->order; i++)
+			if (dme->attrs[i].used)
+				attrs[count++] = dme->attrs[i];
+
+	pthread_mutex_unlock(&dme->lock);
+
+	if (!attrs)
+		return;
+
+	qsort(attrs, count, sizeof(*attrs), dme_attr_cmp);
+	for (i = 0; i < count; i++)
+		fprintf(f, "  dme %04x/%u: 0x%08x\n", attrs[i].key >> 16,
+			attrs[i].key & 0xffff, attrs[i].value);
+
+	free(attrs);
+}
@@ -20,6 +20,7 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <linux/usb/functionfs.h>
@@ -29,16 +30,12 @@
 
 #define FFS_PREFIX	"/dev/ffs-gbsim/"
 #define FFS_GBEMU_EP0	FFS_PREFIX"ep0"
-#define FFS_GBEMU_IN	FFS_PREFIX"ep1"
-#define FFS_GBEMU_OUT	FFS_PREFIX"ep8"
+#define FFS_GBEMU_EP	FFS_PREFIX"ep%d"
 
 #define STR_INTERFACE	"gbsim"
 
 #define NEVENT		5
 
-/* Number of bulk in and bulk out couple */
-#define NUM_BULKS		7
-
 /* vendor request APB1 log */
 #define REQUEST_LOG		0x02
 
@@ -55,20 +52,37 @@
 #define REQUEST_LATENCY_TAG_EN	0x06
 #define REQUEST_LATENCY_TAG_DIS	0x07
 
+static usbg_state *s;
+static usbg_gadget *g;
+
 int control = -ENXIO;
-int to_ap = -ENXIO;
-int from_ap = -ENXIO;
+int to_ap[NUM_BULKS] = { [0 ... NUM_BULKS - 1] = -ENXIO };
+int from_ap[NUM_BULKS] = { [0 ... NUM_BULKS - 1] = -ENXIO };
+
+static pthread_t recv_pthread[NUM_BULKS];
+static pthread_t send_pthread[NUM_BULKS];
 
-static pthread_t recv_pthread;
+/* Payload of the REQUEST_EP_MAPPING vendor request */
+struct cport_to_ep {
+	__le16 cport_id;
+	__u8 endpoint_in;
+	__u8 endpoint_out;
+} __attribute__((packed));
+
+/*
+ * Bulk in endpoint index used for each hd cport. Everything goes through the
+ * first couple until the AP asks for a different mapping.
+ */
+static uint8_t cport_ep_map[HD_CPORT_MAX];
 
 #define GBSIM_LEGACY_DESCRIPTORS
 
 /*
  * Descriptors:
  *
- * EP0 [control]	- Ch9 and SVC inbound messages
- * EP1 [bulk in]	- CPort outbound messages
- * EP2 [bulk out]	- CPort inbound messages
+ * EP0 [control]		- Ch9 and SVC inbound messages
+ * EP1-EP7 [bulk in]	- CPort outbound messages
+ * EP8-EP14 [bulk out]	- CPort inbound messages
  */
 static struct {
 	struct {
@@ -163,25 +177,80 @@ void cleanup_endpoint(int ep_fd, char *ep_name)
 		gbsim_error("%s: close \n", ep_name);
 }
 
+/*
+ * Repeatedly perform blocking reads to receive messages arriving
+ * from the AP on the bulk out endpoint given by param, and hand them
+ * over to the connection they are addressed to.
+ */
+static void *recv_thread(void *param)
+{
+	int ep = (intptr_t)param;
+	struct gbsim_message *msg;
+
+	while (1) {
+		ssize_t rsize;
+
+		msg = message_alloc();
+		if (!msg)
+			return NULL;
+
+		rsize = read(from_ap[ep], msg->data, sizeof(msg->data));
+		if (rsize < 0) {
+			gbsim_error("error %zd receiving from AP\n", rsize);
+			message_free(msg);
+			return NULL;
+		}
+
+		msg->size = rsize;
+		dispatch_message(msg);
+	}
+}
+
+static int open_endpoint(int ep_num)
+{
+	char ep_name[32];
+
+	snprintf(ep_name, sizeof(ep_name), FFS_GBEMU_EP, ep_num);
+
+	return open(ep_name, O_RDWR);
+}
+
 static int enable_endpoints(void)
 {
-	int ret;
+	int ret, i;
 
 	/* Start Bulk In/Out endpoints here */
 	gbsim_debug("Start Bulk In/Out endpoints\n");
 
-	to_ap = open(FFS_GBEMU_IN, O_RDWR);
-	if (to_ap < 0)
-		return to_ap;
+	for (i = 0; i < NUM_BULKS; i++) {
+		to_ap[i] = open_endpoint(i + 1);
+		if (to_ap[i] < 0)
+			return to_ap[i];
 
-	from_ap = open(FFS_GBEMU_OUT, O_RDWR);
-	if (from_ap < 0)
-		return from_ap;
+		from_ap[i] = open_endpoint(i + NUM_BULKS + 1);
+		if (from_ap[i] < 0)
+			return from_ap[i];
+	}
 
-	ret = pthread_create(&recv_pthread, NULL, recv_thread, NULL);
-	if (ret < 0) {
-		perror("can't create cport thread");
-		return ret;
+	/* One reader per bulk out endpoint, and one sender per bulk in with AIO */
+	for (i = 0; i < NUM_BULKS; i++) {
+		ret = pthread_create(&recv_pthread[i], NULL,
+				     aio_enabled() ? aio_recv_thread : recv_thread,
+				     (void *)(intptr_t)i);
+		if (ret) {
+			gbsim_error("can't create cport thread (%d)\n", ret);
+			return -ret;
+		}
+
+		if (!aio_enabled())
+			continue;
+
+		ret = pthread_create(&send_pthread[i], NULL, aio_send_thread,
+				     (void *)(intptr_t)i);
+		if (ret) {
+			gbsim_error("can't create cport thread (%d)\n", ret);
+			return -ret;
+		}
 	}
 
 	return 0;
@@ -189,35 +258,75 @@ static int enable_endpoints(void)
 
 static void disable_endpoints(void)
 {
+	int i;
+
 	gbsim_debug("Disable CPort endpoints\n");
 
-	if (to_ap < 0 || from_ap < 0)
+	if (to_ap[0] < 0 || from_ap[0] < 0)
 		return;
 
-	pthread_cancel(recv_pthread);
-	pthread_join(recv_pthread, NULL);
+	for (i = 0; i < NUM_BULKS; i++) {
+		pthread_cancel(recv_pthread[i]);
+		if (aio_enabled())
+			pthread_cancel(send_pthread[i]);
+	}
+	for (i = 0; i < NUM_BULKS; i++) {
+		pthread_join(recv_pthread[i], NULL);
+		if (aio_enabled())
+			pthread_join(send_pthread[i], NULL);
+	}
 
-	close(from_ap);
-	from_ap = -EINVAL;
-	close(to_ap);
-	to_ap = -EINVAL;
+	for (i = 0; i < NUM_BULKS; i++) {
+		close(from_ap[i]);
+		from_ap[i] = -EINVAL;
+		close(to_ap[i]);
+		to_ap[i] = -EINVAL;
+	}
 }
 
-static int dump_control_msg(const struct usb_ctrlrequest *setup)
+int cport_to_ep(uint16_t hd_cport_id)
 {
-	uint8_t buf[256];
-	int count, i;
+	if (hd_cport_id >= HD_CPORT_MAX)
+		return 0;
+
+	return cport_ep_map[hd_cport_id];
+}
+
+static void map_cport_to_ep(struct cport_to_ep *map, int count)
+{
+	uint16_t cport_id;
+	int ep;
+
+	if (count < sizeof(*map)) {
+		gbsim_error("short ep_mapping request (%d)\n", count);
+		return;
+	}
+
+	cport_id = le16toh(map->cport_id);
+	ep = (map->endpoint_in & USB_ENDPOINT_NUMBER_MASK) - 1;
+
+	if (cport_id >= HD_CPORT_MAX || ep < 0 || ep >= NUM_BULKS) {
+		gbsim_error("invalid ep_mapping cport %hu ep_in %02x ep_out %02x\n",
+			    cport_id, map->endpoint_in, map->endpoint_out);
+		return;
+	}
+
+	cport_ep_map[cport_id] = ep;
+	gbsim_debug("ep_mapping cport %hu -> bulk couple %d\n", cport_id, ep);
+}
+
+static int dump_control_msg(const struct usb_ctrlrequest *setup, uint8_t *buf)
+{
+	int count;
 
 	if ((count = read(control, buf, setup->wLength)) < 0) {
 		perror("Message data not present\n");
 		return 0;
 	}
 
-	if (verbose) {
+	if (gbsim_tracing()) {
 		gbsim_debug("AP->SVC message:\n");
-		for (i = 0; i < count; i++)
-			fprintf(stdout, "%02x ", buf[i]);
-		fprintf(stdout, "\n");
+		gbsim_dump(buf, count);
 	}
 
 	return count;
@@ -225,10 +334,11 @@ static int dump_control_msg(const struct usb_ctrlrequest *setup)
 
 static void handle_setup(const struct usb_ctrlrequest *setup)
 {
+	uint8_t buf[256];
 	uint16_t count;
 	int ret;
 
-	if (verbose) {
+	if (gbsim_tracing()) {
 		gbsim_debug("AP->AP Bridge setup message:\n");
 		gbsim_debug("  bRequestType = %02x\n", setup->bRequestType);
 		gbsim_debug("  bRequest     = %02x\n", setup->bRequest);
@@ -247,8 +357,8 @@ static void handle_setup(const struct usb_ctrlrequest *setup)
 		gbsim_debug("log request, nothing to do\n");
 		break;
 	case REQUEST_EP_MAPPING:
-		dump_control_msg(setup);
-		gbsim_debug("ep_mapping request, nothing to do\n");
+		ret = dump_control_msg(setup, buf);
+		map_cport_to_ep((struct cport_to_ep *)buf, ret);
 		break;
 	case REQUEST_CPORT_COUNT:
 		count = htole16(16);
@@ -267,19 +377,21 @@ static void handle_setup(const struct usb_ctrlrequest *setup)
 
 		break;
 	case REQUEST_RESET_CPORT:
-		dump_control_msg(setup);
+		dump_control_msg(setup, buf);
 		gbsim_debug("reset_cport request for cport: %04x\n",
 			    le16toh(setup->wValue));
 		break;
 	case REQUEST_LATENCY_TAG_EN:
-		dump_control_msg(setup);
+		dump_control_msg(setup, buf);
 		gbsim_debug("latency_tag_en request for cport: %04x\n",
 			    le16toh(setup->wValue));
+		latency_tag_enable(le16toh(setup->wValue), true);
 		break;
 	case REQUEST_LATENCY_TAG_DIS:
-		dump_control_msg(setup);
+		dump_control_msg(setup, buf);
 		gbsim_debug("latency_tag_dis request for cport: %04x\n",
 			    le16toh(setup->wValue));
+		latency_tag_enable(le16toh(setup->wValue), false);
 		break;
 	default:
 		gbsim_error("Invalid request type %02x\n", setup->bRequest);
@@ -325,6 +437,13 @@ static int read_control(void)
 			break;
 		case FUNCTIONFS_DISABLE:
 			disable_endpoints();
+			/*
+			 * The next AP starts from a bare endo, with every
+			 * cport on the first bulk couple
+			 */
+			connections_reset();
+			interfaces_reset();
+			memset(cport_ep_map, 0, sizeof(cport_ep_map));
 			break;
 		case FUNCTIONFS_SETUP:
 			handle_setup(&event[i].u.setup);
@@ -407,22 +526,29 @@ static void functionfs_init_gb(void)
 	return;
 }
 
-int functionfs_loop(void)
+static int functionfs_loop(void)
 {
-	struct pollfd ep_poll[1];
+	struct pollfd ep_poll[2];
 	int ret;
 
 	do {
 		/* Always listen on control */
 		ep_poll[0].fd = control;
 		ep_poll[0].events = POLLIN | POLLHUP;
+		ep_poll[1].fd = exit_fd;
+		ep_poll[1].events = POLLIN;
 
-		ret = poll(ep_poll, 1, -1);
+		ret = poll(ep_poll, 2, -1);
 		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
 			perror("poll");
 			break;
 		}
 
+		if (ep_poll[1].revents & POLLIN)
+			break;
+
 		/* TODO: What to do with HUP? */
 		if (ep_poll[0].revents & POLLIN) {
 			ret = read_control();
@@ -440,21 +566,83 @@ done:
 	return ret;
 }
 
-int functionfs_init(void)
+static int functionfs_init(void)
 {
 	/* Mount functionfs */
 	mkdir(FFS_PREFIX, S_IRWXU|S_IRWXG|S_IRWXO);
 	mount("gbsim", FFS_PREFIX, "functionfs", 0, NULL);
 
+	aio_init();
+
 	/* Configure the Greybus emulator */
 	functionfs_init_gb();
 
 	return 0;
 }
 
-int functionfs_cleanup(void)
+static int functionfs_sendv(uint16_t hd_cport_id, const struct iovec *iov,
+			    int count)
 {
-	recv_thread_cleanup(NULL);
+	ssize_t nbytes;
+
+	if (aio_enabled())
+		return aio_send(cport_to_ep(hd_cport_id), iov, count);
+
+	/* A single write, the endpoint takes a whole message per transfer */
+	nbytes = writev(to_ap[cport_to_ep(hd_cport_id)], iov, count);
+	if (nbytes < 0)
+		return nbytes;
 
 	return 0;
 }
+
+static int functionfs_send(uint16_t hd_cport_id, void *buf, size_t size)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = size,
+	};
+
+	return functionfs_sendv(hd_cport_id, &iov, 1);
+}
+
+static void recv_thread_cleanup(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NUM_BULKS; i++) {
+		cleanup_endpoint(to_ap[i], "to_ap");
+		cleanup_endpoint(from_ap[i], "from_ap");
+	}
+}
+
+static int functionfs_transport_init(void)
+{
+	int ret;
+
+	ret = gadget_create(&s, &g);
+	if (ret < 0)
+		return ret;
+
+	ret = functionfs_init();
+	if (ret < 0)
+		return ret;
+
+	return gadget_enable(g);
+}
+
+static void functionfs_transport_exit(void)
+{
+	gadget_cleanup(s, g);
+	recv_thread_cleanup(NULL);
+}
+
+/* USB gadget, the AP being on the other end of dummy_hcd or a real cable */
+struct gbsim_transport functionfs_transport = {
+	.name	= "functionfs",
+	.init	= functionfs_transport_init,
+	.loop	= functionfs_loop,
+	.send	= functionfs_send,
+	.sendv	= functionfs_sendv,
+	.exit	= functionfs_transport_exit,
+};
@@ -22,15 +22,16 @@
 
 #define GB_FIRMWARE_FETCH_MAX	2000
 
-static void (*download_callback)(void);
+static void (*download_callback)(bool valid);
 
-static char *firmware_file = "ara_firmware.fw";
-static int firmware_size;
-static int firmware_read_size;
-static int firmware_fetch_size;
-static int firmware_fd;
+/* Each connection fetches a firmware of its own */
+struct fw_download {
+	struct gbsim_fw_fetch *fetch;
+	uint8_t firmware_id;
+	bool firmware_valid;
+};
 
-char *fw_download_get_operation(uint8_t type)
+static char *fw_download_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_FW_DOWNLOAD_TYPE_FIND_FIRMWARE:
@@ -51,7 +52,6 @@ int fw_download_request_send(uint8_t type, uint16_t hd_cport_id, char *tag,
 	struct op_msg msg = { };
 	struct gb_operation_msg_hdr *oph = &msg.header;
 	struct gb_fw_download_find_firmware_request *fw_download_find_req;
-	struct gb_fw_download_fetch_firmware_request *fw_download_fetch_req;
 	struct gb_fw_download_release_firmware_request *fw_download_release_req;
 	uint16_t message_size = sizeof(*oph);
 	size_t payload_size;
@@ -63,19 +63,6 @@ int fw_download_request_send(uint8_t type, uint16_t hd_cport_id, char *tag,
 
 		strcpy((char *)&fw_download_find_req->firmware_tag, tag);
 		break;
-	case GB_FW_DOWNLOAD_TYPE_FETCH_FIRMWARE:
-		payload_size = sizeof(*fw_download_fetch_req);
-		fw_download_fetch_req = &msg.fw_download_fetch_req;
-
-		/* Calculate fetch size for remaining data */
-		firmware_fetch_size = firmware_size - firmware_read_size;
-		if (firmware_fetch_size > GB_FIRMWARE_FETCH_MAX)
-			firmware_fetch_size = GB_FIRMWARE_FETCH_MAX;
-
-		fw_download_fetch_req->offset = htole32(firmware_read_size);
-		fw_download_fetch_req->size = htole32(firmware_fetch_size);
-		fw_download_fetch_req->firmware_id = firmware_id;
-		break;
 	case GB_FW_DOWNLOAD_TYPE_RELEASE_FIRMWARE:
 		payload_size = sizeof(*fw_download_release_req);
 		fw_download_release_req = &msg.fw_download_release_req;
@@ -89,141 +76,167 @@ int fw_download_request_send(uint8_t type, uint16_t hd_cport_id, char *tag,
 	}
 
 	message_size += payload_size;
-	return send_request(hd_cport_id, &msg, message_size, 1, type);
+	return send_operation(hd_cport_id, &msg, message_size, type, NULL,
+			      NULL);
 }
 
-int download_firmware(char *tag, uint16_t hd_cport_id, void (*func)(void))
+/* Request a chunk of the firmware, on behalf of the fetch */
+static int fw_download_fetch_send(uint16_t hd_cport_id, uint32_t offset,
+				  uint32_t size, uint8_t firmware_id,
+				  void *priv)
 {
-	int ret;
-
-	download_callback = func;
+	struct op_msg msg = { };
+	struct gb_fw_download_fetch_firmware_request *fw_download_fetch_req;
+	uint16_t message_size = sizeof(msg.header);
 
-	ret = fw_download_request_send(GB_FW_DOWNLOAD_TYPE_FIND_FIRMWARE,
-					hd_cport_id, tag, 0);
-	if (ret) {
-		download_callback = func;
-		gbsim_error("%s: Failed to find firmware (%d)\n", __func__, ret);
-	}
+	fw_download_fetch_req = &msg.fw_download_fetch_req;
+	fw_download_fetch_req->offset = htole32(offset);
+	fw_download_fetch_req->size = htole32(size);
+	fw_download_fetch_req->firmware_id = firmware_id;
+	message_size += sizeof(*fw_download_fetch_req);
 
-	return ret;
+	return send_operation(hd_cport_id, &msg, message_size,
+			      GB_FW_DOWNLOAD_TYPE_FETCH_FIRMWARE, priv,
+			      fw_fetch_expired);
 }
 
-static int fetch_firmware(uint16_t hd_cport_id, uint8_t firmware_id)
+/*
+ * The fetch ended, whether the firmware checks out or not the AP can let
+ * go of it. fw-mgmt is told how it went once the AP has released it.
+ */
+static void fw_download_fetch_done(uint16_t hd_cport_id, int result,
+				   void *priv)
 {
+	struct fw_download *download = priv;
 	int ret;
 
-	ret = fw_download_request_send(GB_FW_DOWNLOAD_TYPE_FETCH_FIRMWARE,
-				    hd_cport_id, NULL, firmware_id);
-	if (ret)
-		gbsim_error("%s: Failed to get firmware (%d)\n", __func__, ret);
+	download->firmware_valid = !result;
 
-	return ret;
+	ret = fw_download_request_send(GB_FW_DOWNLOAD_TYPE_RELEASE_FIRMWARE,
+				hd_cport_id, NULL, download->firmware_id);
+	if (ret) {
+		gbsim_error("%s: Failed to release firmware with id: %d (%d)\n",
+			    __func__, download->firmware_id, ret);
+		if (download_callback)
+			download_callback(false);
+	}
 }
 
-static int dump_firmware(uint8_t *data)
+int download_firmware(char *tag, uint16_t hd_cport_id, void (*func)(bool valid))
 {
 	int ret;
 
-	if (!firmware_fd) {
-		firmware_fd = open(firmware_file, O_WRONLY);
-		if (firmware_fd < 0) {
-			gbsim_debug("%s: Failed to open file %s\n", __func__,
-				    firmware_file);
-		}
-	}
-
-	/* dump data */
-	if (firmware_fd > 0) {
-		ret = write(firmware_fd, data, firmware_fetch_size);
-		gbsim_debug("%s: Dumped %d bytes of data\n", __func__, ret);
-	}
+	download_callback = func;
 
-	firmware_read_size += firmware_fetch_size;
-	if (firmware_read_size == firmware_size) {
-		if (firmware_fd > 0)
-			close(firmware_fd);
-		firmware_fd = 0;
-		firmware_size = 0;
-		firmware_read_size = 0;
-		firmware_fetch_size = 0;
+	ret = fw_download_request_send(GB_FW_DOWNLOAD_TYPE_FIND_FIRMWARE,
+					hd_cport_id, tag, 0);
+	if (ret) {
+		download_callback = func;
+		gbsim_error("%s: Failed to find firmware (%d)\n", __func__, ret);
 	}
 
-	return 0;
+	return ret;
 }
 
 /* Response from AP to Module, in response to a request Module has sent earlier */
-static int fw_download_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
+static int fw_download_handler_response(struct gbsim_connection *connection,
 				void *rbuf, size_t rsize)
 {
 	struct op_msg *op_rsp = rbuf;
 	struct gb_operation_msg_hdr *oph = &op_rsp->header;
 	struct gb_fw_download_find_firmware_response *fw_download_find_rsp;
 	struct gb_fw_download_fetch_firmware_response *fw_download_fetch_rsp;
-	int ret = 0;
-	static uint8_t firmware_id;
+	struct fw_download *download = connection->priv;
+	struct gbsim_fw_fetch *fetch = download->fetch;
+	uint16_t hd_cport_id = connection->hd_cport_id;
+	uint32_t firmware_size;
 	int type = oph->type & ~OP_RESPONSE;
 
 	/* Did the request fail? */
 	if (oph->result) {
 		gbsim_error("%s: Operation type: %s FAILED (%d)\n", __func__,
 			    fw_download_get_operation(type), oph->result);
+		if (type == GB_FW_DOWNLOAD_TYPE_FETCH_FIRMWARE)
+			fw_fetch_fail(fetch, connection->operation);
 		return oph->result;
 	}
 
 	switch (type) {
 	case GB_FW_DOWNLOAD_TYPE_FIND_FIRMWARE:
 		fw_download_find_rsp = &op_rsp->fw_download_find_rsp;
-		firmware_id = fw_download_find_rsp->firmware_id;
+		download->firmware_id = fw_download_find_rsp->firmware_id;
 		firmware_size = le32toh(fw_download_find_rsp->size);
 
-		gbsim_debug("%s: Firmware size returned is %d bytes, id: %d\n",
-			    __func__, firmware_size, firmware_id);
+		gbsim_debug("%s: Firmware size returned is %u bytes, id: %d\n",
+			    __func__, firmware_size, download->firmware_id);
 
-		ret = fetch_firmware(hd_cport_id, firmware_id);
-		break;
+		return fw_fetch_start(fetch, hd_cport_id, firmware_size,
+				      download->firmware_id);
 	case GB_FW_DOWNLOAD_TYPE_FETCH_FIRMWARE:
 		fw_download_fetch_rsp = &op_rsp->fw_download_fetch_rsp;
-		ret = dump_firmware(fw_download_fetch_rsp->data);
-		if (ret)
-			break;
-
-		if (firmware_read_size < firmware_size) {
-			ret = fetch_firmware(hd_cport_id, firmware_id);
-			break;
-		}
-
-		ret = fw_download_request_send(GB_FW_DOWNLOAD_TYPE_RELEASE_FIRMWARE,
-					hd_cport_id, NULL, firmware_id);
-		if (ret)
-			gbsim_error("%s: Failed to release firmware with id: %d (%d)\n",
-				    __func__, firmware_id, ret);
-		break;
+		return fw_fetch_receive(fetch, connection->operation,
+					fw_download_fetch_rsp->data,
+					rsize - sizeof(*oph));
 	case GB_FW_DOWNLOAD_TYPE_RELEASE_FIRMWARE:
 		gbsim_debug("%s: AP released firmware\n", __func__);
 		if (download_callback)
-			download_callback();
+			download_callback(download->firmware_valid);
 		else
 			gbsim_debug("%s: No callback to call\n", __func__);
-		break;
+		return 0;
 	default:
 		gbsim_error("%s: Response not supported (%d)\n", __func__,
 			    type);
 		return -EINVAL;
 	}
-
-	return ret;
 }
 
-int fw_download_handler(struct gbsim_connection *connection, void *rbuf,
+static int fw_download_handler(struct gbsim_connection *connection, void *rbuf,
 		    size_t rsize, void *tbuf, size_t tsize)
 {
 	struct op_msg *op = rbuf;
 	struct gb_operation_msg_hdr *oph = &op->header;
-	uint16_t cport_id = connection->cport_id;
-	uint16_t hd_cport_id = connection->hd_cport_id;
 
 	if (oph->type & OP_RESPONSE)
-		return fw_download_handler_response(cport_id, hd_cport_id, rbuf, rsize);
+		return fw_download_handler_response(connection, rbuf, rsize);
 	else
 		return -EINVAL;
 }
+
+static int fw_download_connection_init(struct gbsim_connection *connection)
+{
+	struct fw_download *download;
+
+	download = calloc(1, sizeof(*download));
+	if (!download)
+		return -ENOMEM;
+
+	download->fetch = fw_fetch_create("fw-download", GB_FIRMWARE_FETCH_MAX,
+					  fw_download_fetch_send,
+					  fw_download_fetch_done, download);
+	if (!download->fetch) {
+		free(download);
+		return -ENOMEM;
+	}
+	connection->priv = download;
+
+	return 0;
+}
+
+static void fw_download_connection_exit(struct gbsim_connection *connection)
+{
+	struct fw_download *download = connection->priv;
+
+	fw_fetch_destroy(download->fetch);
+	free(download);
+}
+
+static struct gbsim_protocol fw_download_protocol = {
+	.id		= GREYBUS_PROTOCOL_FW_DOWNLOAD,
+	.name		= "fw-download",
+	.handler	= fw_download_handler,
+	.get_operation	= fw_download_get_operation,
+	.connection_init = fw_download_connection_init,
+	.connection_exit = fw_download_connection_exit,
+};
+GBSIM_PROTOCOL(fw_download_protocol);
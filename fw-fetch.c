@@ -0,0 +1,599 @@
+/*
+ * Greybus Simulator: windowed firmware fetch
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * Firmware fetched from the AP chunk by chunk, as the bootrom and the
+ * firmware download protocols do.
+ *
+ * Up to a window of chunks are requested at once, each at an offset of its
+ * own, and every response lets the next chunk be requested, so that the AP
+ * always has requests to serve. The responses may come back in any order.
+ * The chunk a response carries is told by the operation it completes,
+ * which points at its slot in the window.
+ *
+ * The end of the fetch, whether the image checks out, doesn't or the fetch
+ * failed, is reported to the protocol through its done callback, which
+ * lets the AP know.
+ *
+ * Chunks are copied straight to their offset in the image, which is kept
+ * in memory, or in a file mapped in full before the first chunk is
+ * requested, so that landing a chunk never waits for the disk. The image
+ * is digested as soon as all the chunks before it have landed, and the
+ * digests checked against the expected ones once the whole image is in.
+ * A file is only renamed into place once it has been checked.
+ *
+ * The fetch is set with -F, as a comma separated list of settings:
+ *
+ *   window=<n>		chunks requested at once (default 1)
+ *   file=<path>	file the image is written to (default: memory only)
+ *   sha256=<hex>	expected SHA-256 digest of the image
+ *   crc32=<hex>	expected CRC32 of the image
+ *
+ * Each connection has its own fetch, whose handler runs one response at a
+ * time, but the requests may be sent from elsewhere, so the fetch is
+ * locked all the same.
+ */
+
+static unsigned int fw_fetch_window = 1;
+static char *fw_fetch_file;
+static bool fw_fetch_check_sha256;
+static uint8_t fw_fetch_sha256[SHA256_DIGEST_SIZE];
+static bool fw_fetch_check_crc32;
+static uint32_t fw_fetch_crc32;
+
+struct fw_fetch_chunk {
+	struct gbsim_fw_fetch *fetch;
+	uint32_t offset;
+	uint32_t size;
+	bool busy;
+};
+
+struct gbsim_fw_fetch {
+	pthread_mutex_t lock;
+	const char *name;
+	uint32_t chunk_max;
+	int (*request)(uint16_t hd_cport_id, uint32_t offset, uint32_t size,
+		       uint8_t firmware_id, void *priv);
+	void (*done)(uint16_t hd_cport_id, int result, void *priv);
+	void *priv;
+
+	uint16_t hd_cport_id;
+	uint8_t firmware_id;
+	bool active;
+	bool failed;
+	uint32_t size;
+	/* Offset of the next chunk to request */
+	uint32_t next;
+	uint32_t received;
+	unsigned int inflight;
+	unsigned int requests;
+	uint64_t start_ns;
+	struct fw_fetch_chunk chunks[FW_FETCH_WINDOW_MAX];
+
+	/* The image, and the file it is mapped from until checked, if any */
+	uint8_t *image;
+	char *tmp_path;
+	/* Chunks landed, and how many of them have been digested, in order */
+	bool *landed;
+	uint32_t digested;
+	struct gbsim_sha256 sha256;
+	uint32_t crc32;
+};
+
+static int fw_fetch_parse_hex(const char *hex, uint8_t *buf, size_t len)
+{
+	unsigned int byte;
+	size_t i;
+
+	if (strlen(hex) != len * 2)
+		return -EINVAL;
+
+	for (i = 0; i < len; i++) {
+		if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+			return -EINVAL;
+		buf[i] = byte;
+	}
+
+	return 0;
+}
+
+int fw_fetch_parse(const char *spec)
+{
+	char *settings, *setting, *value, *end, *save;
+	unsigned long n;
+	int ret = 0;
+
+	settings = strdup(spec);
+	if (!settings)
+		return -ENOMEM;
+
+	for (setting = strtok_r(settings, ",", &save); setting && !ret;
+	     setting = strtok_r(NULL, ",", &save)) {
+		value = strchr(setting, '=');
+		if (!value || !value[1]) {
+			ret = -EINVAL;
+			break;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(setting, "window")) {
+			n = strtoul(value, &end, 0);
+			if (*end || !n || n > FW_FETCH_WINDOW_MAX)
+				ret = -EINVAL;
+			else
+				fw_fetch_window = n;
+		} else if (!strcmp(setting, "file")) {
+			free(fw_fetch_file);
+			fw_fetch_file = strdup(value);
+			if (!fw_fetch_file)
+				ret = -ENOMEM;
+		} else if (!strcmp(setting, "sha256")) {
+			ret = fw_fetch_parse_hex(value, fw_fetch_sha256,
+						 sizeof(fw_fetch_sha256));
+			fw_fetch_check_sha256 = !ret;
+		} else if (!strcmp(setting, "crc32")) {
+			n = strtoul(value, &end, 16);
+			if (*end || n > UINT32_MAX)
+				ret = -EINVAL;
+			fw_fetch_crc32 = n;
+			fw_fetch_check_crc32 = !ret;
+		} else {
+			ret = -EINVAL;
+		}
+	}
+	free(settings);
+
+	return ret;
+}
+
+/*
+ * request sends the request for a chunk, with the chunk as its priv. done
+ * is called with 0 once the firmware is in and checks out, -EBADMSG if it
+ * doesn't match the expected digests, or -EIO if the fetch failed.
+ */
+struct gbsim_fw_fetch *fw_fetch_create(const char *name, uint32_t chunk_max,
+				       int (*request)(uint16_t hd_cport_id,
+						      uint32_t offset,
+						      uint32_t size,
+						      uint8_t firmware_id,
+						      void *priv),
+				       void (*done)(uint16_t hd_cport_id,
+						    int result, void *priv),
+				       void *priv)
+{
+	struct gbsim_fw_fetch *fetch;
+	unsigned int i;
+
+	fetch = calloc(1, sizeof(*fetch));
+	if (!fetch)
+		return NULL;
+
+	pthread_mutex_init(&fetch->lock, NULL);
+	fetch->name = name;
+	fetch->chunk_max = chunk_max;
+	fetch->request = request;
+	fetch->done = done;
+	fetch->priv = priv;
+	for (i = 0; i < FW_FETCH_WINDOW_MAX; i++)
+		fetch->chunks[i].fetch = fetch;
+
+	return fetch;
+}
+
+/*
+ * Map the image. A file is written as a temporary one next to it, so that
+ * fetches running at once don't step on each other, and a broken image
+ * never replaces a good one.
+ */
+static int fw_fetch_image_map(struct gbsim_fw_fetch *fetch)
+{
+	int fd, ret;
+
+	if (!fw_fetch_file) {
+		if (!fetch->size)
+			return 0;
+
+		fetch->image = mmap(NULL, fetch->size, PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (fetch->image == MAP_FAILED) {
+			fetch->image = NULL;
+			return -errno;
+		}
+		return 0;
+	}
+
+	fetch->tmp_path = malloc(strlen(fw_fetch_file) + sizeof(".XXXXXX"));
+	if (!fetch->tmp_path)
+		return -ENOMEM;
+	sprintf(fetch->tmp_path, "%s.XXXXXX", fw_fetch_file);
+
+	fd = mkstemp(fetch->tmp_path);
+	if (fd < 0) {
+		ret = -errno;
+		goto err_free;
+	}
+
+	/* Fall back to a sparse file where blocks can't be preallocated */
+	if (posix_fallocate(fd, 0, fetch->size) && ftruncate(fd, fetch->size)) {
+		ret = -errno;
+		goto err_close;
+	}
+
+	if (fetch->size) {
+		fetch->image = mmap(NULL, fetch->size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, fd, 0);
+		if (fetch->image == MAP_FAILED) {
+			fetch->image = NULL;
+			ret = -errno;
+			goto err_close;
+		}
+	}
+	close(fd);
+
+	return 0;
+
+err_close:
+	close(fd);
+	unlink(fetch->tmp_path);
+err_free:
+	free(fetch->tmp_path);
+	fetch->tmp_path = NULL;
+
+	return ret;
+}
+
+/* Unmap the image, putting its file in place if it is to be kept */
+static void fw_fetch_image_unmap(struct gbsim_fw_fetch *fetch, bool keep)
+{
+	if (fetch->image)
+		munmap(fetch->image, fetch->size);
+	fetch->image = NULL;
+
+	free(fetch->landed);
+	fetch->landed = NULL;
+
+	if (!fetch->tmp_path)
+		return;
+
+	if (!keep)
+		unlink(fetch->tmp_path);
+	else if (rename(fetch->tmp_path, fw_fetch_file))
+		gbsim_error("%s: failed to rename %s to %s (%d)\n", fetch->name,
+			    fetch->tmp_path, fw_fetch_file, -errno);
+
+	free(fetch->tmp_path);
+	fetch->tmp_path = NULL;
+}
+
+void fw_fetch_destroy(struct gbsim_fw_fetch *fetch)
+{
+	if (!fetch)
+		return;
+
+	fw_fetch_image_unmap(fetch, false);
+	pthread_mutex_destroy(&fetch->lock);
+	free(fetch);
+}
+
+/*
+ * Must be called with the fetch lock held, once nothing is in flight.
+ * Returns 1 if the image was fetched whole and matches the expected
+ * digests, -EBADMSG if it doesn't match.
+ */
+static int _fw_fetch_end(struct gbsim_fw_fetch *fetch)
+{
+	uint64_t ns = gbsim_now_ns() - fetch->start_ns;
+	uint8_t sha256[SHA256_DIGEST_SIZE];
+	char hex[SHA256_DIGEST_SIZE * 2 + 1];
+	bool valid;
+	int i;
+
+	fetch->active = false;
+
+	if (fetch->failed) {
+		fw_fetch_image_unmap(fetch, false);
+		gbsim_error("%s: firmware fetch failed after %u of %u bytes\n",
+			    fetch->name, fetch->received, fetch->size);
+		return -EIO;
+	}
+
+	sha256_final(&fetch->sha256, sha256);
+	valid = (!fw_fetch_check_sha256 ||
+		 !memcmp(sha256, fw_fetch_sha256, sizeof(sha256))) &&
+		(!fw_fetch_check_crc32 || fetch->crc32 == fw_fetch_crc32);
+	fw_fetch_image_unmap(fetch, valid);
+
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		sprintf(hex + i * 2, "%02x", sha256[i]);
+
+	gbsim_info("%s: fetched %u bytes of firmware in %llu us, %llu KiB/s (%u requests, window %u)\n",
+		   fetch->name, fetch->size, (unsigned long long)ns / 1000,
+		   ns ? (unsigned long long)fetch->size * 1000000000ULL / ns /
+			1024 : 0ULL,
+		   fetch->requests, fw_fetch_window);
+	gbsim_info("%s: firmware sha256 %s crc32 %08x\n", fetch->name, hex,
+		   fetch->crc32);
+
+	if (!valid) {
+		gbsim_error("%s: firmware doesn't match the expected digest\n",
+			    fetch->name);
+		return -EBADMSG;
+	}
+
+	return 1;
+}
+
+/*
+ * Give a chunk's slot back, ending the fetch once it has failed. Returns
+ * what _fw_fetch_end() does if it ended, 0 otherwise.
+ */
+static int _fw_fetch_chunk_put(struct gbsim_fw_fetch *fetch,
+			       struct fw_fetch_chunk *chunk)
+{
+	chunk->busy = false;
+	fetch->inflight--;
+
+	if (fetch->failed && !fetch->inflight)
+		return _fw_fetch_end(fetch);
+
+	return 0;
+}
+
+/*
+ * Report the end of the fetch to the protocol, given what _fw_fetch_end()
+ * returned. Called without the fetch lock, as the protocol sends requests.
+ */
+static void fw_fetch_done(struct gbsim_fw_fetch *fetch, int ret)
+{
+	fetch->done(fetch->hd_cport_id, ret > 0 ? 0 : ret, fetch->priv);
+}
+
+/* Digest the chunks that have landed right after those already digested */
+static void _fw_fetch_digest(struct gbsim_fw_fetch *fetch)
+{
+	uint64_t offset;
+	uint32_t size;
+
+	for (;;) {
+		offset = (uint64_t)fetch->digested * fetch->chunk_max;
+		if (offset >= fetch->size || !fetch->landed[fetch->digested])
+			break;
+
+		size = fetch->size - offset;
+		if (size > fetch->chunk_max)
+			size = fetch->chunk_max;
+
+		sha256_update(&fetch->sha256, fetch->image + offset, size);
+		fetch->crc32 = crc32_update(fetch->crc32, fetch->image + offset,
+					    size);
+		fetch->digested++;
+	}
+}
+
+/* Request chunks until the window is full or all have been requested */
+static int fw_fetch_fill(struct gbsim_fw_fetch *fetch)
+{
+	struct fw_fetch_chunk *chunk;
+	uint32_t offset, size;
+	uint16_t hd_cport_id;
+	uint8_t firmware_id;
+	unsigned int i;
+	int ret, end;
+
+	for (;;) {
+		pthread_mutex_lock(&fetch->lock);
+		if (fetch->failed || fetch->next == fetch->size ||
+		    fetch->inflight >= fw_fetch_window) {
+			pthread_mutex_unlock(&fetch->lock);
+			return 0;
+		}
+
+		/* There is a free slot as long as the window isn't full */
+		for (i = 0; fetch->chunks[i].busy; i++)
+			;
+		chunk = &fetch->chunks[i];
+		chunk->offset = fetch->next;
+		chunk->size = fetch->size - fetch->next;
+		if (chunk->size > fetch->chunk_max)
+			chunk->size = fetch->chunk_max;
+		chunk->busy = true;
+		fetch->next += chunk->size;
+		fetch->inflight++;
+		fetch->requests++;
+
+		offset = chunk->offset;
+		size = chunk->size;
+		hd_cport_id = fetch->hd_cport_id;
+		firmware_id = fetch->firmware_id;
+		pthread_mutex_unlock(&fetch->lock);
+
+		ret = fetch->request(hd_cport_id, offset, size, firmware_id,
+				     chunk);
+		if (ret) {
+			gbsim_error("%s: failed to request %u bytes at %u (%d)\n",
+				    fetch->name, size, offset, ret);
+			pthread_mutex_lock(&fetch->lock);
+			fetch->failed = true;
+			end = _fw_fetch_chunk_put(fetch, chunk);
+			pthread_mutex_unlock(&fetch->lock);
+			if (end)
+				fw_fetch_done(fetch, end);
+			return ret;
+		}
+	}
+}
+
+/*
+ * Start fetching the firmware of the given size. Returns 0 once under
+ * way, the end of the fetch is reported to the done callback.
+ */
+int fw_fetch_start(struct gbsim_fw_fetch *fetch, uint16_t hd_cport_id,
+		   uint32_t size, uint8_t firmware_id)
+{
+	uint32_t chunk_count = size / fetch->chunk_max + 1;
+	int ret;
+
+	pthread_mutex_lock(&fetch->lock);
+	if (fetch->active) {
+		pthread_mutex_unlock(&fetch->lock);
+		gbsim_error("%s: firmware fetch already in progress\n",
+			    fetch->name);
+		return -EBUSY;
+	}
+
+	fetch->hd_cport_id = hd_cport_id;
+	fetch->firmware_id = firmware_id;
+	fetch->failed = false;
+	fetch->size = size;
+	fetch->next = 0;
+	fetch->received = 0;
+	fetch->requests = 0;
+	fetch->digested = 0;
+	sha256_init(&fetch->sha256);
+	fetch->crc32 = 0;
+
+	fetch->landed = calloc(chunk_count, sizeof(*fetch->landed));
+	if (!fetch->landed) {
+		pthread_mutex_unlock(&fetch->lock);
+		return -ENOMEM;
+	}
+
+	ret = fw_fetch_image_map(fetch);
+	if (ret) {
+		gbsim_error("%s: failed to map a %u bytes firmware image (%d)\n",
+			    fetch->name, size, ret);
+		fw_fetch_image_unmap(fetch, false);
+		pthread_mutex_unlock(&fetch->lock);
+		return ret;
+	}
+
+	fetch->active = true;
+	fetch->start_ns = gbsim_now_ns();
+	if (!size) {
+		ret = _fw_fetch_end(fetch);
+		pthread_mutex_unlock(&fetch->lock);
+		fw_fetch_done(fetch, ret);
+		return 0;
+	}
+	pthread_mutex_unlock(&fetch->lock);
+
+	return fw_fetch_fill(fetch);
+}
+
+static struct fw_fetch_chunk *fw_fetch_chunk(struct gbsim_fw_fetch *fetch,
+					     struct gbsim_operation *operation)
+{
+	struct fw_fetch_chunk *chunk = operation ? operation->priv : NULL;
+
+	if (!chunk || chunk < fetch->chunks ||
+	    chunk >= fetch->chunks + FW_FETCH_WINDOW_MAX) {
+		gbsim_error("%s: response to no firmware fetch request\n",
+			    fetch->name);
+		return NULL;
+	}
+
+	return chunk;
+}
+
+/*
+ * Take in the chunk the response to a fetch request carries, and request
+ * the next one, or end the fetch once the whole firmware is in.
+ */
+int fw_fetch_receive(struct gbsim_fw_fetch *fetch,
+		     struct gbsim_operation *operation, const void *data,
+		     size_t size)
+{
+	struct fw_fetch_chunk *chunk;
+	int ret = 0;
+
+	chunk = fw_fetch_chunk(fetch, operation);
+	if (!chunk)
+		return -EINVAL;
+
+	pthread_mutex_lock(&fetch->lock);
+	if (size < chunk->size) {
+		gbsim_error("%s: short firmware chunk at %u: %zu of %u bytes\n",
+			    fetch->name, chunk->offset, size, chunk->size);
+		fetch->failed = true;
+		ret = _fw_fetch_chunk_put(fetch, chunk);
+		pthread_mutex_unlock(&fetch->lock);
+		if (ret)
+			fw_fetch_done(fetch, ret);
+		return -EPROTO;
+	}
+
+	/* Chunks of a failed fetch still in flight are dropped */
+	if (fetch->failed) {
+		ret = _fw_fetch_chunk_put(fetch, chunk);
+		pthread_mutex_unlock(&fetch->lock);
+		if (ret)
+			fw_fetch_done(fetch, ret);
+		return 0;
+	}
+
+	memcpy(fetch->image + chunk->offset, data, chunk->size);
+	fetch->landed[chunk->offset / fetch->chunk_max] = true;
+	_fw_fetch_digest(fetch);
+
+	fetch->received += chunk->size;
+	_fw_fetch_chunk_put(fetch, chunk);
+	if (fetch->received == fetch->size)
+		ret = _fw_fetch_end(fetch);
+	pthread_mutex_unlock(&fetch->lock);
+
+	if (ret) {
+		fw_fetch_done(fetch, ret);
+		return 0;
+	}
+
+	return fw_fetch_fill(fetch);
+}
+
+/* The AP failed a fetch request, give up on the firmware */
+void fw_fetch_fail(struct gbsim_fw_fetch *fetch,
+		   struct gbsim_operation *operation)
+{
+	struct fw_fetch_chunk *chunk;
+	int ret;
+
+	chunk = fw_fetch_chunk(fetch, operation);
+	if (!chunk)
+		return;
+
+	pthread_mutex_lock(&fetch->lock);
+	fetch->failed = true;
+	ret = _fw_fetch_chunk_put(fetch, chunk);
+	pthread_mutex_unlock(&fetch->lock);
+
+	if (ret)
+		fw_fetch_done(fetch, ret);
+}
+
+/*
+ * The AP never answered a fetch request, give up on the firmware as if it
+ * had failed the request. Passed to send_operation() with the request.
+ */
+void fw_fetch_expired(struct gbsim_operation *operation)
+{
+	struct fw_fetch_chunk *chunk = operation->priv;
+
+	fw_fetch_fail(chunk->fetch, operation);
+}
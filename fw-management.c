@@ -20,7 +20,7 @@
 
 #include "gbsim.h"
 
-char *fw_mgmt_get_operation(uint8_t type)
+static char *fw_mgmt_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_FW_MGMT_TYPE_INTERFACE_FW_VERSION:
@@ -44,8 +44,9 @@ static uint8_t fw_down_type;
 static uint16_t fw_mgmt_hd_cport_id;
 static uint16_t fw_down_request_id;
 
-/* Request from Module to AP */
-int fw_mgmt_request_send(uint8_t type, uint16_t hd_cport_id, uint8_t request_id)
+/* Request from Module to AP, reporting whether the firmware checks out */
+int fw_mgmt_request_send(uint8_t type, uint16_t hd_cport_id, uint8_t request_id,
+			 bool valid)
 {
 	struct op_msg msg = { };
 	struct gb_operation_msg_hdr *oph = &msg.header;
@@ -60,7 +61,9 @@ int fw_mgmt_request_send(uint8_t type, uint16_t hd_cport_id, uint8_t request_id)
 		fw_mgmt_loaded_fw_req = &msg.fw_mgmt_loaded_fw_req;
 
 		fw_mgmt_loaded_fw_req->request_id = request_id;
-		fw_mgmt_loaded_fw_req->status = GB_FW_LOAD_STATUS_VALIDATED;
+		fw_mgmt_loaded_fw_req->status = valid ?
+			GB_FW_LOAD_STATUS_VALIDATED :
+			GB_FW_LOAD_STATUS_VALIDATION_FAILED;
 		fw_mgmt_loaded_fw_req->major = htole16(2);
 		fw_mgmt_loaded_fw_req->minor = htole16(1);
 		break;
@@ -69,7 +72,9 @@ int fw_mgmt_request_send(uint8_t type, uint16_t hd_cport_id, uint8_t request_id)
 		fw_mgmt_backend_fw_updated_req = &msg.fw_mgmt_backend_fw_updated_req;
 
 		fw_mgmt_backend_fw_updated_req->request_id = request_id;
-		fw_mgmt_backend_fw_updated_req->status = GB_FW_BACKEND_FW_STATUS_SUCCESS;
+		fw_mgmt_backend_fw_updated_req->status = valid ?
+			GB_FW_BACKEND_FW_STATUS_SUCCESS :
+			GB_FW_BACKEND_FW_STATUS_FAIL_FETCH;
 		break;
 	default:
 		gbsim_error("firmware operation type %02x not supported\n",
@@ -78,14 +83,17 @@ int fw_mgmt_request_send(uint8_t type, uint16_t hd_cport_id, uint8_t request_id)
 	}
 
 	message_size += payload_size;
-	return send_request(hd_cport_id, &msg, message_size, 1, type);
+	return send_operation(hd_cport_id, &msg, message_size, type, NULL,
+			      NULL);
 }
 
-static void download_callback(void)
+static void download_callback(bool valid)
 {
-	gbsim_debug("Firmware Downloaded: (type=%u cport-id=%u request-id=%u)\n",
-			fw_down_type, fw_mgmt_hd_cport_id, fw_down_request_id);
-	fw_mgmt_request_send(fw_down_type, fw_mgmt_hd_cport_id, fw_down_request_id);
+	gbsim_debug("Firmware Downloaded: (type=%u cport-id=%u request-id=%u valid=%d)\n",
+			fw_down_type, fw_mgmt_hd_cport_id, fw_down_request_id,
+			valid);
+	fw_mgmt_request_send(fw_down_type, fw_mgmt_hd_cport_id, fw_down_request_id,
+			     valid);
 }
 
 /* Request from AP to Module */
@@ -178,7 +186,8 @@ static int fw_mgmt_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 	switch (oph->type) {
 	case GB_FW_MGMT_TYPE_LOAD_AND_VALIDATE_FW:
 		if (fw_mgmt_load_validate_fw_req->load_method != GB_FW_LOAD_METHOD_UNIPRO) {
-			fw_mgmt_request_send(GB_FW_MGMT_TYPE_LOADED_FW, hd_cport_id, request_id);
+			fw_mgmt_request_send(GB_FW_MGMT_TYPE_LOADED_FW, hd_cport_id,
+					     request_id, true);
 			return 0;
 		}
 		/* Fallback */
@@ -216,7 +225,7 @@ static int fw_mgmt_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 	return 0;
 }
 
-int fw_mgmt_handler(struct gbsim_connection *connection, void *rbuf,
+static int fw_mgmt_handler(struct gbsim_connection *connection, void *rbuf,
 		    size_t rsize, void *tbuf, size_t tsize)
 {
 	struct op_msg *op = rbuf;
@@ -230,3 +239,11 @@ int fw_mgmt_handler(struct gbsim_connection *connection, void *rbuf,
 		return fw_mgmt_handler_request(cport_id, hd_cport_id, rbuf, rsize,
 					   tbuf, tsize);
 }
+
+static struct gbsim_protocol fw_mgmt_protocol = {
+	.id		= GREYBUS_PROTOCOL_FW_MANAGEMENT,
+	.name		= "fw-mgmt",
+	.handler	= fw_mgmt_handler,
+	.get_operation	= fw_mgmt_get_operation,
+};
+GBSIM_PROTOCOL(fw_mgmt_protocol);
@@ -13,9 +13,15 @@
 
 #define __packed  __attribute__((__packed__))
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <endian.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <usbg/usbg.h>
 
 #ifndef BIT
@@ -34,7 +40,16 @@ extern int i2c_adapter;
 extern int uart_portno;
 extern int uart_count;
 extern int verbose;
+extern int worker_count;
+extern char *capture_file;
+extern char *replay_file;
+extern int replay_fast;
+extern char *socket_address;
+extern char *stats_file;
 extern char *hotplug_basedir;
+extern int exit_fd;
+
+bool exit_requested(void);
 
 /* Matches up with the Greybus Protocol specification document */
 #define GB_REQUEST_TYPE_PROTOCOL_VERSION 0x01
@@ -45,24 +60,172 @@ extern char *hotplug_basedir;
 #define ENDO_ID 0x4755
 #define AP_INTF_ID 0x5
 
+/* The kernel gives out a handful of device ids, hence of interfaces */
+#define INTF_ID_MAX		32
+
+/* Number of bulk in and bulk out couple */
+#define NUM_BULKS		7
+
+/* The hd cport id travels in a single header pad byte */
+#define HD_CPORT_MAX		256
+
+/* Protocol ids are a single byte on the wire */
+#define PROTOCOL_MAX		256
+
 extern int control;
-extern int to_ap;
-extern int from_ap;
+extern int to_ap[NUM_BULKS];
+extern int from_ap[NUM_BULKS];
+
+#define ES1_MSG_SIZE	(2 * 1024)
+
+/* A message exchanged with the AP on a bulk endpoint */
+struct gbsim_message {
+	TAILQ_ENTRY(gbsim_message) mnode;
+	uint64_t rx_ns;
+	size_t size;
+	char data[ES1_MSG_SIZE];
+};
+
+/* A request sent to the AP, waiting for its response */
+struct gbsim_operation {
+	TAILQ_ENTRY(gbsim_operation) onode;
+	uint16_t id;
+	uint8_t type;
+	uint64_t sent_ns;
+	/* Whatever the sender needs to handle the response */
+	void *priv;
+	/* Called instead of the response handler if the AP doesn't respond */
+	void (*expired)(struct gbsim_operation *operation);
+};
 
 struct gbsim_connection {
 	TAILQ_ENTRY(gbsim_connection) cnode;
 	uint16_t cport_id;
 	uint16_t hd_cport_id;
 	int protocol;
+	/* Interface of the CPort, NULL for the AP's own SVC CPort */
+	struct gbsim_interface *intf;
+	void *priv;
+
+	/* Dispatch state, protected by the connection lock */
+	TAILQ_HEAD(mhead, gbsim_message) messages;
+	TAILQ_ENTRY(gbsim_connection) wnode;
+	bool queued;
+	bool busy;
+	bool released;
+
+	/* Requests sent to the AP, oldest first, protected by the lock too */
+	TAILQ_HEAD(ohead, gbsim_operation) operations;
+	unsigned int operation_count;
+	uint16_t operation_id;
+	/* Operation the response being handled completes, NULL if none */
+	struct gbsim_operation *operation;
 };
 
-struct gbsim_interface {
-	void *manifest;
-	size_t manifest_size;
-	TAILQ_HEAD(chead, gbsim_connection) connections;
+/* A CPort described by an interface manifest */
+struct gbsim_cport {
+	uint16_t id;
+	uint8_t protocol;
+};
+
+/* A parsed manifest, shared by the interfaces it describes */
+struct gbsim_manifest {
+	TAILQ_ENTRY(gbsim_manifest) node;
+	char *path;
+	struct timespec mtime;
+	void *data;
+	size_t size;
+	size_t file_size;
+	struct gbsim_cport *cports;
+	unsigned int cport_count;
+	unsigned int refcount;
+};
+
+/* UniPro links of the bridges */
+#define UNIPRO_LANES_MAX	2
+#define UNIPRO_HS_GEAR_MAX	3
+#define UNIPRO_PWM_GEAR_MAX	7
+
+/* Power up steps the SVC takes an interface through */
+enum unipro_step {
+	UNIPRO_STEP_VSYS,
+	UNIPRO_STEP_REFCLK,
+	UNIPRO_STEP_UNIPRO,
+	UNIPRO_STEP_ACTIVATE,
+	UNIPRO_STEP_PWRM,
+	UNIPRO_STEP_COUNT,
+};
+
+/* One direction of the UniPro link between an interface and the switch */
+struct gbsim_link {
+	uint8_t mode;
+	uint8_t gear;
+	uint8_t nlanes;
+	/* 0 when messages aren't paced */
+	uint64_t bytes_per_s;
+	/* Time the link is busy sending the queued messages until */
+	uint64_t busy_ns;
+};
+
+/* UniPro attributes */
+#define PA_ACTIVE_TX_DATA_LANES		0x1560
+#define PA_CONNECTED_TX_DATA_LANES	0x1561
+#define PA_TX_GEAR			0x1568
+#define PA_HS_SERIES			0x156a
+#define PA_PWR_MODE			0x1571
+#define PA_ACTIVE_RX_DATA_LANES		0x1580
+#define PA_CONNECTED_RX_DATA_LANES	0x1581
+#define PA_RX_GEAR			0x1583
+#define PA_MAX_RX_PWM_GEAR		0x1586
+#define PA_MAX_RX_HS_GEAR		0x1587
+#define DME_T_TST_SRC_INCREMENT		0x4083
+#define DME_DDBL1_MANUFACTURERID	0x5003
+#define DME_DDBL1_PRODUCTID		0x5004
+#define DME_TOSHIBA_GMP_VID		0x6000
+#define DME_TOSHIBA_GMP_PID		0x6001
+#define DME_TOSHIBA_GMP_SN0		0x6002
+#define DME_TOSHIBA_GMP_SN1		0x6003
+#define DME_TOSHIBA_GMP_INIT_STATUS	0x6101
+
+/* Values the AP checks the bridges for */
+#define DME_TOSHIBA_DMID		0x0126
+#define DME_TOSHIBA_ES3_GBPHY_DPID	0x1002
+#define DME_GMP_VID			0x0001
+#define DME_GMP_PID			0x0001
+#define DME_INIT_TRUSTED_SPI_BOOT_FINISHED	0x03
+#define DME_INIT_BOOTROM_UNIPRO_BOOT_STARTED	0x06
+
+/* DME configuration result codes */
+#define DME_RESULT_SUCCESS		0x00
+#define DME_RESULT_INVALID_MIB_ATTRIBUTE	0x01
+#define DME_RESULT_PEER_COMMUNICATION_FAILURE	0x08
+#define DME_RESULT_FAILURE		0x0a
+
+struct gbsim_dme;
+
+enum gbsim_interface_state {
+	GBSIM_INTF_OFF,
+	GBSIM_INTF_VSYS,
+	GBSIM_INTF_REFCLK,
+	GBSIM_INTF_UNIPRO,
+	GBSIM_INTF_ACTIVE,
 };
 
-extern struct gbsim_interface interface;
+struct gbsim_interface {
+	uint8_t id;
+	char *name;
+	struct gbsim_manifest *manifest;
+	bool removed;
+	unsigned int refcount;
+
+	/* Power state and link, only changed by the SVC requests */
+	enum gbsim_interface_state state;
+	uint8_t hs_series;
+	/* From the AP to the interface, and back */
+	struct gbsim_link tx;
+	struct gbsim_link rx;
+	struct gbsim_dme *dme;
+};
 
 /* CPorts */
 
@@ -95,11 +258,25 @@ struct op_msg {
 		struct gb_svc_route_create_request	svc_route_create_request;
 		struct gb_svc_route_destroy_request	svc_route_destroy_request;
 		struct gb_svc_pwrmon_rail_count_get_response	svc_pwrmon_rail_count_get_response;
+		struct gb_svc_pwrmon_rail_names_get_response	svc_pwrmon_rail_names_get_response;
+		struct gb_svc_pwrmon_sample_get_request		svc_pwrmon_sample_get_request;
+		struct gb_svc_pwrmon_sample_get_response	svc_pwrmon_sample_get_response;
+		struct gb_svc_pwrmon_intf_sample_get_request	svc_pwrmon_intf_sample_get_request;
+		struct gb_svc_pwrmon_intf_sample_get_response	svc_pwrmon_intf_sample_get_response;
+		struct gb_svc_intf_vsys_request		svc_intf_vsys_request;
 		struct gb_svc_intf_vsys_response	svc_intf_vsys_response;
+		struct gb_svc_intf_refclk_request	svc_intf_refclk_request;
 		struct gb_svc_intf_refclk_response	svc_intf_refclk_response;
+		struct gb_svc_intf_unipro_request	svc_intf_unipro_request;
 		struct gb_svc_intf_unipro_response	svc_intf_unipro_response;
+		struct gb_svc_intf_activate_request	svc_intf_activate_request;
 		struct gb_svc_intf_activate_response	svc_intf_activate_response;
+		struct gb_svc_intf_set_pwrm_request	svc_intf_set_pwrm_request;
 		struct gb_svc_intf_set_pwrm_response	svc_intf_set_pwrm_response;
+		struct gb_svc_timesync_enable_request	svc_timesync_enable_request;
+		struct gb_svc_timesync_authoritative_response	svc_timesync_authoritative_response;
+		struct gb_svc_timesync_wake_pins_acquire_request	svc_timesync_wake_pins_acquire_request;
+		struct gb_svc_timesync_ping_response	svc_timesync_ping_response;
 		struct gb_gpio_line_count_response	gpio_lc_rsp;
 		struct gb_gpio_activate_request		gpio_act_req;
 		struct gb_gpio_deactivate_request	gpio_deact_req;
@@ -194,113 +371,276 @@ struct op_msg {
 #define OP_RESPONSE			0x80
 
 /* debug/info/error macros */
+/*
+ * Message tracing (debug output and dumps) is runtime controlled by -v, and
+ * can be compiled out entirely with --disable-tracing for benchmark builds.
+ * Anything only computed for the trace must be done under gbsim_tracing().
+ */
+#ifdef GBSIM_NO_TRACING
+#define gbsim_tracing()		0
+#else
+#define gbsim_tracing()		(verbose)
+#endif
+
+enum gbsim_log_level {
+	GBSIM_LOG_ERROR,
+	GBSIM_LOG_INFO,
+	GBSIM_LOG_DEBUG,
+	GBSIM_LOG_DUMP,
+};
+
+void gbsim_log(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void gbsim_dump(void *data, size_t size);
+int log_init(void);
+void log_exit(void);
+
 #define gbsim_debug(fmt, ...)						\
-        do { if (verbose) { fprintf(stdout, "[D] GBSIM: " fmt,  	\
-				  ##__VA_ARGS__); fflush(stdout); } } while (0)
+        do { if (gbsim_tracing())					\
+		gbsim_log(GBSIM_LOG_DEBUG, fmt, ##__VA_ARGS__); } while (0)
 #define gbsim_info(fmt, ...)						\
-        do { fprintf(stdout, "[I] GBSIM: " fmt, ##__VA_ARGS__); fflush(stdout); } while (0)
+        gbsim_log(GBSIM_LOG_INFO, fmt, ##__VA_ARGS__)
 #define gbsim_error(fmt, ...)						\
-        do { fprintf(stderr, "[E] GBSIM: " fmt, ##__VA_ARGS__); fflush(stderr); } while (0)
+        gbsim_log(GBSIM_LOG_ERROR, fmt, ##__VA_ARGS__)
 
-static inline void gbsim_dump(void *data, size_t size)
+static inline uint64_t gbsim_now_ns(void)
 {
-	uint8_t *buf = data;
-	int i;
-
-	fprintf(stdout, "[R] GBSIM: DUMP ->");
-	for (i = 0; i < size; i++)
-		fprintf(stdout, " %02hhx", buf[i]);
-	fprintf(stdout, "\n");
-	fflush(stdout);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static inline uint8_t cport_to_module_id(uint16_t cport_id)
+/* Modules are identified by their primary interface id */
+static inline uint8_t connection_module_id(struct gbsim_connection *connection)
 {
-	/* FIXME can identify based on registered cport module */
-	return 1;
+	return connection->intf ? connection->intf->id : AP_INTF_ID;
 }
 
 struct gbsim_connection *connection_find(uint16_t cport_id);
-void allocate_connection(uint16_t cport_id, uint16_t hd_cport_id, int protocol_id);
+int allocate_connection(struct gbsim_interface *intf, uint16_t cport_id,
+			uint16_t hd_cport_id, int protocol_id);
 uint16_t find_hd_cport_for_protocol(int protocol_id);
 void free_connection(struct gbsim_connection *connections);
-void free_connections(void);
+void free_interface_connections(struct gbsim_interface *intf);
+void connections_reset(void);
+
+int interface_slots_parse(const char *slots);
+int interface_insert(const char *name, struct gbsim_manifest *manifest);
+int interface_remove(const char *name);
+void interfaces_reap(void);
+void interfaces_reset(void);
+struct gbsim_interface *interface_find(uint8_t intf_id);
+void interface_hold(struct gbsim_interface *intf);
+void interface_put(struct gbsim_interface *intf);
+int interface_cport_protocol(struct gbsim_interface *intf, uint16_t cport_id);
+void interfaces_dump(FILE *f);
+
+struct gbsim_dme *dme_create(struct gbsim_interface *intf);
+void dme_destroy(struct gbsim_dme *dme);
+int dme_get(struct gbsim_dme *dme, uint16_t attr_id, uint16_t selector,
+	    uint32_t *value);
+int dme_set(struct gbsim_dme *dme, uint16_t attr_id, uint16_t selector,
+	    uint32_t value);
+void dme_dump(struct gbsim_dme *dme, FILE *f);
+
+int pwrmon_parse(const char *spec);
+unsigned int pwrmon_rail_count_get(void);
+size_t pwrmon_rail_names_get(void *buf);
+uint8_t pwrmon_sample_get(uint8_t rail_id, uint8_t type,
+			  uint32_t *measurement);
+uint8_t pwrmon_intf_sample_get(uint8_t intf_id, uint8_t type,
+			       uint32_t *measurement);
+
+#define SHA256_BLOCK_SIZE	64
+#define SHA256_DIGEST_SIZE	32
+
+struct gbsim_sha256 {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t buf[SHA256_BLOCK_SIZE];
+};
+
+void sha256_init(struct gbsim_sha256 *ctx);
+void sha256_update(struct gbsim_sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct gbsim_sha256 *ctx, uint8_t *digest);
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+/* Firmware chunks a fetch may have requested at once */
+#define FW_FETCH_WINDOW_MAX	64
+
+struct gbsim_fw_fetch;
+
+int fw_fetch_parse(const char *spec);
+struct gbsim_fw_fetch *fw_fetch_create(const char *name, uint32_t chunk_max,
+				       int (*request)(uint16_t hd_cport_id,
+						      uint32_t offset,
+						      uint32_t size,
+						      uint8_t firmware_id,
+						      void *priv),
+				       void (*done)(uint16_t hd_cport_id,
+						    int result, void *priv),
+				       void *priv);
+void fw_fetch_destroy(struct gbsim_fw_fetch *fetch);
+int fw_fetch_start(struct gbsim_fw_fetch *fetch, uint16_t hd_cport_id,
+		   uint32_t size, uint8_t firmware_id);
+int fw_fetch_receive(struct gbsim_fw_fetch *fetch,
+		     struct gbsim_operation *operation, const void *data,
+		     size_t size);
+void fw_fetch_fail(struct gbsim_fw_fetch *fetch,
+		   struct gbsim_operation *operation);
+void fw_fetch_expired(struct gbsim_operation *operation);
+
+int timesync_wake_pins_acquire(uint32_t strobe_mask);
+void timesync_wake_pins_release(void);
+int timesync_enable(uint8_t count, uint64_t frame_time,
+		    uint32_t strobe_delay_us, uint32_t refclk);
+void timesync_disable(void);
+int timesync_authoritative(uint64_t *frame_time);
+int timesync_ping(uint64_t *frame_time);
 
 int gadget_create(usbg_state **, usbg_gadget **);
 int gadget_enable(usbg_gadget *);
 int gadget_cleanup(usbg_state *, usbg_gadget *);
 
-int functionfs_init(void);
-int functionfs_loop(void);
-int functionfs_cleanup(void);
-void cleanup_endpoint(int, char *);
-
-int inotify_start(char *);
-
-void *recv_thread(void *);
-void recv_thread_cleanup(void *);
-
-int control_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *control_get_operation(uint8_t type);
-
-int svc_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-int svc_request_send(uint8_t, uint8_t);
-char *svc_get_operation(uint8_t type);
-void svc_init(void);
-void svc_exit(void);
-
-int gpio_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *gpio_get_operation(uint8_t type);
-void gpio_init(void);
-
-int i2c_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *i2c_get_operation(uint8_t type);
-void i2c_init(void);
-
-int pwm_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *pwm_get_operation(uint8_t type);
-void pwm_init(void);
-
-int sdio_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *sdio_get_operation(uint8_t type);
-void sdio_init(void);
+/* A link to the AP, carrying greybus messages in both directions */
+struct gbsim_transport {
+	const char *name;
+	int (*init)(void);
+	int (*loop)(void);
+	int (*send)(uint16_t hd_cport_id, void *buf, size_t size);
+	/* Optional, send from a scatter list */
+	int (*sendv)(uint16_t hd_cport_id, const struct iovec *iov, int count);
+	void (*exit)(void);
+};
 
-int spi_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *spi_get_operation(uint8_t type);
+/* Most payload segments a message can be sent from */
+#define GBSIM_MAX_IOV		4
 
-int lights_handler(struct gbsim_connection *,  void *, size_t, void *, size_t);
-char *lights_get_operation(uint8_t type);
+extern struct gbsim_transport *transport;
+extern struct gbsim_transport functionfs_transport;
+extern struct gbsim_transport socket_transport;
+extern struct gbsim_transport replay_transport;
+void cleanup_endpoint(int, char *);
+int cport_to_ep(uint16_t hd_cport_id);
 
-int power_supply_handler(struct gbsim_connection *,  void *, size_t, void *, size_t);
-char *power_supply_get_operation(uint8_t type);
+int inotify_start(char *);
 
-int uart_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *uart_get_operation(uint8_t type);
-void uart_init(void);
-void uart_cleanup(void);
+int storm_parse(const char *spec);
+bool storm_enabled(void);
+int storm_start(void);
+void storm_connection_created(uint8_t intf_id);
+void storm_connection_destroyed(uint8_t intf_id);
+void storm_cport_connected(uint8_t intf_id);
+
+int unipro_latency_parse(const char *spec);
+void unipro_step_delay(enum unipro_step step);
+int unipro_link_set_mode(struct gbsim_interface *intf,
+			 struct gb_svc_intf_set_pwrm_request *req);
+void unipro_link_down(struct gbsim_interface *intf);
+bool unipro_throttled(void);
+void unipro_link_throttle(struct gbsim_link *link, size_t size);
+
+int dispatch_init(void);
+void get_protocol_operation(int protocol_id, char **protocol,
+			    char **operation, uint8_t type);
+void latency_tag_enable(uint16_t hd_cport_id, bool enable);
+bool latency_tag_enabled(uint16_t hd_cport_id);
+void latency_tag_times(uint32_t *bridge_us, uint32_t *handler_us);
+void dispatch_message(struct gbsim_message *);
+
+int message_pool_init(void);
+struct gbsim_message *message_alloc(void);
+void message_free(struct gbsim_message *msg);
+void message_pool_dump(FILE *f);
+
+/* Direction of a captured frame */
+#define GBSIM_CAPTURE_FROM_AP		0
+#define GBSIM_CAPTURE_TO_AP		1
 
-int loopback_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *loopback_get_operation(uint8_t type);
-void loopback_init(void);
-void loopback_cleanup(void);
+/*
+ * Pseudo header preceding each frame in a capture file, all fields are
+ * little endian. protocol is 0xff when the hd cport has no connection.
+ */
+struct gbsim_capture_hdr {
+	__u8 direction;
+	__u8 protocol;
+	__le16 hd_cport_id;
+	__le16 cport_id;
+	__le16 reserved;
+} __packed;
+
+int capture_init(void);
+void capture_message(int direction, uint16_t hd_cport_id, uint16_t cport_id,
+		     int protocol, void *buf, size_t size);
+void capture_exit(void);
+
+bool replay_active(void);
+
+int stats_init(void);
+void stats_reset(uint16_t hd_cport_id, uint16_t cport_id, int protocol);
+void stats_message(uint16_t hd_cport_id, bool inbound, uint8_t type,
+		   size_t size, int ret);
+void stats_handler(uint16_t hd_cport_id, uint8_t type, uint64_t ns);
+void stats_dump(FILE *f);
+
+int aio_init(void);
+bool aio_enabled(void);
+void *aio_recv_thread(void *);
+void *aio_send_thread(void *);
+int aio_send(int ep, const struct iovec *iov, int count);
+
+/* A protocol model, registered with GBSIM_PROTOCOL() */
+struct gbsim_protocol {
+	int id;
+	const char *name;
+	int (*handler)(struct gbsim_connection *connection, void *rbuf,
+		       size_t rsize, void *tbuf, size_t tsize);
+	char *(*get_operation)(uint8_t type);
+
+	/* Optional, called once at startup and exit */
+	void (*init)(void);
+	void (*cleanup)(void);
+
+	/* Optional, set up and tear down the state of a connection */
+	int (*connection_init)(struct gbsim_connection *connection);
+	void (*connection_exit)(struct gbsim_connection *connection);
+};
 
-int bootrom_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *bootrom_get_operation(uint8_t type);
+void protocol_register(struct gbsim_protocol *protocol);
+struct gbsim_protocol *protocol_find(int protocol_id);
+void protocols_init(void);
+void protocols_cleanup(void);
 
-int fw_mgmt_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *fw_mgmt_get_operation(uint8_t type);
+/* Register a protocol model before main() runs */
+#define GBSIM_PROTOCOL(_protocol)					\
+	static void __attribute__((constructor)) _protocol##_register(void) \
+	{								\
+		protocol_register(&_protocol);				\
+	}
 
-int fw_download_handler(struct gbsim_connection *, void *, size_t, void *, size_t);
-char *fw_download_get_operation(uint8_t type);
-int download_firmware(char *tag, uint16_t hd_cport_id, void (*func)(void));
+int svc_request_send(uint8_t, uint8_t);
+int download_firmware(char *tag, uint16_t hd_cport_id, void (*func)(bool valid));
 
-bool manifest_parse(void *data, size_t size);
-void reset_hd_cport_id(void);
+struct gbsim_manifest *manifest_get(const char *path);
+struct gbsim_manifest *manifest_create(const void *data, size_t size);
+void manifest_hold(struct gbsim_manifest *m);
+void manifest_put(struct gbsim_manifest *m);
+int manifest_cport_protocol(struct gbsim_manifest *m, uint16_t cport_id);
 int send_response(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
 			uint16_t operation_id, uint8_t type, uint8_t result);
+int send_response_iov(uint16_t hd_cport_id,
+			struct op_msg *message, uint16_t message_size,
+			const struct iovec *payload, int count,
+			uint16_t operation_id, uint8_t type, uint8_t result);
 int send_request(uint16_t hd_cport_id,
 			struct op_msg *message, uint16_t message_size,
 			uint16_t operation_id, uint8_t type);
+int send_operation(uint16_t hd_cport_id,
+			struct op_msg *message, uint16_t message_size,
+			uint8_t type, void *priv,
+			void (*expired)(struct gbsim_operation *operation));
 
 #endif /* __GBSIM_H */
@@ -29,10 +29,13 @@ struct gb_gpio {
 	uint8_t irq_unmasked;
 };
 
-static struct gb_gpio gb_gpios[6];
-static gpio *gpios[6];
+#define GPIO_LINES	6
 
-static int gb_gpio_set_value(uint8_t which, uint8_t value)
+/* Backend lines, shared by all the GPIO connections */
+static gpio *gpios[GPIO_LINES];
+
+static int gb_gpio_set_value(struct gb_gpio *gb_gpios, uint8_t which,
+			     uint8_t value)
 {
 	uint8_t which_con;
 
@@ -72,9 +75,10 @@ static int gb_gpio_set_value(uint8_t which, uint8_t value)
 	return 0;
 }
 
-int gpio_handler(struct gbsim_connection *connection, void *rbuf,
+static int gpio_handler(struct gbsim_connection *connection, void *rbuf,
 		 size_t rsize, void *tbuf, size_t tsize)
 {
+	struct gb_gpio *gb_gpios = connection->priv;
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp;
@@ -88,6 +92,17 @@ int gpio_handler(struct gbsim_connection *connection, void *rbuf,
 	op_rsp = (struct op_msg *)tbuf;
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
 
+	/* All the requests but line count start with the line number */
+	if (!(oph->type & OP_RESPONSE) && oph->type != GB_GPIO_TYPE_LINE_COUNT &&
+	    op_req->gpio_act_req.which >= GPIO_LINES) {
+		gbsim_error("GPIO %hhu out of range\n",
+			    op_req->gpio_act_req.which);
+		return send_response(hd_cport_id, op_rsp,
+				     sizeof(struct gb_operation_msg_hdr),
+				     oph->operation_id, oph->type,
+				     PROTOCOL_STATUS_INVALID);
+	}
+
 	switch (oph->type) {
 	case GB_GPIO_TYPE_LINE_COUNT:
 		payload_size = sizeof(struct gb_gpio_line_count_response);
@@ -151,7 +166,8 @@ int gpio_handler(struct gbsim_connection *connection, void *rbuf,
 		if (bbb_backend)
 			libsoc_gpio_set_level(gpios[which], op_req->gpio_set_val_req.value);
 		else
-			send_event = gb_gpio_set_value(which, op_req->gpio_set_val_req.value);
+			send_event = gb_gpio_set_value(gb_gpios, which,
+							       op_req->gpio_set_val_req.value);
 		break;
 	case GB_GPIO_TYPE_SET_DEBOUNCE:
 		payload_size = 0;
@@ -207,7 +223,7 @@ int gpio_handler(struct gbsim_connection *connection, void *rbuf,
 	return 0;
 }
 
-char *gpio_get_operation(uint8_t type)
+static char *gpio_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -243,7 +259,7 @@ char *gpio_get_operation(uint8_t type)
 	}
 }
 
-void gpio_init(void)
+static void gpio_init(void)
 {
 	int i;
 
@@ -254,7 +270,33 @@ void gpio_init(void)
 		 * pins on the header can be used in loopback mode for
 		 * testing.
 		 */
-		for (i=0; i<6; i++)
+		for (i = 0; i < GPIO_LINES; i++)
 			gpios[i] = libsoc_gpio_request(56+i, LS_GREEDY);
 	}
 }
+
+/* Each GPIO connection is a controller with lines of its own */
+static int gpio_connection_init(struct gbsim_connection *connection)
+{
+	connection->priv = calloc(GPIO_LINES, sizeof(struct gb_gpio));
+	if (!connection->priv)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void gpio_connection_exit(struct gbsim_connection *connection)
+{
+	free(connection->priv);
+}
+
+static struct gbsim_protocol gpio_protocol = {
+	.id		= GREYBUS_PROTOCOL_GPIO,
+	.name		= "GPIO",
+	.handler	= gpio_handler,
+	.get_operation	= gpio_get_operation,
+	.init		= gpio_init,
+	.connection_init = gpio_connection_init,
+	.connection_exit = gpio_connection_exit,
+};
+GBSIM_PROTOCOL(gpio_protocol);
@@ -15,6 +15,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -25,7 +26,32 @@
 static __u8 data_byte;
 static int ifd;
 
-int i2c_handler(struct gbsim_connection *connection, void *rbuf,
+/*
+ * The ops, and the data they write, must all be in the request and what
+ * they read must fit in the response.
+ */
+static bool i2c_transfer_valid(struct gb_i2c_transfer_request *request,
+			       int op_count, size_t rsize, size_t tsize)
+{
+	size_t size = sizeof(struct gb_operation_msg_hdr) + sizeof(*request) +
+		      op_count * sizeof(request->ops[0]);
+	size_t read_size = sizeof(struct gb_operation_msg_hdr);
+	int i;
+
+	if (size > rsize)
+		return false;
+
+	for (i = 0; i < op_count; i++) {
+		if (le16toh(request->ops[i].flags) & I2C_M_RD)
+			read_size += le16toh(request->ops[i].size);
+		else
+			size += le16toh(request->ops[i].size);
+	}
+
+	return size <= rsize && read_size <= tsize;
+}
+
+static int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 		size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
@@ -53,6 +79,13 @@ int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 		op_count = le16toh(op_req->i2c_xfer_req.op_count);
 		write_data = (__u8 *)&op_req->i2c_xfer_req.ops[op_count];
 		gbsim_debug("Number of transfer ops %d\n", op_count);
+		if (!i2c_transfer_valid(&op_req->i2c_xfer_req, op_count, rsize,
+					tsize)) {
+			gbsim_error("i2c transfer larger than its request\n");
+			result = PROTOCOL_STATUS_INVALID;
+			payload_size = 0;
+			break;
+		}
 		for (i = 0; i < op_count; i++) {
 			struct gb_i2c_transfer_op *op;
 			__u16 addr;
@@ -76,8 +109,13 @@ int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 					int count;
 					ioctl(ifd, BLKFLSBUF);
 					count = read(ifd, &op_rsp->i2c_xfer_rsp.data[read_count], size);
-					if (count != size)
+					if (count != size) {
 						gbsim_error("op %d: failed to read %04x bytes\n", i, size);
+						if (count < 0)
+							count = 0;
+						memset(&op_rsp->i2c_xfer_rsp.data[read_count + count],
+						       0, size - count);
+					}
 				} else {
 					for (i = read_count; i < (read_count + size); i++)
 					op_rsp->i2c_xfer_rsp.data[i] = data_byte++;
@@ -111,7 +149,7 @@ int i2c_handler(struct gbsim_connection *connection, void *rbuf,
 				oph->operation_id, oph->type, result);
 }
 
-char *i2c_get_operation(uint8_t type)
+static char *i2c_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -125,7 +163,7 @@ char *i2c_get_operation(uint8_t type)
 	}
 }
 
-void i2c_init(void)
+static void i2c_init(void)
 {
 	char filename[20];
 
@@ -136,3 +174,12 @@ void i2c_init(void)
 			gbsim_error("failed opening i2c-dev node read/write\n");
 	}
 }
+
+static struct gbsim_protocol i2c_protocol = {
+	.id		= GREYBUS_PROTOCOL_I2C,
+	.name		= "I2C",
+	.handler	= i2c_handler,
+	.get_operation	= i2c_get_operation,
+	.init		= i2c_init,
+};
+GBSIM_PROTOCOL(i2c_protocol);
@@ -30,58 +30,6 @@ static pthread_t inotify_pthread;
 int notify_fd = -ENXIO;
 static char root[256];
 
-static struct greybus_manifest_header *get_manifest_blob(char *mnfs)
-{
-	struct greybus_manifest_header *mh;
-	int mnf_fd;
-	ssize_t n;
-	__le16 file_size;
-	uint16_t size;
-
-	if ((mnf_fd = open(mnfs, O_RDONLY)) < 0) {
-		gbsim_error("failed to open manifest blob %s\n", mnfs);
-		return NULL;
-	}
-
-	/* First just get the size */
-	if ((n = read(mnf_fd, &file_size, 2)) != 2) {
-		gbsim_error("failed to read manifest size, read %zd\n", n);
-		goto out;
-	}
-	size = le16toh(file_size);
-
-	/* Size has to cover at least itself */
-	if (size < 2) {
-		gbsim_error("bad manifest size %hu\n", size);
-		goto out;
-	}
-
-	/* Allocate a big enough buffer */
-	if (!(mh = malloc(size))) {
-		gbsim_error("failed to allocate manifest buffer\n");
-		goto out;
-	}
-
-	/* Now go back and read the whole thing */
-	if (lseek(mnf_fd, 0, SEEK_SET)) {
-		gbsim_error("failed to seek to front of manifest\n");
-		goto out_free;
-	}
-	if (read(mnf_fd, mh, size) != size) {
-		gbsim_error("failed to read manifest\n");
-		goto out_free;
-	}
-	close(mnf_fd);
-
-	return mh;
-out_free:
-	free(mh);
-out:
-	close(mnf_fd);
-
-	return NULL;
-}
-
 static void *inotify_thread(void *param)
 {
 	char buffer[16 * INOTIFY_EVENT_BUF];
@@ -118,25 +66,40 @@ static void *inotify_thread(void *param)
 
 			if (event->mask & IN_CLOSE_WRITE) {
 				char mnfs[256];
-				struct greybus_manifest_header *mh;
+				struct gbsim_manifest *m;
+				int intf_id;
+
 				strcpy(mnfs, root);
 				strcat(mnfs, "/");
 				strcat(mnfs, event->name);
-				mh = get_manifest_blob(mnfs);
-				if (mh) {
-					interface.manifest = mh;
-					interface.manifest_size = le16toh(mh->size);
-					manifest_parse(mh, le16toh(mh->size));
-
-					gbsim_info("%s Interface inserted\n", event->name);
-					/* Fix Interface ID to 1 */
-					svc_request_send(GB_SVC_TYPE_MODULE_INSERTED, 1);
-				} else
+				m = manifest_get(mnfs);
+				if (!m) {
 					gbsim_error("missing manifest blob, no hotplug event sent\n");
+					continue;
+				}
+
+				intf_id = interface_insert(event->name, m);
+				if (intf_id < 0) {
+					gbsim_error("%s not inserted (%d)\n",
+						    event->name, intf_id);
+					manifest_put(m);
+					continue;
+				}
+
+				gbsim_info("%s Interface %d inserted\n",
+					   event->name, intf_id);
+				svc_request_send(GB_SVC_TYPE_MODULE_INSERTED,
+						 intf_id);
 			} else if (event->mask & IN_DELETE) {
-				/* Fix Interface ID to 1 */
-				svc_request_send(GB_SVC_TYPE_MODULE_REMOVED, 1);
-				gbsim_info("%s interface removed\n", event->name);
+				int intf_id = interface_remove(event->name);
+
+				if (intf_id < 0)
+					continue;
+
+				svc_request_send(GB_SVC_TYPE_MODULE_REMOVED,
+						 intf_id);
+				gbsim_info("%s interface %d removed\n",
+					   event->name, intf_id);
 			}
 		}
 	} while (length >= 0);
@@ -150,6 +113,10 @@ int inotify_start(char *base_dir)
 	struct stat root_stat;
 	int notify_wd;
 
+	/* Already watching, from an earlier AP connection */
+	if (notify_fd >= 0)
+		return 0;
+
 	/* Our inotify directory */
 	strcpy(root, base_dir);
 	strcat(root, "/");
@@ -0,0 +1,313 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbsim.h"
+
+/*
+ * Interfaces inserted in the endo.
+ *
+ * Each manifest dropped in the hotplug directory becomes an interface, in
+ * the slot the file name asks for ("<id>-<name>") or else in the lowest
+ * free one. The slots modules can go in are set with -I, all the interface
+ * ids but the AP's by default.
+ *
+ * An interface only refers to its parsed manifest, from the manifest cache,
+ * to know which CPorts it has. The AP binds them to hd cports with the SVC
+ * connection create requests, which is when the connections get allocated,
+ * so any number of interfaces can share the hd cports the way the kernel
+ * hands them out.
+ *
+ * Interfaces are reference counted: each of their connections holds one,
+ * and so does their slot until the AP has acknowledged the removal of the
+ * module.
+ */
+
+static struct gbsim_interface *interfaces[INTF_ID_MAX];
+static bool interface_slots[INTF_ID_MAX];
+static bool interface_slots_set;
+static pthread_mutex_t interface_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Parse a list of interface ids and ranges, like "1-4,6,8" */
+int interface_slots_parse(const char *slots)
+{
+	unsigned long first, last;
+	const char *p = slots;
+	char *end;
+
+	memset(interface_slots, 0, sizeof(interface_slots));
+
+	while (*p) {
+		first = strtoul(p, &end, 0);
+		if (end == p)
+			return -EINVAL;
+
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 0);
+			if (end == p)
+				return -EINVAL;
+		}
+
+		if (!first || first > last || last >= INTF_ID_MAX)
+			return -ERANGE;
+
+		for (; first <= last; first++)
+			if (first != AP_INTF_ID)
+				interface_slots[first] = true;
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -EINVAL;
+		p = end;
+	}
+
+	interface_slots_set = true;
+
+	return 0;
+}
+
+static bool interface_slot_valid(unsigned int intf_id)
+{
+	if (!intf_id || intf_id >= INTF_ID_MAX || intf_id == AP_INTF_ID)
+		return false;
+
+	return interface_slots_set ? interface_slots[intf_id] : true;
+}
+
+/* Slot explicitly asked for by the manifest file name, 0 if none */
+static unsigned int interface_slot_requested(const char *name)
+{
+	unsigned long intf_id;
+	char *end;
+
+	intf_id = strtoul(name, &end, 10);
+	if (end == name || *end != '-')
+		return 0;
+
+	return intf_id < INTF_ID_MAX ? intf_id : INTF_ID_MAX;
+}
+
+static void interface_free(struct gbsim_interface *intf)
+{
+	dme_destroy(intf->dme);
+	manifest_put(intf->manifest);
+	free(intf->name);
+	free(intf);
+}
+
+void interface_hold(struct gbsim_interface *intf)
+{
+	if (intf)
+		__atomic_add_fetch(&intf->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void interface_put(struct gbsim_interface *intf)
+{
+	if (intf && !__atomic_sub_fetch(&intf->refcount, 1, __ATOMIC_ACQ_REL))
+		interface_free(intf);
+}
+
+/* Look an inserted interface up, holding a reference to it */
+struct gbsim_interface *interface_find(uint8_t intf_id)
+{
+	struct gbsim_interface *intf = NULL;
+
+	pthread_mutex_lock(&interface_lock);
+	if (intf_id < INTF_ID_MAX && interfaces[intf_id] &&
+	    !interfaces[intf_id]->removed) {
+		intf = interfaces[intf_id];
+		interface_hold(intf);
+	}
+	pthread_mutex_unlock(&interface_lock);
+
+	return intf;
+}
+
+/*
+ * Insert an interface described by the manifest, taking over the reference
+ * to it on success, and return its id or a negative errno.
+ */
+int interface_insert(const char *name, struct gbsim_manifest *manifest)
+{
+	struct gbsim_interface *intf;
+	unsigned int intf_id, i;
+	int ret;
+
+	intf = calloc(1, sizeof(*intf));
+	if (!intf)
+		return -ENOMEM;
+
+	intf->name = strdup(name);
+	intf->refcount = 1;
+	if (!intf->name) {
+		free(intf);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&interface_lock);
+
+	for (i = 1; i < INTF_ID_MAX; i++)
+		if (interfaces[i] && !strcmp(interfaces[i]->name, name)) {
+			gbsim_error("%s already inserted in interface %u\n",
+				    name, i);
+			ret = -EEXIST;
+			goto err_unlock;
+		}
+
+	intf_id = interface_slot_requested(name);
+	if (intf_id) {
+		if (!interface_slot_valid(intf_id) || interfaces[intf_id]) {
+			gbsim_error("interface %u not available for %s\n",
+				    intf_id, name);
+			ret = -EBUSY;
+			goto err_unlock;
+		}
+	} else {
+		for (intf_id = 1; intf_id < INTF_ID_MAX; intf_id++)
+			if (interface_slot_valid(intf_id) &&
+			    !interfaces[intf_id])
+				break;
+
+		if (intf_id == INTF_ID_MAX) {
+			gbsim_error("no free interface for %s\n", name);
+			ret = -ENOSPC;
+			goto err_unlock;
+		}
+	}
+
+	intf->id = intf_id;
+	intf->manifest = manifest;
+	intf->dme = dme_create(intf);
+	if (!intf->dme) {
+		intf->manifest = NULL;
+		ret = -ENOMEM;
+		goto err_unlock;
+	}
+	interfaces[intf_id] = intf;
+
+	pthread_mutex_unlock(&interface_lock);
+
+	gbsim_debug("%s inserted in interface %u\n", name, intf_id);
+
+	return intf_id;
+
+err_unlock:
+	pthread_mutex_unlock(&interface_lock);
+	/* The manifest stays the caller's */
+	interface_free(intf);
+
+	return ret;
+}
+
+/*
+ * Mark the interface the manifest went in as removed, and return its id or
+ * a negative errno. It goes away once the AP acknowledges the removal.
+ */
+int interface_remove(const char *name)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&interface_lock);
+	for (i = 1; i < INTF_ID_MAX; i++) {
+		if (!interfaces[i] || interfaces[i]->removed ||
+		    strcmp(interfaces[i]->name, name))
+			continue;
+
+		interfaces[i]->removed = true;
+		pthread_mutex_unlock(&interface_lock);
+
+		return i;
+	}
+	pthread_mutex_unlock(&interface_lock);
+
+	return -ENODEV;
+}
+
+/* Free the slots, and the connections left, of the removed interfaces */
+void interfaces_reap(void)
+{
+	struct gbsim_interface *intf;
+	unsigned int i;
+
+	for (i = 1; i < INTF_ID_MAX; i++) {
+		pthread_mutex_lock(&interface_lock);
+		intf = interfaces[i];
+		if (!intf || !intf->removed) {
+			pthread_mutex_unlock(&interface_lock);
+			continue;
+		}
+		interfaces[i] = NULL;
+		pthread_mutex_unlock(&interface_lock);
+
+		free_interface_connections(intf);
+		gbsim_debug("interface %u (%s) released\n", i, intf->name);
+		interface_put(intf);
+	}
+}
+
+/* The AP went away, release all the interfaces it was told about */
+void interfaces_reset(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&interface_lock);
+	for (i = 1; i < INTF_ID_MAX; i++)
+		if (interfaces[i])
+			interfaces[i]->removed = true;
+	pthread_mutex_unlock(&interface_lock);
+
+	interfaces_reap();
+}
+
+static const char * const interface_states[] = {
+	[GBSIM_INTF_OFF]	= "off",
+	[GBSIM_INTF_VSYS]	= "vsys",
+	[GBSIM_INTF_REFCLK]	= "refclk",
+	[GBSIM_INTF_UNIPRO]	= "unipro",
+	[GBSIM_INTF_ACTIVE]	= "active",
+};
+
+/* Dump the state, link and UniPro attributes of the inserted interfaces */
+void interfaces_dump(FILE *f)
+{
+	struct gbsim_interface *intf;
+	unsigned int i;
+
+	pthread_mutex_lock(&interface_lock);
+	for (i = 1; i < INTF_ID_MAX; i++) {
+		intf = interfaces[i];
+		if (!intf)
+			continue;
+
+		fprintf(f, "interface %u %s: %s%s, link %llu bytes/s to it, %llu from it\n",
+			i, intf->name, interface_states[intf->state],
+			intf->removed ? " (removed)" : "",
+			(unsigned long long)intf->tx.bytes_per_s,
+			(unsigned long long)intf->rx.bytes_per_s);
+		dme_dump(intf->dme, f);
+	}
+	pthread_mutex_unlock(&interface_lock);
+}
+
+/* Protocol of an interface's CPort, as given by its manifest */
+int interface_cport_protocol(struct gbsim_interface *intf, uint16_t cport_id)
+{
+	if (!intf->manifest)
+		return -ENOENT;
+
+	return manifest_cport_protocol(intf->manifest, cport_id);
+}
@@ -53,8 +53,6 @@ struct gb_light {
 	struct gb_channel	*channels;
 };
 
-static struct gb_light *gbl[LIGHTS_COUNT];
-
 #define GB_CHANNEL_MODE_VENDOR	0x00100000
 
 static const struct gb_channel channel_rgb = {
@@ -137,7 +135,8 @@ static const struct gb_channel channel_torch = {
 };
 
 #define define_get_channel(__type)					\
-static struct gb_channel *_get_channel_##__type(struct op_msg *op_req)	\
+static struct gb_channel *_get_channel_##__type(struct gb_light **gbl,	\
+						struct op_msg *op_req)	\
 {									\
 	uint8_t light_id;						\
 	uint8_t channel_id;						\
@@ -149,7 +148,7 @@ static struct gb_channel *_get_channel_##__type(struct op_msg *op_req)	\
 	return &light->channels[channel_id];				\
 }
 
-#define get_channel(__req, __type) _get_channel_##__type(__req)
+#define get_channel(__gbl, __req, __type) _get_channel_##__type(__gbl, __req)
 
 define_get_channel(conf);
 define_get_channel(bright);
@@ -228,6 +227,8 @@ static struct gb_light *light_init(uint8_t id)
 	struct gb_light *light;
 
 	light = calloc(1, sizeof(*light));
+	if (!light)
+		return NULL;
 
 	light->id = id;
 	snprintf(light->name, sizeof(light->name), "gbsim%d", id);
@@ -250,6 +251,15 @@ static struct gb_light *light_init(uint8_t id)
 	return light;
 }
 
+static void light_free(struct gb_light *light)
+{
+	if (!light)
+		return;
+
+	free(light->channels);
+	free(light);
+}
+
 static ssize_t lights_send_event(struct op_msg *op_req, uint16_t hd_cport_id,
 				 uint8_t light_id, uint8_t event)
 {
@@ -267,9 +277,10 @@ static ssize_t lights_send_event(struct op_msg *op_req, uint16_t hd_cport_id,
 			    GB_LIGHTS_TYPE_EVENT);
 }
 
-int lights_handler(struct gbsim_connection *connection, void *rbuf,
+static int lights_handler(struct gbsim_connection *connection, void *rbuf,
 		   size_t rsize, void *tbuf, size_t tsize)
 {
+	struct gb_light **gbl = connection->priv;
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
 	ssize_t ret = 0;
@@ -280,7 +291,6 @@ int lights_handler(struct gbsim_connection *connection, void *rbuf,
 	uint16_t message_size;
 	uint16_t hd_cport_id = connection->hd_cport_id;
 	uint8_t light_id = 0;
-	int i;
 
 	op_rsp = (struct op_msg *)tbuf;
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
@@ -289,9 +299,6 @@ int lights_handler(struct gbsim_connection *connection, void *rbuf,
 	case GB_LIGHTS_TYPE_GET_LIGHTS:
 		payload_size = sizeof(struct gb_lights_get_lights_response);
 		op_rsp->lights_gl_rsp.lights_count = LIGHTS_COUNT;
-
-		for (i = 0; i < LIGHTS_COUNT; i++)
-			gbl[i] = light_init(i);
 		break;
 	case GB_LIGHTS_TYPE_GET_LIGHT_CONFIG:
 		payload_size = sizeof(struct gb_lights_get_light_config_response);
@@ -304,7 +311,7 @@ int lights_handler(struct gbsim_connection *connection, void *rbuf,
 		break;
 	case GB_LIGHTS_TYPE_GET_CHANNEL_CONFIG:
 		payload_size = sizeof(struct gb_lights_get_channel_config_response);
-		channel = get_channel(op_req, conf);
+		channel = get_channel(gbl, op_req, conf);
 
 		op_rsp->lights_glc_conf_rsp.max_brightness =
 			channel->max_brightness;
@@ -323,30 +330,30 @@ int lights_handler(struct gbsim_connection *connection, void *rbuf,
 		 * reconfigure event
 		 */
 		light_id = op_req->lights_glc_bright_req.light_id;
-		channel = get_channel(op_req, bright);
+		channel = get_channel(gbl, op_req, bright);
 
 		channel->brightness = op_req->lights_glc_bright_req.brightness;
 		break;
 	case GB_LIGHTS_TYPE_SET_FADE:
-		channel = get_channel(op_req, fade);
+		channel = get_channel(gbl, op_req, fade);
 
 		channel->fade_in = op_req->lights_glc_fade_req.fade_in;
 		channel->fade_out = op_req->lights_glc_fade_req.fade_out;
 		break;
 	case GB_LIGHTS_TYPE_SET_COLOR:
-		channel = get_channel(op_req, color);
+		channel = get_channel(gbl, op_req, color);
 
 		channel->color = le32toh(op_req->lights_glc_color_req.color);
 		break;
 	case GB_LIGHTS_TYPE_SET_BLINK:
-		channel = get_channel(op_req, blink);
+		channel = get_channel(gbl, op_req, blink);
 
 		channel->time_on_ms = le16toh(op_req->lights_glc_blink_req.time_on_ms);
 		channel->time_off_ms = le16toh(op_req->lights_glc_blink_req.time_off_ms);
 		break;
 	case GB_LIGHTS_TYPE_GET_CHANNEL_FLASH_CONFIG:
 		payload_size = sizeof(struct gb_lights_get_channel_flash_config_response);
-		channel = get_channel(op_req, fconf);
+		channel = get_channel(gbl, op_req, fconf);
 
 		op_rsp->lights_glc_fconf_rsp.intensity_min_uA =
 			channel->intensity_min_uA;
@@ -363,17 +370,17 @@ int lights_handler(struct gbsim_connection *connection, void *rbuf,
 			channel->timeout_step_us;
 		break;
 	case GB_LIGHTS_TYPE_SET_FLASH_INTENSITY:
-		channel = get_channel(op_req, fint);
+		channel = get_channel(gbl, op_req, fint);
 
 		channel->current = le32toh(op_req->lights_glc_fint_req.intensity_uA);
 		break;
 	case GB_LIGHTS_TYPE_SET_FLASH_TIMEOUT:
-		channel = get_channel(op_req, ftimeout);
+		channel = get_channel(gbl, op_req, ftimeout);
 
 		channel->timeout = le32toh(op_req->lights_glc_ftimeout_req.timeout_us);
 		break;
 	case GB_LIGHTS_TYPE_SET_FLASH_STROBE:
-		channel = get_channel(op_req, fstrobe);
+		channel = get_channel(gbl, op_req, fstrobe);
 
 		channel->strobe = op_req->lights_glc_fstrobe_req.state ? true : false;
 		break;
@@ -395,7 +402,7 @@ int lights_handler(struct gbsim_connection *connection, void *rbuf,
 	return ret;
 }
 
-char *lights_get_operation(uint8_t type)
+static char *lights_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -430,3 +437,45 @@ char *lights_get_operation(uint8_t type)
 		return "(Unknown operation)";
 	}
 }
+
+static void lights_connection_exit(struct gbsim_connection *connection)
+{
+	struct gb_light **gbl = connection->priv;
+	int i;
+
+	for (i = 0; i < LIGHTS_COUNT; i++)
+		light_free(gbl[i]);
+	free(gbl);
+}
+
+/* Each lights connection has its own set of lights */
+static int lights_connection_init(struct gbsim_connection *connection)
+{
+	struct gb_light **gbl;
+	int i;
+
+	gbl = calloc(LIGHTS_COUNT, sizeof(*gbl));
+	if (!gbl)
+		return -ENOMEM;
+	connection->priv = gbl;
+
+	for (i = 0; i < LIGHTS_COUNT; i++) {
+		gbl[i] = light_init(i);
+		if (!gbl[i] || !gbl[i]->channels) {
+			lights_connection_exit(connection);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static struct gbsim_protocol lights_protocol = {
+	.id		= GREYBUS_PROTOCOL_LIGHTS,
+	.name		= "LIGHTS",
+	.handler	= lights_handler,
+	.get_operation	= lights_get_operation,
+	.connection_init = lights_connection_init,
+	.connection_exit = lights_connection_exit,
+};
+GBSIM_PROTOCOL(lights_protocol);
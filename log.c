@@ -0,0 +1,394 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * Asynchronous logger.
+ *
+ * Every thread formats its log lines into a ring of its own, which is only
+ * ever written by that thread and read by the drain thread, so logging
+ * takes no lock and makes no syscall. The drain thread periodically merges
+ * the rings in timestamp order and writes the result out with a single
+ * write() per stream.
+ *
+ * A thread's ring outlives it until drained. When a ring is full the line
+ * is dropped and accounted for, rather than stalling the message path.
+ */
+
+/* Size of each thread's ring, must be a power of two */
+#define LOG_RING_SIZE		(256 * 1024)
+#define LOG_RING_MASK		(LOG_RING_SIZE - 1)
+
+/* Longest line, large enough to hold the dump of a full message */
+#define LOG_LINE_MAX		(8 * 1024)
+
+/* Size of the drain output buffers */
+#define LOG_OUT_SIZE		(64 * 1024)
+
+/* Interval between two drains */
+#define LOG_DRAIN_NS		(10 * 1000 * 1000)
+
+/*
+ * Records are 16 bytes aligned so that the room left at the end of the ring
+ * can always hold at least a wrap marker.
+ */
+#define LOG_RECORD_ALIGN	16
+#define LOG_RECORD_SIZE(len)						\
+	(((sizeof(struct log_record) + (len)) + LOG_RECORD_ALIGN - 1) &	\
+	 ~(LOG_RECORD_ALIGN - 1))
+
+struct log_record {
+	uint32_t len;
+	uint8_t level;
+	uint8_t wrap;
+	uint8_t pad[2];
+	uint64_t ns;
+	char text[];
+};
+
+struct log_ring {
+	TAILQ_ENTRY(log_ring) rnode;
+	size_t head;		/* written by the owner thread */
+	size_t tail;		/* written by the drain thread */
+	unsigned int dropped;	/* written by the owner thread */
+	unsigned int reported;	/* drops already reported by the drain */
+	int dead;
+	char buf[LOG_RING_SIZE];
+};
+
+static const char log_prefix[] = {
+	[GBSIM_LOG_ERROR]	= 'E',
+	[GBSIM_LOG_INFO]	= 'I',
+	[GBSIM_LOG_DEBUG]	= 'D',
+	[GBSIM_LOG_DUMP]	= 'R',
+};
+
+static TAILQ_HEAD(lhead, log_ring) log_rings = TAILQ_HEAD_INITIALIZER(log_rings);
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_key;
+static pthread_t log_pthread;
+static struct timespec log_start;
+static int log_running;
+
+static __thread struct log_ring *log_ring;
+static __thread char log_line[LOG_LINE_MAX];
+
+/* Output buffers of the drain thread, one per stream */
+static char log_out[2][LOG_OUT_SIZE];
+static size_t log_out_len[2];
+
+static uint64_t log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)(ts.tv_sec - log_start.tv_sec) * 1000000000ULL +
+	       ts.tv_nsec - log_start.tv_nsec;
+}
+
+/* Called on thread exit, the ring is freed by the drain once emptied */
+static void log_thread_exit(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *log_get_ring(void)
+{
+	struct log_ring *ring = log_ring;
+
+	if (ring)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	pthread_mutex_lock(&log_lock);
+	TAILQ_INSERT_TAIL(&log_rings, ring, rnode);
+	pthread_mutex_unlock(&log_lock);
+
+	pthread_setspecific(log_key, ring);
+	log_ring = ring;
+
+	return ring;
+}
+
+static void log_direct(int level, const char *text, size_t len)
+{
+	FILE *stream = level == GBSIM_LOG_ERROR ? stderr : stdout;
+
+	fprintf(stream, "[%c] GBSIM: %.*s", log_prefix[level], (int)len, text);
+	fflush(stream);
+}
+
+/* Queue a formatted line on the calling thread's ring */
+static void log_write(int level, const char *text, size_t len)
+{
+	struct log_ring *ring;
+	struct log_record *rec;
+	size_t head, tail, pos, need, room;
+
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ||
+	    !(ring = log_get_ring())) {
+		log_direct(level, text, len);
+		return;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	pos = head & LOG_RING_MASK;
+	need = LOG_RECORD_SIZE(len);
+	room = LOG_RING_SIZE - pos;
+
+	/* Records are contiguous, skip over the end of the ring if needed */
+	if (LOG_RING_SIZE - (head - tail) < need + (room < need ? room : 0)) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (room < need) {
+		rec = (struct log_record *)&ring->buf[pos];
+		rec->wrap = 1;
+		head += room;
+		pos = 0;
+	}
+
+	rec = (struct log_record *)&ring->buf[pos];
+	rec->len = len;
+	rec->level = level;
+	rec->wrap = 0;
+	rec->ns = log_now();
+	memcpy(rec->text, text, len);
+
+	__atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+}
+
+void gbsim_log(int level, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(log_line, sizeof(log_line), fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return;
+	if (len >= sizeof(log_line))
+		len = sizeof(log_line) - 1;
+
+	log_write(level, log_line, len);
+}
+
+/* Format the whole message at once, instead of one call per byte */
+void gbsim_dump(void *data, size_t size)
+{
+	static const char hex[] = "0123456789abcdef";
+	static const char head[] = "DUMP ->";
+	uint8_t *buf = data;
+	char *p = log_line;
+	size_t i;
+
+	if (size > (sizeof(log_line) - sizeof(head) - 1) / 3)
+		size = (sizeof(log_line) - sizeof(head) - 1) / 3;
+
+	memcpy(p, head, sizeof(head) - 1);
+	p += sizeof(head) - 1;
+
+	for (i = 0; i < size; i++) {
+		*p++ = ' ';
+		*p++ = hex[buf[i] >> 4];
+		*p++ = hex[buf[i] & 0xf];
+	}
+	*p++ = '\n';
+
+	log_write(GBSIM_LOG_DUMP, log_line, p - log_line);
+}
+
+/* Next record of the ring, or NULL if empty. Must be called by the drain. */
+static struct log_record *log_peek(struct log_ring *ring)
+{
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	struct log_record *rec;
+
+	while (ring->tail != head) {
+		rec = (struct log_record *)&ring->buf[ring->tail & LOG_RING_MASK];
+		if (!rec->wrap)
+			return rec;
+
+		__atomic_store_n(&ring->tail,
+				 ring->tail + LOG_RING_SIZE -
+				 (ring->tail & LOG_RING_MASK), __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void log_flush_stream(int stream)
+{
+	int fd = stream ? STDERR_FILENO : STDOUT_FILENO;
+	size_t off = 0;
+	ssize_t ret;
+
+	while (off < log_out_len[stream]) {
+		ret = write(fd, log_out[stream] + off, log_out_len[stream] - off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += ret;
+	}
+	log_out_len[stream] = 0;
+}
+
+static void log_emit(int level, uint64_t ns, const char *text, size_t len)
+{
+	int stream = level == GBSIM_LOG_ERROR;
+	char prefix[48];
+	int plen;
+
+	plen = snprintf(prefix, sizeof(prefix), "[%5llu.%06llu] [%c] GBSIM: ",
+			(unsigned long long)(ns / 1000000000ULL),
+			(unsigned long long)(ns % 1000000000ULL) / 1000,
+			log_prefix[level]);
+
+	if (log_out_len[stream] + plen + len > sizeof(log_out[stream]))
+		log_flush_stream(stream);
+
+	memcpy(log_out[stream] + log_out_len[stream], prefix, plen);
+	memcpy(log_out[stream] + log_out_len[stream] + plen, text, len);
+	log_out_len[stream] += plen + len;
+}
+
+/*
+ * Write out everything queued so far, merging the rings in timestamp order,
+ * and release the rings of the threads that are gone.
+ */
+static void log_drain(void)
+{
+	struct log_ring *ring, *oldest, *next;
+	struct log_record *rec, *first;
+	unsigned int dropped;
+	char text[64];
+	int len;
+
+	pthread_mutex_lock(&log_lock);
+
+	while (1) {
+		oldest = NULL;
+		first = NULL;
+		TAILQ_FOREACH(ring, &log_rings, rnode) {
+			rec = log_peek(ring);
+			if (rec && (!first || rec->ns < first->ns)) {
+				first = rec;
+				oldest = ring;
+			}
+		}
+
+		if (!oldest)
+			break;
+
+		log_emit(first->level, first->ns, first->text, first->len);
+		__atomic_store_n(&oldest->tail,
+				 oldest->tail + LOG_RECORD_SIZE(first->len),
+				 __ATOMIC_RELEASE);
+	}
+
+	for (ring = TAILQ_FIRST(&log_rings); ring; ring = next) {
+		next = TAILQ_NEXT(ring, rnode);
+
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			len = snprintf(text, sizeof(text),
+				       "%u log messages dropped\n",
+				       dropped - ring->reported);
+			log_emit(GBSIM_LOG_ERROR, log_now(), text, len);
+			ring->reported = dropped;
+		}
+
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+		    !log_peek(ring)) {
+			TAILQ_REMOVE(&log_rings, ring, rnode);
+			free(ring);
+		}
+	}
+
+	pthread_mutex_unlock(&log_lock);
+
+	log_flush_stream(0);
+	log_flush_stream(1);
+}
+
+static void *log_thread(void *param)
+{
+	struct timespec interval = {
+		.tv_sec = 0,
+		.tv_nsec = LOG_DRAIN_NS,
+	};
+
+	while (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		nanosleep(&interval, NULL);
+		log_drain();
+	}
+
+	return NULL;
+}
+
+int log_init(void)
+{
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &log_start);
+
+	ret = pthread_key_create(&log_key, log_thread_exit);
+	if (ret)
+		return -ret;
+
+	__atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+
+	ret = pthread_create(&log_pthread, NULL, log_thread, NULL);
+	if (ret) {
+		__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+		pthread_key_delete(log_key);
+		return -ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Stop the drain thread and write out what is left. Lines logged from then
+ * on are written directly.
+ */
+void log_exit(void)
+{
+	if (!__atomic_exchange_n(&log_running, 0, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_join(log_pthread, NULL);
+
+	log_drain();
+}
@@ -37,6 +37,7 @@ enum {
 };
 
 struct gb_loopback {
+	TAILQ_ENTRY(gb_loopback) lnode;
 	uint16_t	cport_id;
 	uint16_t	hd_cport_id;
 	uint8_t		id;
@@ -48,7 +49,10 @@ struct gb_loopback {
 	int		state;
 };
 
-static struct gb_loopback gblb;
+/* Loopback ports, one per connection, walked by the loopback thread */
+static TAILQ_HEAD(lbhead, gb_loopback) loopback_ports =
+	TAILQ_HEAD_INITIALIZER(loopback_ports);
+static pthread_mutex_t loopback_lock = PTHREAD_MUTEX_INITIALIZER;
 static bool terminate_thread;
 static int thread_started;
 static int port_count;
@@ -81,26 +85,36 @@ static void *loopback_thread(void *param)
 	pthread_barrier_wait(&loopback_barrier);
 
 	while (!terminate_thread) {
-		if (!gblb.init)
-			state = LOOPBACK_FSM_IDLE;
-		else
-			state = gblb.state;
-
-		switch (state) {
-		case LOOPBACK_FSM_PING_HOST:
-			gb_loopback_ping_host(&gblb);
-			break;
-		case LOOPBACK_FSM_TRANSFER_HOST:
-			gb_loopback_transfer_host(&gblb, gblb.size);
-			break;
-		case LOOPBACK_FSM_SINK_HOST:
-			gb_loopback_sink_host(&gblb, gblb.size);
-			break;
-		case LOOPBACK_FSM_IDLE:
-		default:
-			sleep(1);
-			continue;
+		struct gb_loopback *gblbp;
+		bool busy = false;
+
+		pthread_mutex_lock(&loopback_lock);
+		TAILQ_FOREACH(gblbp, &loopback_ports, lnode) {
+			if (!gblbp->init)
+				state = LOOPBACK_FSM_IDLE;
+			else
+				state = gblbp->state;
+
+			switch (state) {
+			case LOOPBACK_FSM_PING_HOST:
+				gb_loopback_ping_host(gblbp);
+				break;
+			case LOOPBACK_FSM_TRANSFER_HOST:
+				gb_loopback_transfer_host(gblbp, gblbp->size);
+				break;
+			case LOOPBACK_FSM_SINK_HOST:
+				gb_loopback_sink_host(gblbp, gblbp->size);
+				break;
+			case LOOPBACK_FSM_IDLE:
+			default:
+				continue;
+			}
+			busy = true;
 		}
+		pthread_mutex_unlock(&loopback_lock);
+
+		if (!busy)
+			sleep(1);
 	}
 
 	gbsim_info("Loopback thread exit\n");
@@ -108,26 +122,27 @@ static void *loopback_thread(void *param)
 	return NULL;
 }
 
-static void loopback_init_port(uint8_t module_id, uint16_t cport_id,
-			  uint16_t hd_cport_id, uint8_t id)
+static void loopback_init_port(struct gb_loopback *gblbp, uint8_t module_id,
+			       uint16_t cport_id, uint16_t hd_cport_id,
+			       uint8_t id)
 {
-	gblb.module_id = module_id;
-	gblb.cport_id = cport_id;
-	gblb.hd_cport_id = hd_cport_id;
-	gblb.id = id;
-	gblb.init = true;
+	gblbp->module_id = module_id;
+	gblbp->cport_id = cport_id;
+	gblbp->hd_cport_id = hd_cport_id;
+	gblbp->id = id;
+	gblbp->init = true;
 	gbsim_debug("Loopback Module %hu Cport %hhu HDCport %hhu index %d\n",
 		    module_id, cport_id, hd_cport_id, port_count);
 }
 
 
-int loopback_handler(struct gbsim_connection *connection, void *rbuf,
+static int loopback_handler(struct gbsim_connection *connection, void *rbuf,
 		 size_t rsize, void *tbuf, size_t tsize)
 {
-	char data[GB_OPERATION_DATA_SIZE_MAX];
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
-	struct op_msg *op_rsp = (struct op_msg *)data;
+	struct op_msg *op_rsp = tbuf;
+	struct iovec payload = { 0 };
 	size_t payload_size = 0;
 	__le32 len;
 	uint16_t message_size;
@@ -138,29 +153,49 @@ int loopback_handler(struct gbsim_connection *connection, void *rbuf,
 	struct gb_loopback_transfer_request *request;
 	struct gb_loopback_transfer_response *response = &op_rsp->loopback_xfer_resp;
 
-	module_id = cport_to_module_id(cport_id);
+	module_id = connection_module_id(connection);
 
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
 
 	/* Associate the module_id and cport_id with the device fd */
-	loopback_init_port(module_id, cport_id, hd_cport_id, oph->operation_id);
+	loopback_init_port(connection->priv, module_id, cport_id, hd_cport_id,
+			   oph->operation_id);
 
 	switch (oph->type) {
 	case GB_LOOPBACK_TYPE_PING:
 		break;
 	case GB_LOOPBACK_TYPE_TRANSFER:
 		request = &op_req->loopback_xfer_req;
-		gbsim_debug("%s: LOOPBACK xfer rx %hu\n", __func__,
-			    request->len);
-		if (request->len > GB_OPERATION_DATA_SIZE_MAX) {
-			gbsim_error("Module %hhu -> AP Cport %hu rx %hu bytes\n",
-				    module_id, cport_id, request->len);
+		len = le32toh(request->len);
+		gbsim_debug("%s: LOOPBACK xfer rx %u\n", __func__, len);
+		/* Only echo what the AP did send */
+		if (len > GB_OPERATION_DATA_SIZE_MAX ||
+		    sizeof(*oph) + sizeof(*request) + len > rsize) {
+			gbsim_error("Module %hhu -> AP Cport %hu rx %u bytes\n",
+				    module_id, cport_id, len);
 			result = PROTOCOL_STATUS_INVALID;
 		} else {
-			len = le32toh(request->len);
 			response->len = htole32(len);
-			memcpy(&response->data, request->data, len);
-			payload_size = sizeof(*response) + len;
+			payload_size = sizeof(*response);
+
+			/* Echo the data straight from the request */
+			payload.iov_base = request->data;
+			payload.iov_len = len;
+
+			/*
+			 * With latency tagging, report the time spent in the
+			 * simulator the way the firmware does: overall in
+			 * reserved0, where gb_loopback takes the APBridge
+			 * latency from, and in the handler in reserved1, its
+			 * GPBridge latency.
+			 */
+			if (latency_tag_enabled(hd_cport_id)) {
+				uint32_t bridge_us, handler_us;
+
+				latency_tag_times(&bridge_us, &handler_us);
+				response->reserved0 = htole32(bridge_us);
+				response->reserved1 = htole32(handler_us);
+			}
 		}
 		break;
 	case GB_LOOPBACK_TYPE_SINK:
@@ -173,11 +208,12 @@ int loopback_handler(struct gbsim_connection *connection, void *rbuf,
 	}
 
 	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
-	return send_response(hd_cport_id, op_rsp, message_size,
-				oph->operation_id, oph->type, result);
+	return send_response_iov(hd_cport_id, op_rsp, message_size,
+				 &payload, payload.iov_len ? 1 : 0,
+				 oph->operation_id, oph->type, result);
 }
 
-char *loopback_get_operation(uint8_t type)
+static char *loopback_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -193,7 +229,7 @@ char *loopback_get_operation(uint8_t type)
 	}
 }
 
-void loopback_cleanup(void)
+static void loopback_cleanup(void)
 {
 	if (thread_started) {
 		/* signal termination */
@@ -205,7 +241,7 @@ void loopback_cleanup(void)
 	}
 }
 
-void loopback_init(void)
+static void loopback_init(void)
 {
 	int ret;
 
@@ -222,3 +258,48 @@ void loopback_init(void)
 	thread_started = 1;
 	pthread_barrier_wait(&loopback_barrier);
 }
+
+static int loopback_connection_init(struct gbsim_connection *connection)
+{
+	struct gb_loopback *gblbp;
+
+	gblbp = calloc(1, sizeof(*gblbp));
+	if (!gblbp)
+		return -ENOMEM;
+
+	pthread_mutex_init(&gblbp->loopback_data, NULL);
+
+	pthread_mutex_lock(&loopback_lock);
+	TAILQ_INSERT_TAIL(&loopback_ports, gblbp, lnode);
+	port_count++;
+	pthread_mutex_unlock(&loopback_lock);
+
+	connection->priv = gblbp;
+
+	return 0;
+}
+
+static void loopback_connection_exit(struct gbsim_connection *connection)
+{
+	struct gb_loopback *gblbp = connection->priv;
+
+	pthread_mutex_lock(&loopback_lock);
+	TAILQ_REMOVE(&loopback_ports, gblbp, lnode);
+	port_count--;
+	pthread_mutex_unlock(&loopback_lock);
+
+	pthread_mutex_destroy(&gblbp->loopback_data);
+	free(gblbp);
+}
+
+static struct gbsim_protocol loopback_protocol = {
+	.id		= GREYBUS_PROTOCOL_LOOPBACK,
+	.name		= "LOOPBACK",
+	.handler	= loopback_handler,
+	.get_operation	= loopback_get_operation,
+	.init		= loopback_init,
+	.cleanup	= loopback_cleanup,
+	.connection_init = loopback_connection_init,
+	.connection_exit = loopback_connection_exit,
+};
+GBSIM_PROTOCOL(loopback_protocol);
@@ -7,15 +7,16 @@
  * Provided under the three clause BSD license found in the LICENSE file.
  */
 
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-#include <usbg/usbg.h>
-
 #include "gbsim.h"
 
 int bbb_backend = 0;
@@ -24,39 +25,80 @@ int uart_portno = 0;
 int uart_count = 0;
 char *hotplug_basedir;
 int verbose = 0;
+int worker_count = 4;
+char *capture_file;
+char *replay_file;
+int replay_fast;
 
-static usbg_state *s;
-static usbg_gadget *g;
+char *socket_address;
+char *stats_file;
+struct gbsim_transport *transport = &functionfs_transport;
 
 static struct sigaction sigact;
+static volatile sig_atomic_t exiting;
+static int exit_pipe[2] = { -1, -1 };
 
-struct gbsim_interface interface;
+/* Readable once a signal asked gbsim to exit, for the transport loops */
+int exit_fd = -1;
 
-static void cleanup(void)
+bool exit_requested(void)
 {
-	printf("cleaning up\n");
-	sigemptyset(&sigact.sa_mask);
-
-	uart_cleanup();
-	gadget_cleanup(s, g);
-	functionfs_cleanup();
-	svc_exit();
+	return exiting;
 }
 
+/* Only what is async-signal-safe, main() tears down once the loop is out */
 static void signal_handler(int sig)
 {
-	if (sig == SIGINT || sig == SIGHUP || sig == SIGTERM)
-		cleanup();
+	int saved_errno = errno;
+
+	exiting = 1;
+	if (write(exit_pipe[1], "x", 1) < 0) {
+		/* Already full, the loops have been woken */
+	}
+
+	errno = saved_errno;
 }
 
-static void signals_init(void)
+static int signals_init(void)
 {
+	sigset_t set;
+
+	if (pipe2(exit_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+		return -errno;
+	exit_fd = exit_pipe[0];
+
 	sigact.sa_handler = signal_handler;
 	sigemptyset(&sigact.sa_mask);
 	sigact.sa_flags = 0;
 	sigaction(SIGINT, &sigact, (struct sigaction *)NULL);
 	sigaction(SIGHUP, &sigact, (struct sigaction *)NULL);
 	sigaction(SIGTERM, &sigact, (struct sigaction *)NULL);
+
+	/*
+	 * Statistics requests are only picked up by the stats thread, and
+	 * exit requests only by the main thread once it runs the transport
+	 * loop, so that they interrupt whatever it is blocked on.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	return 0;
+}
+
+/* Let the exit signals in on the calling thread only */
+static void signals_unblock(void)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 }
 
 int main(int argc, char *argv[])
@@ -64,20 +106,77 @@ int main(int argc, char *argv[])
 	int ret = -EINVAL;
 	int o;
 
-	while ((o = getopt(argc, argv, ":bh:i:u:U:v")) != -1) {
+	while ((o = getopt(argc, argv, ":bc:F:h:H:i:I:L:P:r:R:s:S:u:U:vw:")) != -1) {
 		switch (o) {
 		case 'b':
 			bbb_backend = 1;
 			printf("bbb_backend %d\n", bbb_backend);
 			break;
+		case 'c':
+			capture_file = optarg;
+			printf("capture_file %s\n", capture_file);
+			break;
+		case 'F':
+			if (fw_fetch_parse(optarg)) {
+				gbsim_error("invalid firmware fetch settings %s\n",
+					    optarg);
+				return 1;
+			}
+			printf("firmware fetch %s\n", optarg);
+			break;
 		case 'h':
 			hotplug_basedir = optarg;
 			printf("hotplug_basedir %s\n", hotplug_basedir);
 			break;
+		case 'H':
+			if (storm_parse(optarg)) {
+				gbsim_error("invalid hotplug storm %s\n", optarg);
+				return 1;
+			}
+			printf("hotplug storm %s\n", optarg);
+			break;
 		case 'i':
 			i2c_adapter = atoi(optarg);
 			printf("i2c_adapter %d\n", i2c_adapter);
 			break;
+		case 'I':
+			if (interface_slots_parse(optarg)) {
+				gbsim_error("invalid interface slots %s\n",
+					    optarg);
+				return 1;
+			}
+			printf("interface slots %s\n", optarg);
+			break;
+		case 'L':
+			if (unipro_latency_parse(optarg)) {
+				gbsim_error("invalid link latencies %s\n",
+					    optarg);
+				return 1;
+			}
+			printf("link latencies %s\n", optarg);
+			break;
+		case 'P':
+			if (pwrmon_parse(optarg)) {
+				gbsim_error("invalid power rails %s\n", optarg);
+				return 1;
+			}
+			printf("power rails %s\n", optarg);
+			break;
+		case 'R':
+			replay_fast = 1;
+			/* fall through */
+		case 'r':
+			replay_file = optarg;
+			printf("replay_file %s\n", replay_file);
+			break;
+		case 's':
+			socket_address = optarg;
+			printf("socket_address %s\n", socket_address);
+			break;
+		case 'S':
+			stats_file = optarg;
+			printf("stats_file %s\n", stats_file);
+			break;
 		case 'u':
 			uart_portno = atoi(optarg);
 			printf("uart_portno %d\n", uart_portno);
@@ -90,15 +189,39 @@ int main(int argc, char *argv[])
 			verbose = 1;
 			printf("verbose %d\n", verbose);
 			break;
+		case 'w':
+			worker_count = atoi(optarg);
+			printf("worker_count %d\n", worker_count);
+			break;
 		case ':':
-			if (optopt == 'i')
+			if (optopt == 'c')
+				gbsim_error("capture file required\n");
+			else if (optopt == 'i')
 				gbsim_error("i2c_adapter required\n");
+			else if (optopt == 'F')
+				gbsim_error("firmware fetch settings required\n");
 			else if (optopt == 'h')
 				gbsim_error("hotplug_basedir required\n");
+			else if (optopt == 'H')
+				gbsim_error("hotplug storm settings required\n");
+			else if (optopt == 'I')
+				gbsim_error("interface slots required\n");
+			else if (optopt == 'L')
+				gbsim_error("link latencies required\n");
+			else if (optopt == 'P')
+				gbsim_error("power rails required\n");
+			else if (optopt == 'r' || optopt == 'R')
+				gbsim_error("replay file required\n");
+			else if (optopt == 's')
+				gbsim_error("socket address required\n");
+			else if (optopt == 'S')
+				gbsim_error("stats file required\n");
 			else if (optopt == 'u')
 				gbsim_error("uart_portno required\n");
 			else if (optopt == 'U')
 				gbsim_error("uart_count required\n");
+			else if (optopt == 'w')
+				gbsim_error("worker_count required\n");
 			else
 				gbsim_error("-%c requires an argument\n",
 					optopt);
@@ -115,38 +238,71 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (!hotplug_basedir) {
+	if (!hotplug_basedir && !replay_file && !storm_enabled()) {
 		gbsim_error("hotplug directory not specified, aborting\n");
 		return 1;
 	}
 
-	signals_init();
+	if (worker_count < 0) {
+		gbsim_error("invalid worker count %d, aborting\n", worker_count);
+		return 1;
+	}
+
+	ret = signals_init();
+	if (ret < 0) {
+		gbsim_error("failed to set up signals (%d)\n", ret);
+		return 1;
+	}
+
+	ret = log_init();
+	if (ret < 0) {
+		gbsim_error("failed to start the logger (%d)\n", ret);
+		return 1;
+	}
 
-	TAILQ_INIT(&interface.connections);
+	ret = message_pool_init();
+	if (ret < 0)
+		goto out;
 
-	ret = gadget_create(&s, &g);
+	ret = capture_init();
 	if (ret < 0)
 		goto out;
 
-	ret = functionfs_init();
+	ret = stats_init();
 	if (ret < 0)
 		goto out;
 
-	ret = gadget_enable(g);
+	if (replay_file)
+		transport = &replay_transport;
+	else if (socket_address)
+		transport = &socket_transport;
+
+	ret = transport->init();
 	if (ret < 0)
 		goto out;
 
-	/* Protocol handlers */
-	svc_init();
-	gpio_init();
-	i2c_init();
-	uart_init();
-	sdio_init();
-	loopback_init();
+	protocols_init();
 
-	ret = functionfs_loop();
+	ret = dispatch_init();
+	if (ret < 0)
+		goto out_protocols;
+
+	signals_unblock();
+	ret = transport->loop();
+
+out_protocols:
+	printf("cleaning up\n");
+
+	/* Write out pending logs, what follows is logged synchronously */
+	log_exit();
+	capture_exit();
+
+	transport->exit();
+	protocols_cleanup();
+	return ret;
 
 out:
+	capture_exit();
+	log_exit();
 	return ret;
 }
-
@@ -8,35 +8,64 @@
  */
 
 #include <errno.h>
-
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <linux/types.h>
 
 #include "gbsim.h"
 
 /*
- * Greybus kernel assigns hd-cport-ids to cports in the order they are present
- * in manifest. To match that here, we can just use a simple counter.
+ * Manifest blobs are read and parsed once, into a table of their CPorts,
+ * and kept in a cache keyed by path, modification time and size, so a
+ * module inserted again costs a stat() and nothing else. Interfaces share
+ * the cached manifests, which are reference counted; the cache holds one
+ * reference to each, and drops it when the file changes or when the least
+ * recently used manifests make room for new ones.
  */
-static uint16_t hd_cport_id_counter;
-static int control_done;
 
-static uint16_t allocate_hd_cport_id(void)
+#define MANIFEST_CACHE_MAX	64
+
+static TAILQ_HEAD(mfhead, gbsim_manifest) manifest_cache =
+	TAILQ_HEAD_INITIALIZER(manifest_cache);
+static unsigned int manifest_cache_count;
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int manifest_cport_protocol(struct gbsim_manifest *m, uint16_t cport_id)
 {
-	/*
-	 * AP's hd_cport_id GB_SVC_CPORT_ID is reserved and must not be used for
-	 * other protocols.
-	 */
-	if (hd_cport_id_counter == GB_SVC_CPORT_ID)
-		++hd_cport_id_counter;
-
-	return hd_cport_id_counter++;
+	unsigned int i;
+
+	for (i = 0; i < m->cport_count; i++)
+		if (m->cports[i].id == cport_id)
+			return m->cports[i].protocol;
+
+	return -ENOENT;
 }
 
-void reset_hd_cport_id(void)
+static int manifest_add_cport(struct gbsim_manifest *m, uint16_t cport_id,
+			      uint8_t protocol)
 {
-	hd_cport_id_counter = 0;
+	struct gbsim_cport *cports;
+
+	if (manifest_cport_protocol(m, cport_id) >= 0) {
+		gbsim_error("cport %hu described twice\n", cport_id);
+		return -EEXIST;
+	}
+
+	cports = realloc(m->cports, (m->cport_count + 1) * sizeof(*cports));
+	if (!cports)
+		return -ENOMEM;
+
+	cports[m->cport_count].id = cport_id;
+	cports[m->cport_count].protocol = protocol;
+	m->cports = cports;
+	m->cport_count++;
+
+	return 0;
 }
 
 /*
@@ -49,11 +78,13 @@ void reset_hd_cport_id(void)
  * Returns the number of bytes consumed by the descriptor, or a
  * negative errno.
  */
-static int identify_descriptor(struct greybus_descriptor *desc, size_t size)
+static int identify_descriptor(struct gbsim_manifest *m,
+			       struct greybus_descriptor *desc, size_t size)
 {
 	struct greybus_descriptor_header *desc_header = &desc->header;
 	size_t expected_size;
 	size_t desc_size;
+	int ret;
 
 	if (size < sizeof(*desc_header)) {
 		gbsim_error("manifest too small\n");
@@ -86,21 +117,11 @@ static int identify_descriptor(struct greybus_descriptor *desc, size_t size)
 	case GREYBUS_TYPE_CPORT:
 		expected_size += sizeof(struct greybus_descriptor_cport);
 
-		/*
-		 * Module's control protocol's node might not be present in
-		 * manifest, and the first allocated cport should be for control
-		 * protocol.
-		 */
-		if (!control_done &&
-			(le16toh(desc->cport.id) != GB_CONTROL_CPORT_ID)) {
-			allocate_connection(GB_CONTROL_CPORT_ID,
-					allocate_hd_cport_id(),
-					GREYBUS_PROTOCOL_CONTROL);
-		}
-
-		control_done = 1;
-		allocate_connection(le16toh(desc->cport.id), allocate_hd_cport_id(),
-				desc->cport.protocol_id);
+		/* Connections are made when the AP binds the cport */
+		ret = manifest_add_cport(m, le16toh(desc->cport.id),
+					 desc->cport.protocol_id);
+		if (ret)
+			return ret;
 		break;
 	case GREYBUS_TYPE_INVALID:
 	default:
@@ -144,13 +165,18 @@ static int identify_descriptor(struct greybus_descriptor *desc, size_t size)
  * After that we look for the interface's bundles--there must be at
  * least one of those.
  *
+ * The CPorts found are recorded in the manifest, with the control CPort
+ * the module's control protocol's node might leave out.
+ *
  * Returns true if parsing was successful, false otherwise.
  */
-bool manifest_parse(void *data, size_t size)
+static bool manifest_parse(struct gbsim_manifest *m)
 {
 	struct greybus_manifest *manifest;
 	struct greybus_manifest_header *header;
 	struct greybus_descriptor *desc;
+	void *data = m->data;
+	size_t size = m->size;
 	__u16 manifest_size;
 
 	/* we have to have at _least_ the manifest header */
@@ -181,13 +207,10 @@ bool manifest_parse(void *data, size_t size)
 	desc = (struct greybus_descriptor *)(header + 1);
 	size -= sizeof(*header);
 
-	/* Reset control protocol's counter */
-	control_done = 0;
-
 	while (size) {
 		int desc_size;
 
-		desc_size = identify_descriptor(desc, size);
+		desc_size = identify_descriptor(m, desc, size);
 		if (desc_size < 0)
 			return false;
 
@@ -195,5 +218,187 @@ bool manifest_parse(void *data, size_t size)
 		size -= desc_size;
 	}
 
+	if (manifest_cport_protocol(m, GB_CONTROL_CPORT_ID) < 0 &&
+	    manifest_add_cport(m, GB_CONTROL_CPORT_ID,
+			       GREYBUS_PROTOCOL_CONTROL))
+		return false;
+
 	return true;
 }
+
+static void manifest_free(struct gbsim_manifest *m)
+{
+	free(m->data);
+	free(m->cports);
+	free(m->path);
+	free(m);
+}
+
+void manifest_hold(struct gbsim_manifest *m)
+{
+	if (m)
+		__atomic_add_fetch(&m->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void manifest_put(struct gbsim_manifest *m)
+{
+	if (m && !__atomic_sub_fetch(&m->refcount, 1, __ATOMIC_ACQ_REL))
+		manifest_free(m);
+}
+
+/* Read a manifest blob file and parse it */
+static struct gbsim_manifest *manifest_load(const char *path,
+					    struct stat *st)
+{
+	struct greybus_manifest_header *mh;
+	struct gbsim_manifest *m;
+	size_t len = 0;
+	ssize_t ret;
+	int fd;
+
+	if (st->st_size < sizeof(*mh)) {
+		gbsim_error("bad manifest blob %s\n", path);
+		return NULL;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->refcount = 1;
+	m->path = strdup(path);
+	m->mtime = st->st_mtim;
+	m->file_size = st->st_size;
+
+	m->data = malloc(m->file_size);
+	if (!m->data)
+		goto err_free;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		gbsim_error("failed to open manifest blob %s\n", path);
+		goto err_free;
+	}
+
+	while (len < m->file_size) {
+		ret = read(fd, m->data + len, m->file_size - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+	close(fd);
+	if (len < sizeof(*mh)) {
+		gbsim_error("failed to read manifest blob %s\n", path);
+		goto err_free;
+	}
+
+	/* The blob may be followed by padding */
+	mh = m->data;
+	m->size = le16toh(mh->size);
+	if (m->size < sizeof(*mh) || m->size > len) {
+		gbsim_error("bad manifest size %zu in %s\n", m->size, path);
+		goto err_free;
+	}
+
+	if (!m->path || !manifest_parse(m))
+		goto err_free;
+
+	return m;
+
+err_free:
+	manifest_free(m);
+	return NULL;
+}
+
+/*
+ * Get the manifest of a blob file, parsed, from the cache if the file is
+ * unchanged since it was loaded.
+ */
+struct gbsim_manifest *manifest_get(const char *path)
+{
+	struct gbsim_manifest *m, *stale = NULL;
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		gbsim_error("failed to stat manifest blob %s (%d)\n", path,
+			    errno);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&manifest_lock);
+	TAILQ_FOREACH(m, &manifest_cache, node) {
+		if (strcmp(m->path, path))
+			continue;
+
+		if (m->file_size == st.st_size &&
+		    m->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    m->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+			/* Most recently used first */
+			TAILQ_REMOVE(&manifest_cache, m, node);
+			TAILQ_INSERT_HEAD(&manifest_cache, m, node);
+			manifest_hold(m);
+			pthread_mutex_unlock(&manifest_lock);
+			return m;
+		}
+
+		TAILQ_REMOVE(&manifest_cache, m, node);
+		manifest_cache_count--;
+		stale = m;
+		break;
+	}
+	pthread_mutex_unlock(&manifest_lock);
+
+	manifest_put(stale);
+
+	m = manifest_load(path, &st);
+	if (!m)
+		return NULL;
+
+	gbsim_debug("manifest %s loaded, %u cports\n", path, m->cport_count);
+
+	/* One reference for the cache, one for the caller */
+	manifest_hold(m);
+
+	pthread_mutex_lock(&manifest_lock);
+	TAILQ_INSERT_HEAD(&manifest_cache, m, node);
+	if (++manifest_cache_count > MANIFEST_CACHE_MAX) {
+		stale = TAILQ_LAST(&manifest_cache, mfhead);
+		TAILQ_REMOVE(&manifest_cache, stale, node);
+		manifest_cache_count--;
+	} else {
+		stale = NULL;
+	}
+	pthread_mutex_unlock(&manifest_lock);
+
+	manifest_put(stale);
+
+	return m;
+}
+
+/* Parse a manifest found in memory, into a copy outside of the cache */
+struct gbsim_manifest *manifest_create(const void *data, size_t size)
+{
+	struct gbsim_manifest *m;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->refcount = 1;
+	m->size = size;
+	m->data = malloc(size);
+	if (!m->data) {
+		free(m);
+		return NULL;
+	}
+	memcpy(m->data, data, size);
+
+	if (!manifest_parse(m)) {
+		manifest_free(m);
+		return NULL;
+	}
+
+	return m;
+}
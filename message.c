@@ -0,0 +1,182 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+
+#include "gbsim.h"
+
+/*
+ * Pool of message buffers.
+ *
+ * Buffers are recycled instead of going back to malloc() for every message
+ * read from or written to the AP. Each thread keeps a small cache of free
+ * buffers it can use without locking. The readers allocate buffers and the
+ * workers free them, so a thread whose cache is full hands half of it over
+ * to the shared pool, and a thread whose cache is empty refills it from
+ * there. Only when the shared pool is empty too is a buffer malloc()ed.
+ *
+ * Buffers aren't zeroed: readers fill them with exactly the size they
+ * account for.
+ */
+
+#define MESSAGE_PREALLOC	256
+#define MESSAGE_CACHE		32
+/* Beyond that, buffers freed after a burst go back to malloc() */
+#define MESSAGE_POOL_MAX	1024
+
+struct message_cache {
+	bool registered;
+	unsigned int count;
+	struct gbsim_message *msgs[MESSAGE_CACHE];
+};
+
+static TAILQ_HEAD(phead, gbsim_message) message_pool =
+	TAILQ_HEAD_INITIALIZER(message_pool);
+static pthread_mutex_t message_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t message_key;
+static unsigned int pool_count;
+
+/* Counters, reported with the statistics */
+static uint64_t cache_hits;
+static uint64_t pool_hits;
+static uint64_t misses;
+static uint64_t allocated;
+
+static __thread struct message_cache message_cache;
+
+static struct message_cache *message_get_cache(void)
+{
+	struct message_cache *cache = &message_cache;
+
+	/* Have the cache flushed to the shared pool when the thread exits */
+	if (!cache->registered) {
+		pthread_setspecific(message_key, cache);
+		cache->registered = true;
+	}
+
+	return cache;
+}
+
+/* Move up to count buffers from the shared pool to the thread's cache */
+static void message_refill(struct message_cache *cache, unsigned int count)
+{
+	struct gbsim_message *msg;
+
+	pthread_mutex_lock(&message_lock);
+	while (count-- && (msg = TAILQ_FIRST(&message_pool))) {
+		TAILQ_REMOVE(&message_pool, msg, mnode);
+		pool_count--;
+		cache->msgs[cache->count++] = msg;
+	}
+	pthread_mutex_unlock(&message_lock);
+}
+
+/* Move count buffers from the thread's cache to the shared pool */
+static void message_spill(struct message_cache *cache, unsigned int count)
+{
+	struct gbsim_message *msg;
+
+	pthread_mutex_lock(&message_lock);
+	while (count--) {
+		msg = cache->msgs[--cache->count];
+		if (pool_count >= MESSAGE_POOL_MAX) {
+			free(msg);
+			__atomic_sub_fetch(&allocated, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		TAILQ_INSERT_HEAD(&message_pool, msg, mnode);
+		pool_count++;
+	}
+	pthread_mutex_unlock(&message_lock);
+}
+
+struct gbsim_message *message_alloc(void)
+{
+	struct message_cache *cache = message_get_cache();
+	struct gbsim_message *msg;
+
+	if (cache->count) {
+		__atomic_add_fetch(&cache_hits, 1, __ATOMIC_RELAXED);
+		return cache->msgs[--cache->count];
+	}
+
+	message_refill(cache, MESSAGE_CACHE / 2);
+	if (cache->count) {
+		__atomic_add_fetch(&pool_hits, 1, __ATOMIC_RELAXED);
+		return cache->msgs[--cache->count];
+	}
+
+	__atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+
+	msg = malloc(sizeof(*msg));
+	if (!msg) {
+		gbsim_error("failed to allocate message buffer\n");
+		return NULL;
+	}
+	__atomic_add_fetch(&allocated, 1, __ATOMIC_RELAXED);
+
+	return msg;
+}
+
+void message_free(struct gbsim_message *msg)
+{
+	struct message_cache *cache;
+
+	if (!msg)
+		return;
+
+	cache = message_get_cache();
+	if (cache->count == MESSAGE_CACHE)
+		message_spill(cache, MESSAGE_CACHE / 2);
+
+	cache->msgs[cache->count++] = msg;
+}
+
+/* Hand the cache of an exiting thread back to the shared pool */
+static void message_thread_exit(void *arg)
+{
+	struct message_cache *cache = arg;
+
+	message_spill(cache, cache->count);
+}
+
+void message_pool_dump(FILE *f)
+{
+	fprintf(f, "message buffers: %llu allocated, %u pooled, %llu cache hits, %llu pool hits, %llu misses\n",
+		(unsigned long long)allocated, pool_count,
+		(unsigned long long)cache_hits,
+		(unsigned long long)pool_hits,
+		(unsigned long long)misses);
+}
+
+int message_pool_init(void)
+{
+	struct gbsim_message *msg;
+	int i, ret;
+
+	ret = pthread_key_create(&message_key, message_thread_exit);
+	if (ret)
+		return -ret;
+
+	for (i = 0; i < MESSAGE_PREALLOC; i++) {
+		msg = malloc(sizeof(*msg));
+		if (!msg)
+			break;
+		TAILQ_INSERT_HEAD(&message_pool, msg, mnode);
+	}
+	pool_count = i;
+	allocated = i;
+
+	return 0;
+}
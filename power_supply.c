@@ -7,6 +7,7 @@
  * Provided under the three clause BSD license found in the LICENSE file.
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -34,8 +35,6 @@ struct gb_power_supply {
 	struct psy_property	*props;
 };
 
-static struct gb_power_supply *gpsy[PSY_COUNT];
-
 static struct gb_power_supply bq27510 = {
 	.manufacturer	= "gl",
 	.serial_number	= "EAEA-AEAE",
@@ -152,9 +151,15 @@ static struct gb_power_supply *set_properties(struct gb_power_supply *psy_type,
 	int i;
 
 	psy = calloc(1, sizeof(*psy));
+	if (!psy)
+		return NULL;
 
 	*psy = *psy_type;
 	psy->props = calloc(psy->props_count, sizeof(struct psy_property));
+	if (!psy->props) {
+		free(psy);
+		return NULL;
+	}
 	for (i = 0; i < psy->props_count; i++)
 		psy->props[i] = props[i];
 
@@ -163,7 +168,7 @@ static struct gb_power_supply *set_properties(struct gb_power_supply *psy_type,
 
 static struct gb_power_supply *power_supply_init(int id)
 {
-	struct gb_power_supply *psy;
+	struct gb_power_supply *psy = NULL;
 
 	switch(id) {
 	case 0:
@@ -182,7 +187,8 @@ static struct gb_power_supply *power_supply_init(int id)
 		gbsim_debug("power_supply: wrong power supply id %d\n", id);
 		break;
 	}
-	psy->id = id;
+	if (psy)
+		psy->id = id;
 
 	return psy;
 }
@@ -197,9 +203,10 @@ static struct psy_property *power_supply_get_psy_prop(struct gb_power_supply *ps
 	return NULL;
 }
 
-int power_supply_handler(struct gbsim_connection *connection, void *rbuf,
+static int power_supply_handler(struct gbsim_connection *connection, void *rbuf,
 		    size_t rsize, void *tbuf, size_t tsize)
 {
+	struct gb_power_supply **gpsy = connection->priv;
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp;
@@ -221,9 +228,6 @@ int power_supply_handler(struct gbsim_connection *connection, void *rbuf,
 	case GB_POWER_SUPPLY_TYPE_GET_SUPPLIES:
 		payload_size = sizeof(struct gb_power_supply_get_supplies_response);
 		op_rsp->psy_get_supplies_rsp.supplies_count = PSY_COUNT;
-
-		for (i = 0; i < PSY_COUNT; i++)
-			gpsy[i] = power_supply_init(i);
 		break;
 	case GB_POWER_SUPPLY_TYPE_GET_DESCRIPTION:
 		payload_size = sizeof(struct gb_power_supply_get_description_response);
@@ -286,7 +290,7 @@ int power_supply_handler(struct gbsim_connection *connection, void *rbuf,
 	return ret;
 }
 
-char *power_supply_get_operation(uint8_t type)
+static char *power_supply_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -305,3 +309,49 @@ char *power_supply_get_operation(uint8_t type)
 		return "(Unknown operation)";
 	}
 }
+
+static void power_supply_connection_exit(struct gbsim_connection *connection)
+{
+	struct gb_power_supply **gpsy = connection->priv;
+	int i;
+
+	for (i = 0; i < PSY_COUNT; i++) {
+		if (!gpsy[i])
+			continue;
+		free(gpsy[i]->props);
+		free(gpsy[i]);
+	}
+	free(gpsy);
+}
+
+/* Each power supply connection has its own set of supplies */
+static int power_supply_connection_init(struct gbsim_connection *connection)
+{
+	struct gb_power_supply **gpsy;
+	int i;
+
+	gpsy = calloc(PSY_COUNT, sizeof(*gpsy));
+	if (!gpsy)
+		return -ENOMEM;
+	connection->priv = gpsy;
+
+	for (i = 0; i < PSY_COUNT; i++) {
+		gpsy[i] = power_supply_init(i);
+		if (!gpsy[i]) {
+			power_supply_connection_exit(connection);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static struct gbsim_protocol power_supply_protocol = {
+	.id		= GREYBUS_PROTOCOL_POWER_SUPPLY,
+	.name		= "POWER_SUPPLY",
+	.handler	= power_supply_handler,
+	.get_operation	= power_supply_get_operation,
+	.connection_init = power_supply_connection_init,
+	.connection_exit = power_supply_connection_exit,
+};
+GBSIM_PROTOCOL(power_supply_protocol);
@@ -0,0 +1,66 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <stdio.h>
+
+#include "gbsim.h"
+
+/*
+ * Registry of the protocol models, indexed by protocol id.
+ *
+ * Each protocol file describes its model with a struct gbsim_protocol and
+ * registers it with GBSIM_PROTOCOL(), which runs before main(). Adding a
+ * protocol therefore only takes a new file.
+ */
+
+static struct gbsim_protocol *protocols[PROTOCOL_MAX];
+
+void protocol_register(struct gbsim_protocol *protocol)
+{
+	if (protocol->id < 0 || protocol->id >= PROTOCOL_MAX ||
+	    !protocol->handler) {
+		gbsim_error("invalid protocol %s\n", protocol->name);
+		return;
+	}
+
+	if (protocols[protocol->id]) {
+		gbsim_error("protocol %02x registered twice, by %s and %s\n",
+			    protocol->id, protocols[protocol->id]->name,
+			    protocol->name);
+		return;
+	}
+
+	protocols[protocol->id] = protocol;
+}
+
+struct gbsim_protocol *protocol_find(int protocol_id)
+{
+	if (protocol_id < 0 || protocol_id >= PROTOCOL_MAX)
+		return NULL;
+
+	return protocols[protocol_id];
+}
+
+void protocols_init(void)
+{
+	int i;
+
+	for (i = 0; i < PROTOCOL_MAX; i++)
+		if (protocols[i] && protocols[i]->init)
+			protocols[i]->init();
+}
+
+void protocols_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < PROTOCOL_MAX; i++)
+		if (protocols[i] && protocols[i]->cleanup)
+			protocols[i]->cleanup();
+}
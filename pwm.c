@@ -23,7 +23,7 @@
 static int pwm_on[2];
 static pwm *pwms[2];
 
-int pwm_handler(struct gbsim_connection *connection, void *rbuf,
+static int pwm_handler(struct gbsim_connection *connection, void *rbuf,
 		size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
@@ -103,7 +103,7 @@ int pwm_handler(struct gbsim_connection *connection, void *rbuf,
 				oph->operation_id, oph->type, result);
 }
 
-char *pwm_get_operation(uint8_t type)
+static char *pwm_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -127,7 +127,7 @@ char *pwm_get_operation(uint8_t type)
 	}
 }
 
-void pwm_init(void)
+static void pwm_init(void)
 {
 	if (bbb_backend) {
 		/* Grab PWM0A and PWM0B found on P9-31 and P9-29 */
@@ -135,3 +135,12 @@ void pwm_init(void)
 		pwms[1] = libsoc_pwm_request(0, 1, LS_GREEDY);
 	}
 }
+
+static struct gbsim_protocol pwm_protocol = {
+	.id		= GREYBUS_PROTOCOL_PWM,
+	.name		= "PWM",
+	.handler	= pwm_handler,
+	.get_operation	= pwm_get_operation,
+	.init		= pwm_init,
+};
+GBSIM_PROTOCOL(pwm_protocol);
@@ -0,0 +1,285 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbsim.h"
+
+/*
+ * Power monitor rails of the SVC.
+ *
+ * The rails are set with -P, as a comma separated list of
+ * "<ids>:<name>=<mV>/<mA>[/<ms>]": the interfaces the rail supplies, as a
+ * list of ids and ranges joined with '+', its nominal voltage, peak current
+ * and the period of its load. "1-4:VSYS=3800/400" gives interfaces 1 to 4 a
+ * rail each, named VSYS_1 to VSYS_4.
+ *
+ * There is no sampling thread: a sample is computed from the time it is
+ * asked for and the state of the interface, so the AP can read them as
+ * often as it likes. A rail is down until the SVC switches V_SYS on for
+ * its interface, idles at a tenth of its peak current until the interface
+ * is activated, and then draws a triangle wave between a quarter of its
+ * peak current and its peak, while the voltage ripples by 1%.
+ */
+
+#define PWRMON_PERIOD_MS	1000
+
+/* As many rail names as fit in a response */
+#define PWRMON_RAIL_MAX							\
+	((ES1_MSG_SIZE - sizeof(struct gb_operation_msg_hdr) -		\
+	  sizeof(struct gb_svc_pwrmon_rail_names_get_response)) /		\
+	 GB_SVC_PWRMON_RAIL_NAME_BUFSIZE)
+
+struct pwrmon_rail {
+	char name[GB_SVC_PWRMON_RAIL_NAME_BUFSIZE];
+	uint8_t intf_id;
+	uint32_t uv;
+	uint32_t ua;
+	uint64_t period_ns;
+	uint64_t phase_ns;
+};
+
+static struct pwrmon_rail pwrmon_rails[PWRMON_RAIL_MAX];
+static unsigned int pwrmon_rail_count;
+
+static int pwrmon_rail_add(uint8_t intf_id, const char *name,
+			   unsigned long mv, unsigned long ma,
+			   unsigned long ms)
+{
+	struct pwrmon_rail *rail;
+
+	if (pwrmon_rail_count == PWRMON_RAIL_MAX)
+		return -ENOSPC;
+
+	rail = &pwrmon_rails[pwrmon_rail_count];
+	if (snprintf(rail->name, sizeof(rail->name), "%s_%u", name,
+		     intf_id) >= sizeof(rail->name))
+		return -ENAMETOOLONG;
+
+	rail->intf_id = intf_id;
+	rail->uv = mv * 1000;
+	rail->ua = ma * 1000;
+	rail->period_ns = ms * 1000000ULL;
+	/* Spread the rails over the period, so they don't all peak at once */
+	rail->phase_ns = rail->period_ns * pwrmon_rail_count / 7;
+	pwrmon_rail_count++;
+
+	return 0;
+}
+
+/* Parse "<ids>:<name>=<mV>/<mA>[/<ms>]" */
+static int pwrmon_parse_rail(char *spec)
+{
+	unsigned long first, last, mv, ma, ms = PWRMON_PERIOD_MS;
+	char *ids, *name, *value, *end;
+	int ret;
+
+	ids = spec;
+	name = strchr(spec, ':');
+	if (!name)
+		return -EINVAL;
+	*name++ = '\0';
+
+	value = strchr(name, '=');
+	if (!value || value == name)
+		return -EINVAL;
+	*value++ = '\0';
+
+	mv = strtoul(value, &end, 0);
+	if (end == value || *end != '/')
+		return -EINVAL;
+	value = end + 1;
+	ma = strtoul(value, &end, 0);
+	if (end == value)
+		return -EINVAL;
+	if (*end == '/') {
+		value = end + 1;
+		ms = strtoul(value, &end, 0);
+		if (end == value || !ms)
+			return -EINVAL;
+	}
+	if (*end || mv > UINT32_MAX / 1000 || ma > UINT32_MAX / 1000)
+		return -EINVAL;
+
+	while (*ids) {
+		first = strtoul(ids, &end, 0);
+		if (end == ids)
+			return -EINVAL;
+
+		last = first;
+		if (*end == '-') {
+			ids = end + 1;
+			last = strtoul(ids, &end, 0);
+			if (end == ids)
+				return -EINVAL;
+		}
+
+		if (!first || first > last || last >= INTF_ID_MAX)
+			return -ERANGE;
+
+		for (; first <= last; first++) {
+			if (first == AP_INTF_ID)
+				continue;
+			ret = pwrmon_rail_add(first, name, mv, ma, ms);
+			if (ret)
+				return ret;
+		}
+
+		if (*end == '+')
+			end++;
+		else if (*end)
+			return -EINVAL;
+		ids = end;
+	}
+
+	return 0;
+}
+
+int pwrmon_parse(const char *spec)
+{
+	char *rails, *rail, *save;
+	int ret = 0;
+
+	rails = strdup(spec);
+	if (!rails)
+		return -ENOMEM;
+
+	for (rail = strtok_r(rails, ",", &save); rail && !ret;
+	     rail = strtok_r(NULL, ",", &save))
+		ret = pwrmon_parse_rail(rail);
+	free(rails);
+
+	return ret;
+}
+
+unsigned int pwrmon_rail_count_get(void)
+{
+	return pwrmon_rail_count;
+}
+
+/* Copy the rail names out, returning the size they take */
+size_t pwrmon_rail_names_get(void *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < pwrmon_rail_count; i++)
+		memcpy(buf + i * GB_SVC_PWRMON_RAIL_NAME_BUFSIZE,
+		       pwrmon_rails[i].name, GB_SVC_PWRMON_RAIL_NAME_BUFSIZE);
+
+	return pwrmon_rail_count * GB_SVC_PWRMON_RAIL_NAME_BUFSIZE;
+}
+
+/* Triangle wave going from 0 to 1000 and back over the period */
+static uint32_t pwrmon_wave(uint64_t now, uint64_t period_ns,
+			    uint64_t phase_ns)
+{
+	uint64_t t = (now + phase_ns) % period_ns;
+
+	t = t * 2000 / period_ns;
+
+	return t < 1000 ? t : 2000 - t;
+}
+
+/* Measure a rail, in uV, uA or uW, as of now */
+static int pwrmon_measure(struct pwrmon_rail *rail, uint8_t type,
+			  uint64_t now, uint32_t *measurement)
+{
+	enum gbsim_interface_state state = GBSIM_INTF_OFF;
+	struct gbsim_interface *intf;
+	uint64_t uv = 0, ua = 0;
+	uint32_t wave;
+
+	intf = interface_find(rail->intf_id);
+	if (intf) {
+		state = intf->state;
+		interface_put(intf);
+	}
+
+	if (state >= GBSIM_INTF_VSYS) {
+		wave = pwrmon_wave(now, rail->period_ns, rail->phase_ns);
+
+		uv = rail->uv - rail->uv / 200 +
+			(uint64_t)rail->uv / 100 * wave / 1000;
+		if (state == GBSIM_INTF_ACTIVE)
+			ua = rail->ua / 4 + (uint64_t)rail->ua * 3 / 4 *
+				wave / 1000;
+		else
+			ua = rail->ua / 10;
+	}
+
+	switch (type) {
+	case GB_SVC_PWRMON_TYPE_VOL:
+		*measurement = uv;
+		break;
+	case GB_SVC_PWRMON_TYPE_CURR:
+		*measurement = ua;
+		break;
+	case GB_SVC_PWRMON_TYPE_PWR:
+		*measurement = uv * ua / 1000000;
+		break;
+	default:
+		return GB_SVC_PWRMON_GET_SAMPLE_INVAL;
+	}
+
+	return GB_SVC_PWRMON_GET_SAMPLE_OK;
+}
+
+/* Sample a rail, returning the result code of the operation */
+uint8_t pwrmon_sample_get(uint8_t rail_id, uint8_t type,
+			  uint32_t *measurement)
+{
+	*measurement = 0;
+
+	if (rail_id >= pwrmon_rail_count)
+		return GB_SVC_PWRMON_GET_SAMPLE_INVAL;
+
+	return pwrmon_measure(&pwrmon_rails[rail_id], type, gbsim_now_ns(),
+			      measurement);
+}
+
+/*
+ * Sample all the rails of an interface together: their currents and powers
+ * add up, the voltage is the one of its first rail.
+ */
+uint8_t pwrmon_intf_sample_get(uint8_t intf_id, uint8_t type,
+			       uint32_t *measurement)
+{
+	uint64_t now = gbsim_now_ns(), total = 0;
+	uint32_t value;
+	unsigned int i;
+	uint8_t result = GB_SVC_PWRMON_GET_SAMPLE_NOSUPP;
+
+	*measurement = 0;
+
+	if (!intf_id || intf_id >= INTF_ID_MAX)
+		return GB_SVC_PWRMON_GET_SAMPLE_INVAL;
+
+	for (i = 0; i < pwrmon_rail_count; i++) {
+		if (pwrmon_rails[i].intf_id != intf_id)
+			continue;
+
+		result = pwrmon_measure(&pwrmon_rails[i], type, now, &value);
+		if (result != GB_SVC_PWRMON_GET_SAMPLE_OK)
+			return result;
+
+		if (type == GB_SVC_PWRMON_TYPE_VOL) {
+			*measurement = value;
+			return result;
+		}
+		total += value;
+	}
+
+	*measurement = total > UINT32_MAX ? UINT32_MAX : total;
+
+	return result;
+}
@@ -0,0 +1,450 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * Replay of a capture file (see capture.c), without USB.
+ *
+ * The frames the AP sent are fed to the dispatcher as if they had been read
+ * from the bulk out endpoints, either at the pace they were captured or as
+ * fast as possible. The responses the handlers generate are compared with
+ * the captured ones, in order, per hd cport.
+ *
+ * Requests initiated by the module are only counted: they depend on events
+ * (USB enumeration, hotplug) that the replay doesn't reproduce.
+ *
+ * The connections are set up from the capture headers, all to a single
+ * interface, in the slot of the first captured connection create request.
+ * Its manifest is taken from the captured control GET_MANIFEST response.
+ */
+
+/* Give up waiting for the last responses after that long without any */
+#define REPLAY_IDLE_TIMEOUT_MS	1000
+
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define LINKTYPE_USER0		147
+
+struct replay_frame {
+	TAILQ_ENTRY(replay_frame) fnode;
+	unsigned int index;
+	struct gbsim_capture_hdr *cap;
+	void *data;
+	size_t size;
+	uint64_t ns;
+};
+
+static TAILQ_HEAD(fhead, replay_frame) replay_expected[HD_CPORT_MAX];
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_cond = PTHREAD_COND_INITIALIZER;
+
+static struct replay_frame *frames;
+static unsigned int frame_count;
+static void *capture_map;
+static size_t capture_map_size;
+
+static unsigned int pending;
+static unsigned int matched;
+static unsigned int diverged;
+static unsigned int unexpected;
+static unsigned int requests;
+static unsigned int fed;
+
+/* pcap file header, nanosecond timestamps flavour */
+struct replay_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct replay_record_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+static uint64_t replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Drop what a failed load mapped, a loaded capture stays until exit */
+static void replay_unload(void)
+{
+	free(frames);
+	frames = NULL;
+	frame_count = 0;
+
+	if (capture_map) {
+		munmap(capture_map, capture_map_size);
+		capture_map = NULL;
+	}
+}
+
+static int replay_load(const char *path)
+{
+	struct replay_file_hdr *fh;
+	struct replay_record_hdr *rh;
+	struct stat st;
+	size_t off;
+	unsigned int n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		gbsim_error("can't open replay file %s (%d)\n", path, errno);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*fh)) {
+		gbsim_error("%s: not a capture file\n", path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	capture_map_size = st.st_size;
+	capture_map = mmap(NULL, capture_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (capture_map == MAP_FAILED) {
+		capture_map = NULL;
+		gbsim_error("can't map replay file %s (%d)\n", path, errno);
+		return -errno;
+	}
+
+	fh = capture_map;
+	if (fh->magic != PCAP_MAGIC_NSEC || fh->linktype != LINKTYPE_USER0) {
+		gbsim_error("%s: not a gbsim capture file\n", path);
+		replay_unload();
+		return -EINVAL;
+	}
+
+	/* Count the frames first, so they can be kept in a single array */
+	for (n = 0, off = sizeof(*fh); off + sizeof(*rh) <= capture_map_size;
+	     n++) {
+		rh = capture_map + off;
+		off += sizeof(*rh) + rh->incl_len;
+	}
+
+	frames = calloc(n, sizeof(*frames));
+	if (n && !frames) {
+		replay_unload();
+		return -ENOMEM;
+	}
+
+	for (n = 0, off = sizeof(*fh); off + sizeof(*rh) <= capture_map_size;
+	     off += sizeof(*rh) + rh->incl_len) {
+		struct replay_frame *frame = &frames[n];
+
+		rh = capture_map + off;
+		if (off + sizeof(*rh) + rh->incl_len > capture_map_size ||
+		    rh->incl_len < sizeof(*frame->cap) +
+				   sizeof(struct gb_operation_msg_hdr)) {
+			gbsim_error("%s: truncated frame %u\n", path, n);
+			break;
+		}
+
+		/* What the endpoint readers would have refused */
+		if (rh->incl_len - sizeof(*frame->cap) > ES1_MSG_SIZE) {
+			gbsim_error("%s: oversized frame %u\n", path, n);
+			break;
+		}
+
+		frame->index = n;
+		frame->cap = capture_map + off + sizeof(*rh);
+		frame->data = frame->cap + 1;
+		frame->size = rh->incl_len - sizeof(*frame->cap);
+		frame->ns = (uint64_t)rh->ts_sec * 1000000000ULL + rh->ts_nsec;
+		n++;
+	}
+	frame_count = n;
+
+	return 0;
+}
+
+/*
+ * Insert the interface the capture was made with, serving the manifest
+ * from its GET_MANIFEST response, if any.
+ */
+static struct gbsim_interface *replay_interface(uint8_t intf_id,
+						void *manifest,
+						size_t manifest_size)
+{
+	struct gbsim_manifest *m = NULL;
+	char name[32];
+	int ret;
+
+	if (intf_id)
+		snprintf(name, sizeof(name), "%hhu-replay", intf_id);
+	else
+		snprintf(name, sizeof(name), "replay");
+
+	if (manifest) {
+		m = manifest_create(manifest, manifest_size);
+		if (!m)
+			gbsim_error("replay: captured manifest rejected\n");
+	}
+
+	ret = interface_insert(name, m);
+	if (ret < 0) {
+		manifest_put(m);
+		gbsim_error("replay: can't insert the interface (%d)\n", ret);
+		return NULL;
+	}
+
+	return interface_find(ret);
+}
+
+/* Create the connections found in the capture */
+static void replay_setup(void)
+{
+	struct gb_svc_conn_create_request *conn_create;
+	struct gbsim_interface *intf;
+	struct gb_operation_msg_hdr *hdr;
+	struct replay_frame *frame;
+	void *manifest = NULL;
+	size_t manifest_size = 0;
+	uint16_t hd_cport_id;
+	uint8_t intf_id = 0;
+	unsigned int i;
+
+	for (i = 0; i < HD_CPORT_MAX; i++)
+		TAILQ_INIT(&replay_expected[i]);
+
+	for (i = 0; i < frame_count; i++) {
+		frame = &frames[i];
+		hdr = frame->data;
+		hd_cport_id = le16toh(frame->cap->hd_cport_id);
+
+		if (hd_cport_id >= HD_CPORT_MAX)
+			continue;
+
+		if (frame->cap->direction != GBSIM_CAPTURE_TO_AP) {
+			if (!intf_id &&
+			    frame->cap->protocol == GREYBUS_PROTOCOL_SVC &&
+			    hdr->type == GB_SVC_TYPE_CONN_CREATE &&
+			    frame->size >= sizeof(*hdr) + sizeof(*conn_create)) {
+				conn_create = (void *)(hdr + 1);
+				intf_id = conn_create->intf2_id;
+			}
+			continue;
+		}
+
+		if (!(hdr->type & OP_RESPONSE)) {
+			requests++;
+			continue;
+		}
+
+		if (frame->cap->protocol == GREYBUS_PROTOCOL_CONTROL &&
+		    hdr->type == (GB_CONTROL_TYPE_GET_MANIFEST | OP_RESPONSE) &&
+		    !manifest) {
+			manifest = hdr + 1;
+			manifest_size = frame->size - sizeof(*hdr);
+		}
+
+		TAILQ_INSERT_TAIL(&replay_expected[hd_cport_id], frame, fnode);
+		pending++;
+	}
+
+	intf = replay_interface(intf_id, manifest, manifest_size);
+
+	for (i = 0; i < frame_count; i++) {
+		frame = &frames[i];
+		hd_cport_id = le16toh(frame->cap->hd_cport_id);
+
+		if (hd_cport_id < HD_CPORT_MAX && frame->cap->protocol != 0xff &&
+		    !connection_find(hd_cport_id))
+			allocate_connection(intf, le16toh(frame->cap->cport_id),
+					    hd_cport_id, frame->cap->protocol);
+	}
+
+	interface_put(intf);
+}
+
+/*
+ * Called instead of writing to the AP: check the message against the next
+ * captured response of its hd cport.
+ */
+static int replay_response(uint16_t hd_cport_id, void *buf, size_t size)
+{
+	struct gb_operation_msg_hdr *hdr = buf;
+	struct replay_frame *frame;
+
+	/* Module initiated requests aren't reproducible, see above */
+	if (!(hdr->type & OP_RESPONSE))
+		return 0;
+
+	pthread_mutex_lock(&replay_lock);
+
+	frame = hd_cport_id < HD_CPORT_MAX ?
+		TAILQ_FIRST(&replay_expected[hd_cport_id]) : NULL;
+	if (!frame) {
+		unexpected++;
+		pthread_mutex_unlock(&replay_lock);
+		gbsim_error("replay: unexpected response on hd cport %hu\n",
+			    hd_cport_id);
+		gbsim_dump(buf, size);
+		return 0;
+	}
+
+	TAILQ_REMOVE(&replay_expected[hd_cport_id], frame, fnode);
+	pending--;
+
+	if (frame->size == size && !memcmp(frame->data, buf, size)) {
+		matched++;
+		frame = NULL;
+	} else {
+		diverged++;
+	}
+
+	pthread_cond_signal(&replay_cond);
+	pthread_mutex_unlock(&replay_lock);
+
+	if (frame) {
+		gbsim_error("replay: response to frame %u diverges on hd cport %hu\n",
+			    frame->index, hd_cport_id);
+		gbsim_error("replay: expected\n");
+		gbsim_dump(frame->data, frame->size);
+		gbsim_error("replay: got\n");
+		gbsim_dump(buf, size);
+	}
+
+	return 0;
+}
+
+/* Feed the AP frames to the dispatcher, as the endpoint readers would */
+static void replay_feed(void)
+{
+	struct gbsim_message *msg;
+	struct replay_frame *frame;
+	struct timespec ts;
+	uint64_t start = 0, first = 0;
+	unsigned int i;
+
+	for (i = 0; i < frame_count && !exit_requested(); i++) {
+		frame = &frames[i];
+
+		if (frame->cap->direction != GBSIM_CAPTURE_FROM_AP)
+			continue;
+
+		if (!replay_fast) {
+			if (!start) {
+				start = replay_now();
+				first = frame->ns;
+			}
+
+			/* Keep the capture's pacing */
+			ts.tv_sec = (start + frame->ns - first) / 1000000000ULL;
+			ts.tv_nsec = (start + frame->ns - first) % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		msg = message_alloc();
+		if (!msg)
+			return;
+
+		msg->size = frame->size;
+		memcpy(msg->data, frame->data, frame->size);
+		dispatch_message(msg);
+		fed++;
+	}
+}
+
+/* Wait for the handlers to produce the outstanding responses */
+static void replay_wait(void)
+{
+	struct timespec ts;
+	unsigned int last;
+
+	pthread_mutex_lock(&replay_lock);
+	while (pending && !exit_requested()) {
+		last = pending;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += REPLAY_IDLE_TIMEOUT_MS * 1000000ULL;
+		ts.tv_sec += ts.tv_nsec / 1000000000ULL;
+		ts.tv_nsec %= 1000000000ULL;
+
+		if (pthread_cond_timedwait(&replay_cond, &replay_lock, &ts) ==
+		    ETIMEDOUT && pending == last)
+			break;
+	}
+	pthread_mutex_unlock(&replay_lock);
+}
+
+static int replay_run(void)
+{
+	uint64_t start, elapsed;
+	int ret;
+
+	ret = replay_load(replay_file);
+	if (ret)
+		return ret;
+
+	replay_setup();
+
+	gbsim_info("replaying %u frames from %s%s\n", frame_count, replay_file,
+		   replay_fast ? " at full speed" : "");
+
+	start = replay_now();
+	replay_feed();
+	replay_wait();
+	elapsed = replay_now() - start;
+
+	gbsim_info("replay: %u frames fed in %llu.%06llu s (%llu frames/s)\n",
+		   fed, (unsigned long long)(elapsed / 1000000000ULL),
+		   (unsigned long long)(elapsed % 1000000000ULL) / 1000,
+		   elapsed ? (unsigned long long)fed * 1000000000ULL / elapsed : 0);
+	gbsim_info("replay: %u responses matched, %u diverged, %u missing, %u unexpected, %u module requests skipped\n",
+		   matched, diverged, pending, unexpected, requests);
+
+	return diverged || pending || unexpected ? -EPROTO : 0;
+}
+
+static int replay_init(void)
+{
+	return 0;
+}
+
+static void replay_exit(void)
+{
+}
+
+bool replay_active(void)
+{
+	return transport == &replay_transport;
+}
+
+/* Captured frames in, responses checked against the capture */
+struct gbsim_transport replay_transport = {
+	.name	= "replay",
+	.init	= replay_init,
+	.loop	= replay_run,
+	.send	= replay_response,
+	.exit	= replay_exit,
+};
@@ -63,8 +63,6 @@ struct sd_card {
 	uint16_t	blk_count;
 };
 
-static struct sd_card *sd;
-
 #define CLEAR_CONDITION_A	0x02004100 /* According current state */
 #define CLEAR_CONDITION_B	0x00c01e00 /* related to previous command */
 #define CLEAR_CONDITION_C	0xfd39a028 /* clear by read */
@@ -251,7 +249,7 @@ static uint8_t sd_mmc_crc7(void *data, size_t size)
 	return crc;
 }
 
-static void sd_reset_cid(void)
+static void sd_reset_cid(struct sd_card *sd)
 {
 	uint32_t *c = &sd->cid[0];
 
@@ -271,7 +269,7 @@ static void sd_reset_cid(void)
 	STUFF_BITS(c, 1, 0, 1);
 }
 
-static void sd_reset_csd(void)
+static void sd_reset_csd(struct sd_card *sd)
 {
 	uint32_t *c = &sd->csd[0];
 
@@ -302,37 +300,37 @@ static void sd_reset_csd(void)
 	STUFF_BITS(c, 1, 0, 1);
 }
 
-static void sd_reset(void)
+static void sd_reset(struct sd_card *sd)
 {
 	sd->state = R1_STATE_IDLE;
 	sd->rca = 0;
 	sd->ocr = OCR_RESET;
 	sd->scr[0] = SCR_RESET;
 	sd->card_status = CARD_STATUS_RESET;
-	sd_reset_cid();
-	sd_reset_csd();
+	sd_reset_cid(sd);
+	sd_reset_csd(sd);
 	free(sd->buf);
 	sd->buf = calloc(1, CARD_SIZE);
 }
 
-static void sd_prepare_r1(void)
+static void sd_prepare_r1(struct sd_card *sd)
 {
 	sd->rsp[0] = sd->card_status;
 
 	sd->card_status &= ~CLEAR_CONDITION_C;
 }
 
-static void sd_prepare_r2(void *reg, ssize_t size)
+static void sd_prepare_r2(struct sd_card *sd, void *reg, ssize_t size)
 {
 	memcpy(&sd->rsp[0], reg, size);
 }
 
-static void sd_prepare_r3(void)
+static void sd_prepare_r3(struct sd_card *sd)
 {
 	sd->rsp[0] = sd->ocr;
 }
 
-static void sd_prepare_r6(void)
+static void sd_prepare_r6(struct sd_card *sd)
 {
 	/* [31:16] rca [15:0] status bits: 23, 22, 19, 12:0 */
 	sd->rsp[0] |= (sd->rca << 16);
@@ -343,12 +341,12 @@ static void sd_prepare_r6(void)
 	sd->card_status &= ~(CLEAR_CONDITION_C & 0xc81fff);
 }
 
-static void sd_prepare_r7(void)
+static void sd_prepare_r7(struct sd_card *sd)
 {
 	sd->rsp[0] = sd->vhs;
 }
 
-static void sd_prepare_rsp(uint8_t cmd)
+static void sd_prepare_rsp(struct sd_card *sd, uint8_t cmd)
 {
 	memset(&sd->rsp[0], 0, sizeof(sd->rsp));
 
@@ -364,28 +362,29 @@ static void sd_prepare_rsp(uint8_t cmd)
 		break;
 	case MMC_ALL_SEND_CID:
 	case MMC_SEND_CID:
-		sd_prepare_r2(sd->cid, sizeof(sd->cid));
+		sd_prepare_r2(sd, sd->cid, sizeof(sd->cid));
 		break;
 	case MMC_SEND_CSD:
-		sd_prepare_r2(sd->csd, sizeof(sd->csd));
+		sd_prepare_r2(sd, sd->csd, sizeof(sd->csd));
 		break;
 	case MMC_SEND_OP_COND:
 	case SD_APP_OP_COND:
-		sd_prepare_r3();
+		sd_prepare_r3(sd);
 		break;
 	case MMC_SET_RELATIVE_ADDR:
-		sd_prepare_r6();
+		sd_prepare_r6(sd);
 		break;
 	case MMC_SEND_EXT_CSD:
-		sd_prepare_r7();
+		sd_prepare_r7(sd);
 		break;
 	default:
-		sd_prepare_r1();
+		sd_prepare_r1(sd);
 		break;
 	}
 }
 
-static void sd_process_apcmd(uint8_t cmd, uint8_t cmd_flags, uint8_t cmd_type,
+static void sd_process_apcmd(struct sd_card *sd, uint8_t cmd,
+			     uint8_t cmd_flags, uint8_t cmd_type,
 			     uint32_t cmd_arg)
 {
 	sd->appcmd = 0;
@@ -409,7 +408,8 @@ static void sd_process_apcmd(uint8_t cmd, uint8_t cmd_flags, uint8_t cmd_type,
 	sd->xfer_offset = 0;
 }
 
-static void sd_process_cmd(uint8_t cmd, uint8_t cmd_flags, uint8_t cmd_type,
+static void sd_process_cmd(struct sd_card *sd, uint8_t cmd,
+			   uint8_t cmd_flags, uint8_t cmd_type,
 			   uint32_t cmd_arg)
 {
 	gbsim_debug(" sdio: cmd:%d, cmd_flags:%d, cmd_type:%d, cmd_arg=0x%08x\n",
@@ -419,7 +419,7 @@ static void sd_process_cmd(uint8_t cmd, uint8_t cmd_flags, uint8_t cmd_type,
 
 	if (sd->appcmd) {
 		sd->appcmd = 0;
-		sd_process_apcmd(cmd, cmd_flags, cmd_type, cmd_arg);
+		sd_process_apcmd(sd, cmd, cmd_flags, cmd_type, cmd_arg);
 		goto prepare_rsp;
 	}
 
@@ -428,7 +428,7 @@ static void sd_process_cmd(uint8_t cmd, uint8_t cmd_flags, uint8_t cmd_type,
 
 	switch (cmd) {
 	case MMC_GO_IDLE_STATE:
-		sd_reset();
+		sd_reset(sd);
 		break;
 	case MMC_SEND_OP_COND:
 		sd->state = R1_STATE_TRAN;
@@ -507,10 +507,11 @@ static void sd_process_cmd(uint8_t cmd, uint8_t cmd_flags, uint8_t cmd_type,
 	}
 
 prepare_rsp:
-	sd_prepare_rsp(cmd);
+	sd_prepare_rsp(sd, cmd);
 }
 
-static void sd_transfer_read(uint16_t blocks, uint16_t blksz)
+static void sd_transfer_read(struct sd_card *sd, uint16_t blocks,
+			     uint16_t blksz)
 {
 	if (sd->state != R1_STATE_DATA) {
 		sd->card_status |= R1_ILLEGAL_COMMAND;
@@ -538,7 +539,8 @@ static void sd_transfer_read(uint16_t blocks, uint16_t blksz)
 	sd->xfer_offset += blocks * blksz;
 }
 
-static void sd_transfer_write(uint16_t blocks, uint16_t blksz)
+static void sd_transfer_write(struct sd_card *sd, uint16_t blocks,
+			      uint16_t blksz)
 {
 	if (sd->state != R1_STATE_RCV) {
 		sd->card_status |= R1_ILLEGAL_COMMAND;
@@ -559,15 +561,6 @@ static void sd_transfer_write(uint16_t blocks, uint16_t blksz)
 	sd->xfer_offset += blocks * blksz;
 }
 
-static void sd_init(void)
-{
-	sd = calloc(1, sizeof(*sd));
-
-	sd->max_blk_size = READ_BL_LEN;
-	sd->max_blk_count = MAX_BLK_COUNT;
-
-	sd_reset();
-}
 
 /* Greybus Specific Code */
 static ssize_t sdio_send_card_event(struct op_msg *op_req, uint16_t hd_cport_id,
@@ -582,45 +575,55 @@ static ssize_t sdio_send_card_event(struct op_msg *op_req, uint16_t hd_cport_id,
 			GB_SDIO_TYPE_EVENT);
 }
 
-static ssize_t sdio_transfer_rsp(struct op_msg *op_rsp, uint16_t hd_cport_id,
+static ssize_t sdio_transfer_rsp(struct sd_card *sd, struct op_msg *op_rsp,
+				 uint16_t hd_cport_id,
 				 struct gb_operation_msg_hdr *oph, uint16_t data_blocks,
 				 uint16_t data_blksz, uint8_t *data)
 {
-	size_t payload_size;
+	struct iovec payload = { 0 };
+	bool rcv = sd->state == R1_STATE_RCV;
 	uint16_t message_size;
 	uint32_t len;
 
-	len = data_blocks * data_blksz;
+	len = (uint32_t)data_blocks * data_blksz;
 
-	if (sd->state == R1_STATE_RCV)
-		payload_size = sizeof(struct gb_sdio_transfer_response);
-	else
-		payload_size = sizeof(struct gb_sdio_transfer_response) + len;
+	message_size = sizeof(struct gb_operation_msg_hdr) +
+		       sizeof(struct gb_sdio_transfer_response);
 
 	if (!sd->xfer || sd->card_status & R1_ILLEGAL_COMMAND) {
 		sd->card_status &= ~R1_ILLEGAL_COMMAND;
 		sd->state = R1_STATE_TRAN;
 		op_rsp->sdio_xfer_rsp.data_blocks = 0;
 		op_rsp->sdio_xfer_rsp.data_blksz = 0;
+
+		/* Still the size the AP expects, with no data */
+		if (!rcv) {
+			memset(&op_rsp->sdio_xfer_rsp.data[0], 0, len);
+			message_size += len;
+		}
 		goto send;
 	} else {
 		op_rsp->sdio_xfer_rsp.data_blocks = data_blocks;
 		op_rsp->sdio_xfer_rsp.data_blksz = data_blksz;
 	}
 
-	if (sd->state == R1_STATE_RCV)
+	if (rcv) {
 		memcpy(sd->xfer, data, len);
-	else
-		memcpy(&op_rsp->sdio_xfer_rsp.data[0], sd->xfer, len);
+	} else {
+		/* Read data goes out straight from the card buffer */
+		payload.iov_base = sd->xfer;
+		payload.iov_len = len;
+	}
 
 send:
-	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
-	return send_response(hd_cport_id, op_rsp, message_size,
-				oph->operation_id, oph->type,
-				PROTOCOL_STATUS_SUCCESS);
+	return send_response_iov(hd_cport_id, op_rsp, message_size,
+				 &payload, payload.iov_len ? 1 : 0,
+				 oph->operation_id, oph->type,
+				 PROTOCOL_STATUS_SUCCESS);
 }
 
-static ssize_t sdio_command_rsp(struct op_msg *op_rsp, uint16_t hd_cport_id,
+static ssize_t sdio_command_rsp(struct sd_card *sd, struct op_msg *op_rsp,
+				uint16_t hd_cport_id,
 				struct gb_operation_msg_hdr *oph)
 {
 	uint16_t message_size = sizeof(struct gb_sdio_command_response) +
@@ -635,9 +638,10 @@ static ssize_t sdio_command_rsp(struct op_msg *op_rsp, uint16_t hd_cport_id,
 				PROTOCOL_STATUS_SUCCESS);
 }
 
-int sdio_handler(struct gbsim_connection *connection, void *rbuf,
+static int sdio_handler(struct gbsim_connection *connection, void *rbuf,
 		 size_t rsize, void *tbuf, size_t tsize)
 {
+	struct sd_card *sd = connection->priv;
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp;
@@ -649,10 +653,11 @@ int sdio_handler(struct gbsim_connection *connection, void *rbuf,
 	uint16_t data_blksz;
 	uint8_t *data;
 	uint8_t module_id;
+	bool xfer_valid;
 
 	uint8_t result = PROTOCOL_STATUS_SUCCESS;
 
-	module_id = cport_to_module_id(cport_id);
+	module_id = connection_module_id(connection);
 
 	op_rsp = (struct op_msg *)tbuf;
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
@@ -674,23 +679,40 @@ int sdio_handler(struct gbsim_connection *connection, void *rbuf,
 			    module_id, cport_id);
 		break;
 	case GB_SDIO_TYPE_COMMAND:
-		sd_process_cmd(op_req->sdio_cmd_req.cmd,
+		sd_process_cmd(sd, op_req->sdio_cmd_req.cmd,
 			       op_req->sdio_cmd_req.cmd_flags,
 			       op_req->sdio_cmd_req.cmd_type,
 			       le32toh(op_req->sdio_cmd_req.cmd_arg));
 
-		sdio_command_rsp(op_rsp, hd_cport_id, oph);
+		sdio_command_rsp(sd, op_rsp, hd_cport_id, oph);
 		return 0;
 	case GB_SDIO_TYPE_TRANSFER:
 		data_blocks = le16toh(op_req->sdio_xfer_req.data_blocks);
 		data_blksz = le16toh(op_req->sdio_xfer_req.data_blksz);
 		data = &op_req->sdio_xfer_req.data[0];
+
+		/* Data written must be in the request, data read fit the response */
+		if (op_req->sdio_xfer_req.data_flags & GB_SDIO_DATA_READ)
+			xfer_valid = sizeof(*oph) +
+				     sizeof(struct gb_sdio_transfer_response) +
+				     (size_t)data_blocks * data_blksz <= tsize;
+		else
+			xfer_valid = sizeof(*oph) +
+				     sizeof(struct gb_sdio_transfer_request) +
+				     (size_t)data_blocks * data_blksz <= rsize;
+		if (!xfer_valid) {
+			gbsim_error("sdio transfer of %zu bytes doesn't fit\n",
+				    (size_t)data_blocks * data_blksz);
+			result = PROTOCOL_STATUS_INVALID;
+			break;
+		}
+
 		if (op_req->sdio_xfer_req.data_flags & GB_SDIO_DATA_READ)
-			sd_transfer_read(data_blocks, data_blksz);
+			sd_transfer_read(sd, data_blocks, data_blksz);
 		else
-			sd_transfer_write(data_blocks, data_blksz);
+			sd_transfer_write(sd, data_blocks, data_blksz);
 
-		sdio_transfer_rsp(op_rsp, hd_cport_id, oph, data_blocks,
+		sdio_transfer_rsp(sd, op_rsp, hd_cport_id, oph, data_blocks,
 				  data_blksz, data);
 		return 0;
 	default:
@@ -710,7 +732,7 @@ int sdio_handler(struct gbsim_connection *connection, void *rbuf,
 	return 0;
 }
 
-char *sdio_get_operation(uint8_t type)
+static char *sdio_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -730,7 +752,43 @@ char *sdio_get_operation(uint8_t type)
 	}
 }
 
-void sdio_init(void)
+/* Each SDIO connection has a card of its own */
+static int sdio_connection_init(struct gbsim_connection *connection)
 {
-	sd_init();
+	struct sd_card *sd;
+
+	sd = calloc(1, sizeof(*sd));
+	if (!sd)
+		return -ENOMEM;
+
+	sd->max_blk_size = READ_BL_LEN;
+	sd->max_blk_count = MAX_BLK_COUNT;
+
+	sd_reset(sd);
+	if (!sd->buf) {
+		free(sd);
+		return -ENOMEM;
+	}
+
+	connection->priv = sd;
+
+	return 0;
 }
+
+static void sdio_connection_exit(struct gbsim_connection *connection)
+{
+	struct sd_card *sd = connection->priv;
+
+	free(sd->buf);
+	free(sd);
+}
+
+static struct gbsim_protocol sdio_protocol = {
+	.id		= GREYBUS_PROTOCOL_SDIO,
+	.name		= "SDIO",
+	.handler	= sdio_handler,
+	.get_operation	= sdio_get_operation,
+	.connection_init = sdio_connection_init,
+	.connection_exit = sdio_connection_exit,
+};
+GBSIM_PROTOCOL(sdio_protocol);
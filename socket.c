@@ -0,0 +1,363 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "gbsim.h"
+
+/*
+ * Socket transport: the AP is a process connecting to gbsim over a
+ * UNIX-domain or TCP stream socket, rather than a USB host. This needs
+ * neither root, configfs nor dummy_hcd.
+ *
+ * The stream carries the greybus messages back to back, exactly as they
+ * would go over the bulk endpoints: each one is delimited by the size in
+ * its header, and its hd cport id is in the header pad byte. Once an AP is
+ * connected, gbsim starts with the SVC version request, like it does when
+ * the USB AP asks for the cport count.
+ *
+ * The address is either "unix:<path>", "tcp:[<host>:]<port>", or a plain
+ * path for a UNIX-domain socket. One AP is served at a time.
+ */
+
+#define SOCKET_RBUF_SIZE	(64 * 1024)
+
+static int listen_fd = -1;
+static int ap_fd = -1;
+static char *unix_path;
+static pthread_mutex_t socket_tx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char socket_rbuf[SOCKET_RBUF_SIZE];
+
+static int socket_listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		gbsim_error("socket path %s too long\n", path);
+		return -ENAMETOOLONG;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	/* A previous instance may have left its socket behind */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		gbsim_error("can't bind to %s (%d)\n", path, errno);
+		close(fd);
+		return -errno;
+	}
+
+	unix_path = strdup(path);
+
+	return fd;
+}
+
+static int socket_listen_tcp(const char *address)
+{
+	struct addrinfo hints, *res, *ai;
+	const char *port;
+	char *host = NULL;
+	int fd = -ENXIO, ret, one = 1;
+
+	port = strrchr(address, ':');
+	if (port) {
+		host = strndup(address, port - address);
+		port++;
+	} else {
+		port = address;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	free(host);
+	if (ret) {
+		gbsim_error("can't resolve %s: %s\n", address, gai_strerror(ret));
+		return -EINVAL;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			fd = -errno;
+			continue;
+		}
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+
+		close(fd);
+		fd = -errno;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0)
+		gbsim_error("can't bind to %s (%d)\n", address, fd);
+
+	return fd;
+}
+
+static int socket_init(void)
+{
+	int fd;
+
+	if (!strncmp(socket_address, "tcp:", 4))
+		fd = socket_listen_tcp(socket_address + 4);
+	else if (!strncmp(socket_address, "unix:", 5))
+		fd = socket_listen_unix(socket_address + 5);
+	else
+		fd = socket_listen_unix(socket_address);
+
+	if (fd < 0)
+		return fd;
+
+	if (listen(fd, 1) < 0) {
+		gbsim_error("can't listen on %s (%d)\n", socket_address, errno);
+		close(fd);
+		return -errno;
+	}
+
+	listen_fd = fd;
+	gbsim_info("waiting for the AP on %s\n", socket_address);
+
+	return 0;
+}
+
+static int socket_sendv(uint16_t hd_cport_id, const struct iovec *iov,
+			int count)
+{
+	struct iovec vec[GBSIM_MAX_IOV + 1];
+	struct msghdr mh;
+	ssize_t ret;
+
+	if (count > GBSIM_MAX_IOV + 1)
+		return -EINVAL;
+
+	/* sendmsg() may stop short, keep a copy of the list to advance it */
+	memcpy(vec, iov, count * sizeof(*iov));
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = vec;
+	mh.msg_iovlen = count;
+
+	pthread_mutex_lock(&socket_tx_lock);
+
+	if (ap_fd < 0) {
+		pthread_mutex_unlock(&socket_tx_lock);
+		return -ENOTCONN;
+	}
+
+	/* Messages from several threads must not interleave on the stream */
+	while (mh.msg_iovlen) {
+		ret = sendmsg(ap_fd, &mh, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			pthread_mutex_unlock(&socket_tx_lock);
+			return ret;
+		}
+
+		while (mh.msg_iovlen && ret >= mh.msg_iov->iov_len) {
+			ret -= mh.msg_iov->iov_len;
+			mh.msg_iov++;
+			mh.msg_iovlen--;
+		}
+		if (mh.msg_iovlen) {
+			mh.msg_iov->iov_base += ret;
+			mh.msg_iov->iov_len -= ret;
+		}
+	}
+
+	pthread_mutex_unlock(&socket_tx_lock);
+
+	return 0;
+}
+
+static int socket_send(uint16_t hd_cport_id, void *buf, size_t size)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = size,
+	};
+
+	return socket_sendv(hd_cport_id, &iov, 1);
+}
+
+/*
+ * Split what was received into messages and dispatch them, returning the
+ * number of bytes consumed.
+ */
+static ssize_t socket_dispatch(char *buf, size_t len)
+{
+	struct gb_operation_msg_hdr *hdr;
+	struct gbsim_message *msg;
+	size_t off = 0, size;
+
+	while (len - off >= sizeof(*hdr)) {
+		hdr = (struct gb_operation_msg_hdr *)(buf + off);
+		size = le16toh(hdr->size);
+
+		if (size < sizeof(*hdr) || size > ES1_MSG_SIZE) {
+			gbsim_error("invalid message size %zu from AP\n", size);
+			return -EPROTO;
+		}
+
+		if (len - off < size)
+			break;
+
+		msg = message_alloc();
+		if (!msg)
+			return -ENOMEM;
+
+		memcpy(msg->data, buf + off, size);
+		msg->size = size;
+		dispatch_message(msg);
+
+		off += size;
+	}
+
+	return off;
+}
+
+/* Wait for fd to be readable, false if asked to exit meanwhile */
+static bool socket_wait(int fd)
+{
+	struct pollfd fds[2] = {
+		{ .fd = fd, .events = POLLIN },
+		{ .fd = exit_fd, .events = POLLIN },
+	};
+
+	while (poll(fds, 2, -1) < 0 && errno == EINTR)
+		;
+
+	return !(fds[1].revents & POLLIN);
+}
+
+/* Serve the connected AP until it goes away */
+static void socket_serve(int fd)
+{
+	size_t len = 0;
+	ssize_t ret;
+	int one = 1;
+
+	/* Latency matters more than throughput on the message path */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	pthread_mutex_lock(&socket_tx_lock);
+	ap_fd = fd;
+	pthread_mutex_unlock(&socket_tx_lock);
+
+	ret = svc_request_send(GB_REQUEST_TYPE_PROTOCOL_VERSION, AP_INTF_ID);
+	if (ret)
+		gbsim_error("Failed to send svc version request (%zd)\n", ret);
+
+	while (socket_wait(fd)) {
+		ret = recv(fd, socket_rbuf + len, sizeof(socket_rbuf) - len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret < 0)
+				gbsim_error("error %d receiving from AP\n", errno);
+			break;
+		}
+		len += ret;
+
+		ret = socket_dispatch(socket_rbuf, len);
+		if (ret < 0)
+			break;
+
+		/* Keep the start of a partial message for the next round */
+		len -= ret;
+		memmove(socket_rbuf, socket_rbuf + ret, len);
+	}
+
+	pthread_mutex_lock(&socket_tx_lock);
+	ap_fd = -1;
+	pthread_mutex_unlock(&socket_tx_lock);
+
+	close(fd);
+
+	/* The next AP starts from a bare endo */
+	connections_reset();
+	interfaces_reset();
+}
+
+static int socket_loop(void)
+{
+	int fd;
+
+	while (socket_wait(listen_fd)) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			gbsim_error("accept failed (%d)\n", errno);
+			return -errno;
+		}
+
+		gbsim_info("AP connected\n");
+		socket_serve(fd);
+		gbsim_info("AP disconnected\n");
+	}
+
+	return 0;
+}
+
+static void socket_exit(void)
+{
+	pthread_mutex_lock(&socket_tx_lock);
+	if (ap_fd >= 0)
+		shutdown(ap_fd, SHUT_RDWR);
+	pthread_mutex_unlock(&socket_tx_lock);
+
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+
+	if (unix_path) {
+		unlink(unix_path);
+		free(unix_path);
+		unix_path = NULL;
+	}
+}
+
+struct gbsim_transport socket_transport = {
+	.name	= "socket",
+	.init	= socket_init,
+	.loop	= socket_loop,
+	.send	= socket_send,
+	.sendv	= socket_sendv,
+	.exit	= socket_exit,
+};
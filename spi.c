@@ -69,8 +69,6 @@ struct gb_spi_master {
 	struct gb_spi_dev	*devices;
 };
 
-static struct gb_spi_master *master;
-
 static struct gb_spi_dev_config spidev_config = {
 	.mode		= GB_SPI_MODE_MODE_3,
 	.bits_per_word	= 8,
@@ -233,7 +231,8 @@ static int spinor_xfer_req_recv(struct gb_spi_dev *dev,
 	return 0;
 }
 
-static int spi_set_device(uint8_t cs, int spi_type)
+static int spi_set_device(struct gb_spi_master *master, uint8_t cs,
+			  int spi_type)
 {
 	struct gb_spi_dev *spi_dev = &master->devices[cs];
 
@@ -258,16 +257,27 @@ static int spi_set_device(uint8_t cs, int spi_type)
 		return 0;
 
 	spi_dev->buf = calloc(1, spi_dev->buf_size);
-	if (!spi_dev->buf) {
-		free(spi_dev);
+	if (!spi_dev->buf)
 		return -ENOMEM;
-	}
 
 	return 0;
 }
 
-static int spi_master_setup(void)
+static void spi_master_free(struct gb_spi_master *master)
+{
+	int i;
+
+	if (master->devices)
+		for (i = 0; i < master->num_chipselect; i++)
+			free(master->devices[i].buf);
+	free(master->devices);
+	free(master);
+}
+
+/* Each SPI connection is a master with devices of its own */
+static int spi_connection_init(struct gbsim_connection *connection)
 {
+	struct gb_spi_master *master;
 	int i;
 
 	master = calloc(1, sizeof(struct gb_spi_master));
@@ -283,19 +293,60 @@ static int spi_master_setup(void)
 
 	master->devices = calloc(master->num_chipselect,
 				 sizeof(struct gb_spi_dev));
-	if (!master->devices)
+	if (!master->devices) {
+		spi_master_free(master);
 		return -ENOMEM;
+	}
 
 	/* for even set spidev for odd set spinor */
-	for (i = 0; i < SPI_NUM_CS; i++)
-		spi_set_device(i, (i % 2 ? SPINOR_TYPE : SPIDEV_TYPE));
+	for (i = 0; i < SPI_NUM_CS; i++) {
+		if (spi_set_device(master, i,
+				   i % 2 ? SPINOR_TYPE : SPIDEV_TYPE)) {
+			spi_master_free(master);
+			return -ENOMEM;
+		}
+	}
+
+	connection->priv = master;
 
 	return 0;
 }
 
-int spi_handler(struct gbsim_connection *connection, void *rbuf,
+static void spi_connection_exit(struct gbsim_connection *connection)
+{
+	spi_master_free(connection->priv);
+}
+
+/*
+ * The transfers, and the data they write, must all be in the request and
+ * what they read must fit in the response.
+ */
+static bool spi_transfer_valid(struct gb_spi_transfer_request *request,
+			       int count, size_t rsize, size_t tsize)
+{
+	size_t size = sizeof(struct gb_operation_msg_hdr) + sizeof(*request) +
+		      count * sizeof(request->transfers[0]);
+	size_t read_size = sizeof(struct gb_operation_msg_hdr) +
+			   sizeof(struct gb_spi_transfer_response);
+	int i;
+
+	if (size > rsize)
+		return false;
+
+	for (i = 0; i < count; i++) {
+		if (request->transfers[i].xfer_flags & GB_SPI_XFER_READ)
+			read_size += le32toh(request->transfers[i].len);
+		if (request->transfers[i].xfer_flags & GB_SPI_XFER_WRITE)
+			size += le32toh(request->transfers[i].len);
+	}
+
+	return size <= rsize && read_size <= tsize;
+}
+
+static int spi_handler(struct gbsim_connection *connection, void *rbuf,
 		   size_t rsize, void *tbuf, size_t tsize)
 {
+	struct gb_spi_master *master = connection->priv;
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp;
@@ -309,6 +360,7 @@ int spi_handler(struct gbsim_connection *connection, void *rbuf,
 	int xfer_cs, cs;
 	int xfer_count;
 	int xfer_rx = 0;
+	uint8_t result = PROTOCOL_STATUS_SUCCESS;
 	int ret;
 	int i;
 
@@ -317,7 +369,6 @@ int spi_handler(struct gbsim_connection *connection, void *rbuf,
 
 	switch (oph->type) {
 	case GB_SPI_TYPE_MASTER_CONFIG:
-		spi_master_setup();
 		payload_size = sizeof(struct gb_spi_master_config_response);
 
 		op_rsp->spi_mc_rsp.mode = htole16(master->mode);
@@ -331,6 +382,8 @@ int spi_handler(struct gbsim_connection *connection, void *rbuf,
 		payload_size = sizeof(struct gb_spi_device_config_response);
 
 		cs = op_req->spi_dc_req.chip_select;
+		if (cs >= master->num_chipselect)
+			return -EINVAL;
 		spi_dev = &master->devices[cs];
 		conf = spi_dev->conf;
 
@@ -347,17 +400,30 @@ int spi_handler(struct gbsim_connection *connection, void *rbuf,
 		xfer = &op_req->spi_xfer_req.transfers[0];
 		xfer_data = xfer + xfer_count;
 
+		if (xfer_cs >= master->num_chipselect)
+			return -EINVAL;
 		spi_dev = &master->devices[xfer_cs];
 
+		if (!spi_transfer_valid(&op_req->spi_xfer_req, xfer_count,
+					rsize, tsize)) {
+			gbsim_error("spi transfer larger than its request\n");
+			result = PROTOCOL_STATUS_INVALID;
+			break;
+		}
+
 		spi_dev->buf_resp = op_rsp->spi_xfer_rsp.data;
 
+		/* Devices don't fill in all they are read, zero it first */
+		for (i = 0; i < xfer_count; i++)
+			if (xfer[i].xfer_flags & GB_SPI_XFER_READ)
+				xfer_rx += xfer[i].len;
+		memset(spi_dev->buf_resp, 0, xfer_rx);
+
 		for (i = 0; i < xfer_count; i++, xfer++) {
 			spi_dev->xfer_req_recv(spi_dev, xfer, xfer_data);
 			/* we only increment if transfer is write */
 			if (xfer->xfer_flags & GB_SPI_XFER_WRITE)
 				xfer_data += xfer->len;
-			if (xfer->xfer_flags & GB_SPI_XFER_READ)
-				xfer_rx += xfer->len;
 		}
 
 		payload_size = sizeof(struct gb_spi_transfer_response) + xfer_rx;
@@ -368,12 +434,11 @@ int spi_handler(struct gbsim_connection *connection, void *rbuf,
 
 	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
 	ret = send_response(hd_cport_id, op_rsp, message_size,
-			    oph->operation_id, oph->type,
-			    PROTOCOL_STATUS_SUCCESS);
+			    oph->operation_id, oph->type, result);
 	return ret;
 }
 
-char *spi_get_operation(uint8_t type)
+static char *spi_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -388,3 +453,13 @@ char *spi_get_operation(uint8_t type)
 		return "(Unknown operation)";
 	}
 }
+
+static struct gbsim_protocol spi_protocol = {
+	.id		= GREYBUS_PROTOCOL_SPI,
+	.name		= "SPI",
+	.handler	= spi_handler,
+	.get_operation	= spi_get_operation,
+	.connection_init = spi_connection_init,
+	.connection_exit = spi_connection_exit,
+};
+GBSIM_PROTOCOL(spi_protocol);
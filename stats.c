@@ -0,0 +1,387 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * Message statistics, per hd cport and per operation type.
+ *
+ * Counters are updated with relaxed atomics from whichever thread sends or
+ * handles a message. Handler times go into log-linear histograms: values
+ * are split into powers of two, each one divided in HIST_SUB linear
+ * sub-buckets, which keeps the relative error under 1/HIST_SUB over the
+ * whole range, from nanoseconds to minutes.
+ *
+ * The statistics are kept per hd cport rather than in the connections, so
+ * they can be updated without holding the connection lock, and they are
+ * reset when a new connection takes the hd cport over.
+ *
+ * SIGUSR1 dumps them on stdout. With -S, they are also rewritten to the
+ * given file every STATS_PERIOD_S seconds.
+ */
+
+#define HIST_SUB_BITS		3
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+/* Enough for 2^40 ns, about 18 minutes */
+#define HIST_BUCKETS		((40 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define STATS_PERIOD_S		1
+
+/* Operation types are 7 bits, the top one being the response flag */
+#define STATS_OP_TYPES		128
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+struct op_stats {
+	uint64_t requests_in;
+	uint64_t responses_in;
+	uint64_t requests_out;
+	uint64_t responses_out;
+	uint64_t errors;
+	struct histogram handler;
+};
+
+struct cport_stats {
+	uint16_t cport_id;
+	int protocol;
+	uint64_t messages_in;
+	uint64_t messages_out;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t errors;
+	struct op_stats *ops[STATS_OP_TYPES];
+};
+
+static struct cport_stats *cport_stats[HD_CPORT_MAX];
+static pthread_t stats_pthread;
+
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static unsigned int hist_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < 2 * HIST_SUB)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	if (shift >= HIST_BUCKETS / HIST_SUB - 1)
+		return HIST_BUCKETS - 1;
+
+	return shift * HIST_SUB + (value >> shift);
+}
+
+/* Highest value falling in a bucket */
+static uint64_t hist_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < 2 * HIST_SUB)
+		return index;
+
+	shift = index / HIST_SUB - 1;
+
+	return (((uint64_t)(index - shift * HIST_SUB) + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *hist, uint64_t value)
+{
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&hist->buckets[hist_index(value)], 1,
+			   __ATOMIC_RELAXED);
+	stats_add(&hist->count, 1);
+	stats_add(&hist->sum, value);
+
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&hist->max, &max, value, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static uint64_t hist_percentile(struct histogram *hist, uint64_t count,
+				unsigned int permille)
+{
+	uint64_t rank = (count * permille + 999) / 1000, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+	}
+
+	return hist->max;
+}
+
+/* Start over for the connection now using the hd cport */
+void stats_reset(uint16_t hd_cport_id, uint16_t cport_id, int protocol)
+{
+	struct cport_stats *stats;
+	int i;
+
+	if (hd_cport_id >= HD_CPORT_MAX)
+		return;
+
+	/*
+	 * Statistics are never freed, a late message of the previous
+	 * connection may still be accounting for itself; at worst it shows up
+	 * in the new connection's figures.
+	 */
+	stats = __atomic_load_n(&cport_stats[hd_cport_id], __ATOMIC_ACQUIRE);
+	if (stats) {
+		stats->messages_in = 0;
+		stats->messages_out = 0;
+		stats->bytes_in = 0;
+		stats->bytes_out = 0;
+		stats->errors = 0;
+		for (i = 0; i < STATS_OP_TYPES; i++)
+			if (stats->ops[i])
+				memset(stats->ops[i], 0, sizeof(*stats->ops[i]));
+	} else {
+		stats = calloc(1, sizeof(*stats));
+		if (!stats)
+			return;
+	}
+
+	stats->cport_id = cport_id;
+	stats->protocol = protocol;
+
+	__atomic_store_n(&cport_stats[hd_cport_id], stats, __ATOMIC_RELEASE);
+}
+
+static struct op_stats *stats_op(struct cport_stats *stats, uint8_t type)
+{
+	struct op_stats *op, *expected = NULL;
+
+	type &= ~OP_RESPONSE;
+
+	op = __atomic_load_n(&stats->ops[type], __ATOMIC_ACQUIRE);
+	if (op)
+		return op;
+
+	op = calloc(1, sizeof(*op));
+	if (!op)
+		return NULL;
+
+	/* Another thread may have raced us to it */
+	if (!__atomic_compare_exchange_n(&stats->ops[type], &expected, op,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		free(op);
+		return expected;
+	}
+
+	return op;
+}
+
+/* Account for a message going through the hd cport */
+void stats_message(uint16_t hd_cport_id, bool inbound, uint8_t type,
+		   size_t size, int ret)
+{
+	struct cport_stats *stats;
+	struct op_stats *op;
+
+	if (hd_cport_id >= HD_CPORT_MAX)
+		return;
+
+	stats = __atomic_load_n(&cport_stats[hd_cport_id], __ATOMIC_ACQUIRE);
+	if (!stats)
+		return;
+
+	op = stats_op(stats, type);
+
+	if (inbound) {
+		stats_add(&stats->messages_in, 1);
+		stats_add(&stats->bytes_in, size);
+	} else {
+		stats_add(&stats->messages_out, 1);
+		stats_add(&stats->bytes_out, size);
+	}
+
+	if (ret) {
+		stats_add(&stats->errors, 1);
+		if (op)
+			stats_add(&op->errors, 1);
+	}
+
+	if (!op)
+		return;
+
+	if (type & OP_RESPONSE)
+		stats_add(inbound ? &op->responses_in : &op->responses_out, 1);
+	else
+		stats_add(inbound ? &op->requests_in : &op->requests_out, 1);
+}
+
+/* Account for the time the handler took to process a message */
+void stats_handler(uint16_t hd_cport_id, uint8_t type, uint64_t ns)
+{
+	struct cport_stats *stats;
+	struct op_stats *op;
+
+	if (hd_cport_id >= HD_CPORT_MAX)
+		return;
+
+	stats = __atomic_load_n(&cport_stats[hd_cport_id], __ATOMIC_ACQUIRE);
+	if (!stats)
+		return;
+
+	op = stats_op(stats, type);
+	if (op)
+		hist_record(&op->handler, ns);
+}
+
+static void stats_dump_op(FILE *f, int protocol, uint8_t type,
+			  struct op_stats *op)
+{
+	struct histogram *hist = &op->handler;
+	char *protocol_name, *operation;
+	uint64_t count;
+
+	get_protocol_operation(protocol, &protocol_name, &operation, type);
+
+	fprintf(f, "  %-40s req in %llu rsp in %llu req out %llu rsp out %llu errors %llu\n",
+		operation,
+		(unsigned long long)op->requests_in,
+		(unsigned long long)op->responses_in,
+		(unsigned long long)op->requests_out,
+		(unsigned long long)op->responses_out,
+		(unsigned long long)op->errors);
+
+	count = hist->count;
+	if (!count)
+		return;
+
+	fprintf(f, "  %-40s handler us: avg %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+		"",
+		hist->sum / 1000.0 / count,
+		hist_percentile(hist, count, 500) / 1000.0,
+		hist_percentile(hist, count, 900) / 1000.0,
+		hist_percentile(hist, count, 990) / 1000.0,
+		hist_percentile(hist, count, 999) / 1000.0,
+		hist->max / 1000.0);
+}
+
+void stats_dump(FILE *f)
+{
+	struct cport_stats *stats;
+	char *protocol, *operation;
+	unsigned int i, type;
+
+	fprintf(f, "gbsim statistics\n");
+	message_pool_dump(f);
+	interfaces_dump(f);
+
+	for (i = 0; i < HD_CPORT_MAX; i++) {
+		stats = __atomic_load_n(&cport_stats[i], __ATOMIC_ACQUIRE);
+		if (!stats)
+			continue;
+
+		get_protocol_operation(stats->protocol, &protocol, &operation, 0);
+
+		fprintf(f, "hd cport %u cport %hu %s: in %llu (%llu bytes) out %llu (%llu bytes) errors %llu\n",
+			i, stats->cport_id, protocol,
+			(unsigned long long)stats->messages_in,
+			(unsigned long long)stats->bytes_in,
+			(unsigned long long)stats->messages_out,
+			(unsigned long long)stats->bytes_out,
+			(unsigned long long)stats->errors);
+
+		for (type = 0; type < STATS_OP_TYPES; type++)
+			if (stats->ops[type])
+				stats_dump_op(f, stats->protocol, type,
+					      stats->ops[type]);
+	}
+
+	fflush(f);
+}
+
+/* Rewrite the whole file, so readers never see a partial dump */
+static void stats_write_file(void)
+{
+	char tmp[256];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", stats_file);
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		gbsim_error("can't write stats to %s (%d)\n", tmp, errno);
+		return;
+	}
+
+	stats_dump(f);
+	fclose(f);
+
+	if (rename(tmp, stats_file) < 0)
+		gbsim_error("can't write stats to %s (%d)\n", stats_file, errno);
+}
+
+static void *stats_thread(void *param)
+{
+	struct timespec period = {
+		.tv_sec = STATS_PERIOD_S,
+	};
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	while (1) {
+		if (stats_file)
+			sig = sigtimedwait(&set, NULL, &period);
+		else
+			sig = sigwaitinfo(&set, NULL);
+
+		if (sig == SIGUSR1)
+			stats_dump(stdout);
+
+		if (stats_file)
+			stats_write_file();
+	}
+
+	return NULL;
+}
+
+/*
+ * SIGUSR1 must have been blocked before any thread got created, so that it
+ * is only ever picked up by the statistics thread.
+ */
+int stats_init(void)
+{
+	int ret;
+
+	ret = pthread_create(&stats_pthread, NULL, stats_thread, NULL);
+	if (ret) {
+		gbsim_error("can't create stats thread (%d)\n", ret);
+		return -ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,432 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * Hotplug storm: insert and remove a batch of modules, all described by the
+ * same manifest, to benchmark how the AP enumerates and tears them down.
+ *
+ * It is set up with -H and a comma separated list of settings:
+ *
+ *   manifest=<file>	manifest blob of the modules (required)
+ *   count=<n>		modules inserted per round (default 1)
+ *   rate=<n>		modules inserted, or removed, per second
+ *			(default 0, as fast as possible)
+ *   burst=<n>		modules sent back to back before pausing to keep
+ *			the rate (default 1)
+ *   hold=<ms>		time modules stay once all enumerated (default 0)
+ *   rounds=<n>		insertion and removal rounds (default 1)
+ *
+ * A module is enumerated when the AP has sent a control CONNECTED request
+ * for each of its cports but the control one, and torn down when the AP
+ * has destroyed all the connections it created to it. The time from the
+ * MODULE_INSERTED request to the last CONNECTED one, and from the
+ * MODULE_REMOVED request to the last CONN_DESTROY one, are reported with
+ * their percentiles once all the rounds are done.
+ */
+
+/* Give up on the modules the AP is still busy with after that long */
+#define STORM_TIMEOUT_MS	10000
+
+struct storm_module {
+	bool active;
+	uint64_t inserted_ns;
+	uint64_t removed_ns;
+	unsigned int expected;
+	unsigned int connected;
+	unsigned int created;
+	unsigned int destroyed;
+	bool enumerated;
+	bool torn_down;
+};
+
+static char *storm_manifest;
+static unsigned int storm_count = 1;
+static unsigned int storm_rate;
+static unsigned int storm_burst = 1;
+static unsigned int storm_hold_ms;
+static unsigned int storm_rounds = 1;
+
+static struct storm_module storm_modules[INTF_ID_MAX];
+static pthread_mutex_t storm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t storm_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t storm_pthread;
+static bool storm_running;
+
+/* Latencies of all the rounds, in ns */
+static uint64_t *enumeration_ns;
+static uint64_t *teardown_ns;
+static unsigned int enumeration_count;
+static unsigned int teardown_count;
+static unsigned int storm_timeouts;
+
+int storm_parse(const char *spec)
+{
+	char *settings, *setting, *value, *end, *save;
+	unsigned long n;
+	int ret = 0;
+
+	settings = strdup(spec);
+	if (!settings)
+		return -ENOMEM;
+
+	for (setting = strtok_r(settings, ",", &save); setting;
+	     setting = strtok_r(NULL, ",", &save)) {
+		value = strchr(setting, '=');
+		if (!value) {
+			ret = -EINVAL;
+			break;
+		}
+		*value++ = '\0';
+
+		if (!strcmp(setting, "manifest")) {
+			free(storm_manifest);
+			storm_manifest = strdup(value);
+			continue;
+		}
+
+		n = strtoul(value, &end, 0);
+		if (!*value || *end) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if (!strcmp(setting, "count") && n)
+			storm_count = n;
+		else if (!strcmp(setting, "rate"))
+			storm_rate = n;
+		else if (!strcmp(setting, "burst") && n)
+			storm_burst = n;
+		else if (!strcmp(setting, "hold"))
+			storm_hold_ms = n;
+		else if (!strcmp(setting, "rounds") && n)
+			storm_rounds = n;
+		else {
+			ret = -EINVAL;
+			break;
+		}
+	}
+	free(settings);
+
+	if (!ret && !storm_manifest)
+		ret = -EINVAL;
+
+	return ret;
+}
+
+bool storm_enabled(void)
+{
+	return storm_manifest;
+}
+
+static struct storm_module *storm_module(uint8_t intf_id)
+{
+	if (!storm_running || intf_id >= INTF_ID_MAX ||
+	    !storm_modules[intf_id].active)
+		return NULL;
+
+	return &storm_modules[intf_id];
+}
+
+static void storm_check_enumerated(struct storm_module *module)
+{
+	if (module->enumerated || module->connected < module->expected)
+		return;
+
+	module->enumerated = true;
+	enumeration_ns[enumeration_count++] = gbsim_now_ns() -
+					      module->inserted_ns;
+	pthread_cond_signal(&storm_cond);
+}
+
+/* The AP connected an interface cport */
+void storm_connection_created(uint8_t intf_id)
+{
+	struct storm_module *module;
+
+	pthread_mutex_lock(&storm_lock);
+	module = storm_module(intf_id);
+	if (module) {
+		module->created++;
+		/* Nothing but the control cport to wait for */
+		storm_check_enumerated(module);
+	}
+	pthread_mutex_unlock(&storm_lock);
+}
+
+void storm_connection_destroyed(uint8_t intf_id)
+{
+	struct storm_module *module;
+
+	pthread_mutex_lock(&storm_lock);
+	module = storm_module(intf_id);
+	if (module && module->removed_ns && !module->torn_down &&
+	    ++module->destroyed >= module->created) {
+		module->torn_down = true;
+		teardown_ns[teardown_count++] = gbsim_now_ns() -
+						module->removed_ns;
+		pthread_cond_signal(&storm_cond);
+	}
+	pthread_mutex_unlock(&storm_lock);
+}
+
+/* The AP told the interface that one of its cports is connected */
+void storm_cport_connected(uint8_t intf_id)
+{
+	struct storm_module *module;
+
+	pthread_mutex_lock(&storm_lock);
+	module = storm_module(intf_id);
+	if (module) {
+		module->connected++;
+		storm_check_enumerated(module);
+	}
+	pthread_mutex_unlock(&storm_lock);
+}
+
+/* Sleep until the deadline of the n-th module of the round, keeping rate */
+static void storm_pace(uint64_t start, unsigned int n)
+{
+	struct timespec ts;
+	uint64_t deadline;
+
+	if (!storm_rate || n % storm_burst)
+		return;
+
+	deadline = start + (uint64_t)n * 1000000000ULL / storm_rate;
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Wait for the modules to be enumerated, or torn down, counting laggards */
+static void storm_wait(int *intf_ids, unsigned int count, bool removal)
+{
+	struct storm_module *module;
+	struct timespec ts;
+	unsigned int i, done;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += STORM_TIMEOUT_MS / 1000;
+	ts.tv_nsec += (STORM_TIMEOUT_MS % 1000) * 1000000ULL;
+	ts.tv_sec += ts.tv_nsec / 1000000000ULL;
+	ts.tv_nsec %= 1000000000ULL;
+
+	pthread_mutex_lock(&storm_lock);
+	while (1) {
+		for (i = 0, done = 0; i < count; i++) {
+			module = &storm_modules[intf_ids[i]];
+			done += removal ? module->torn_down :
+					  module->enumerated;
+		}
+
+		if (done == count)
+			break;
+
+		if (pthread_cond_timedwait(&storm_cond, &storm_lock, &ts) ==
+		    ETIMEDOUT) {
+			gbsim_error("storm: %u modules not %s after %u ms\n",
+				    count - done,
+				    removal ? "torn down" : "enumerated",
+				    STORM_TIMEOUT_MS);
+			storm_timeouts += count - done;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&storm_lock);
+}
+
+static int storm_insert(struct gbsim_manifest *m, unsigned int n)
+{
+	struct storm_module *module;
+	char name[32];
+	int intf_id;
+
+	/* All the modules share the manifest */
+	manifest_hold(m);
+
+	snprintf(name, sizeof(name), "storm-%u", n);
+	intf_id = interface_insert(name, m);
+	if (intf_id < 0) {
+		manifest_put(m);
+		return intf_id;
+	}
+
+	pthread_mutex_lock(&storm_lock);
+	module = &storm_modules[intf_id];
+	memset(module, 0, sizeof(*module));
+	module->active = true;
+	module->expected = m->cport_count - 1;
+	module->inserted_ns = gbsim_now_ns();
+	pthread_mutex_unlock(&storm_lock);
+
+	svc_request_send(GB_SVC_TYPE_MODULE_INSERTED, intf_id);
+
+	return intf_id;
+}
+
+static void storm_remove(unsigned int n, int intf_id)
+{
+	struct storm_module *module;
+	char name[32];
+
+	snprintf(name, sizeof(name), "storm-%u", n);
+	if (interface_remove(name) < 0)
+		return;
+
+	pthread_mutex_lock(&storm_lock);
+	module = &storm_modules[intf_id];
+	module->removed_ns = gbsim_now_ns();
+	/* Never connected, nothing to tear down */
+	if (!module->created)
+		module->torn_down = true;
+	pthread_mutex_unlock(&storm_lock);
+
+	svc_request_send(GB_SVC_TYPE_MODULE_REMOVED, intf_id);
+}
+
+static int storm_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void storm_report(const char *what, uint64_t *ns, unsigned int count)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	if (!count) {
+		gbsim_info("storm: no module %s\n", what);
+		return;
+	}
+
+	qsort(ns, count, sizeof(*ns), storm_compare);
+	for (i = 0; i < count; i++)
+		sum += ns[i];
+
+#define STORM_PCT(p)	(ns[((count - 1) * (p)) / 1000] / 1000000.0)
+	gbsim_info("storm: %u modules %s, ms: avg %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+		   count, what, sum / 1000000.0 / count, STORM_PCT(500),
+		   STORM_PCT(900), STORM_PCT(990), ns[count - 1] / 1000000.0);
+#undef STORM_PCT
+}
+
+static void *storm_thread(void *param)
+{
+	struct gbsim_manifest *m;
+	struct timespec hold;
+	unsigned int round, n, inserted;
+	int *intf_ids;
+	uint64_t start;
+	int ret;
+
+	m = manifest_get(storm_manifest);
+	intf_ids = calloc(storm_count, sizeof(*intf_ids));
+	if (!m || !intf_ids)
+		goto out;
+
+	hold.tv_sec = storm_hold_ms / 1000;
+	hold.tv_nsec = (storm_hold_ms % 1000) * 1000000;
+
+	gbsim_info("storm: %u rounds of %u modules, %u per second in bursts of %u\n",
+		   storm_rounds, storm_count, storm_rate, storm_burst);
+
+	for (round = 0; round < storm_rounds; round++) {
+		start = gbsim_now_ns();
+		for (n = 0; n < storm_count; n++) {
+			storm_pace(start, n);
+			ret = storm_insert(m, n);
+			if (ret < 0) {
+				gbsim_error("storm: module %u not inserted (%d)\n",
+					    n, ret);
+				break;
+			}
+			intf_ids[n] = ret;
+		}
+		inserted = n;
+
+		storm_wait(intf_ids, inserted, false);
+		nanosleep(&hold, NULL);
+
+		start = gbsim_now_ns();
+		for (n = 0; n < inserted; n++) {
+			storm_pace(start, n);
+			storm_remove(n, intf_ids[n]);
+		}
+
+		storm_wait(intf_ids, inserted, true);
+
+		pthread_mutex_lock(&storm_lock);
+		for (n = 0; n < inserted; n++)
+			storm_modules[intf_ids[n]].active = false;
+		pthread_mutex_unlock(&storm_lock);
+
+		if (inserted < storm_count)
+			break;
+	}
+
+	pthread_mutex_lock(&storm_lock);
+	storm_report("enumerated", enumeration_ns, enumeration_count);
+	storm_report("torn down", teardown_ns, teardown_count);
+	if (storm_timeouts)
+		gbsim_info("storm: %u modules timed out\n", storm_timeouts);
+	pthread_mutex_unlock(&storm_lock);
+
+out:
+	pthread_mutex_lock(&storm_lock);
+	storm_running = false;
+	pthread_mutex_unlock(&storm_lock);
+
+	free(intf_ids);
+	manifest_put(m);
+
+	return NULL;
+}
+
+/* Start the storm, once the AP's SVC is ready for hotplug events */
+int storm_start(void)
+{
+	int ret;
+
+	if (storm_running)
+		return 0;
+
+	free(enumeration_ns);
+	free(teardown_ns);
+	enumeration_ns = calloc(storm_count * storm_rounds, sizeof(uint64_t));
+	teardown_ns = calloc(storm_count * storm_rounds, sizeof(uint64_t));
+	if (!enumeration_ns || !teardown_ns)
+		return -ENOMEM;
+
+	enumeration_count = 0;
+	teardown_count = 0;
+	storm_timeouts = 0;
+	storm_running = true;
+
+	ret = pthread_create(&storm_pthread, NULL, storm_thread, NULL);
+	if (ret) {
+		gbsim_error("can't create storm thread (%d)\n", ret);
+		storm_running = false;
+		return -ret;
+	}
+	pthread_detach(storm_pthread);
+
+	return 0;
+}
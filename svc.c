@@ -20,6 +20,218 @@
 
 #include "gbsim.h"
 
+/*
+ * Bind an interface CPort to the hd cport the AP picked for it, which is
+ * when the connection comes to life.
+ */
+static int svc_connection_create(struct gb_svc_conn_create_request *req)
+{
+	uint16_t hd_cport_id = le16toh(req->cport1_id);
+	uint16_t cport_id = le16toh(req->cport2_id);
+	struct gbsim_connection *connection;
+	struct gbsim_interface *intf;
+	int protocol, ret;
+
+	if (req->intf1_id != AP_INTF_ID)
+		return -EINVAL;
+
+	intf = interface_find(req->intf2_id);
+	if (!intf) {
+		gbsim_error("no interface %hhu to connect to\n", req->intf2_id);
+		return -ENODEV;
+	}
+
+	/* Already bound, as when replaying a capture */
+	connection = connection_find(hd_cport_id);
+	if (connection && connection->intf == intf &&
+	    connection->cport_id == cport_id) {
+		interface_put(intf);
+		return 0;
+	}
+
+	protocol = interface_cport_protocol(intf, cport_id);
+	if (protocol < 0) {
+		gbsim_error("interface %hhu has no cport %hu\n", intf->id,
+			    cport_id);
+		interface_put(intf);
+		return protocol;
+	}
+
+	ret = allocate_connection(intf, cport_id, hd_cport_id, protocol);
+	if (!ret)
+		storm_connection_created(intf->id);
+	interface_put(intf);
+
+	return ret;
+}
+
+static int svc_connection_destroy(struct gb_svc_conn_destroy_request *req)
+{
+	struct gbsim_connection *connection;
+
+	storm_connection_destroyed(req->intf2_id);
+
+	/* Connections are dropped with their module once its removal is done */
+	connection = connection_find(le16toh(req->cport1_id));
+	if (!connection)
+		return 0;
+
+	if (!connection->intf || connection->intf->id != req->intf2_id ||
+	    connection->cport_id != le16toh(req->cport2_id))
+		return -EINVAL;
+
+	free_connection(connection);
+
+	return 0;
+}
+
+/*
+ * Take a power up step of an interface, or undo it. Steps are taken in
+ * order and undone in the reverse order, taking the UniPro link down also
+ * deactivates the interface. Asking for a step already done, or undone,
+ * is fine.
+ */
+static int svc_intf_step(uint8_t intf_id, enum unipro_step step,
+			 enum gbsim_interface_state state, bool enable)
+{
+	struct gbsim_interface *intf;
+	int ret = 0;
+
+	intf = interface_find(intf_id);
+	if (!intf)
+		return -ENODEV;
+
+	if (enable) {
+		if (intf->state < state - 1)
+			ret = -EINVAL;
+		else if (intf->state == state - 1)
+			goto change;
+	} else {
+		if (intf->state > state &&
+		    !(state == GBSIM_INTF_UNIPRO &&
+		      intf->state == GBSIM_INTF_ACTIVE))
+			ret = -EBUSY;
+		else if (intf->state >= state)
+			goto change;
+	}
+
+	if (ret)
+		gbsim_error("interface %hhu can't %s step %d in state %d\n",
+			    intf_id, enable ? "enable" : "disable", step,
+			    intf->state);
+	interface_put(intf);
+
+	return ret;
+
+change:
+	unipro_step_delay(step);
+	intf->state = enable ? state : state - 1;
+	if (!enable && state == GBSIM_INTF_UNIPRO)
+		unipro_link_down(intf);
+
+	gbsim_debug("interface %hhu now in state %d\n", intf_id, intf->state);
+	interface_put(intf);
+
+	return 0;
+}
+
+/* Activate the interface, returning the status of the operation */
+static uint8_t svc_intf_activate(uint8_t intf_id)
+{
+	struct gbsim_interface *intf;
+	uint8_t status;
+
+	intf = interface_find(intf_id);
+	if (!intf)
+		return GB_SVC_INTF_NOT_DETECTED;
+
+	switch (intf->state) {
+	case GBSIM_INTF_OFF:
+		status = GB_SVC_INTF_NO_V_SYS;
+		break;
+	case GBSIM_INTF_VSYS:
+		status = GB_SVC_INTF_NO_REFCLK;
+		break;
+	case GBSIM_INTF_REFCLK:
+		status = GB_SVC_INTF_NO_UPRO_LINK;
+		break;
+	case GBSIM_INTF_UNIPRO:
+		unipro_step_delay(UNIPRO_STEP_ACTIVATE);
+		intf->state = GBSIM_INTF_ACTIVE;
+		/* fall through */
+	default:
+		status = GB_SVC_OP_SUCCESS;
+		break;
+	}
+	interface_put(intf);
+
+	return status;
+}
+
+/*
+ * Switch the power mode of the link of the interface, returning the result
+ * code the AP expects: PWR_OK for hibernation, PWR_LOCAL otherwise.
+ */
+static uint8_t svc_intf_set_pwrm(struct gb_svc_intf_set_pwrm_request *req)
+{
+	struct gbsim_interface *intf;
+	uint8_t result_code;
+
+	intf = interface_find(req->intf_id);
+	if (!intf)
+		return GB_SVC_SETPWRM_PWR_FATAL_ERROR;
+
+	if (intf->state < GBSIM_INTF_UNIPRO) {
+		result_code = GB_SVC_SETPWRM_PWR_FATAL_ERROR;
+	} else if (unipro_link_set_mode(intf, req)) {
+		result_code = GB_SVC_SETPWRM_PWR_ERROR_CAP;
+	} else {
+		unipro_step_delay(UNIPRO_STEP_PWRM);
+		if (req->tx_mode == GB_SVC_UNIPRO_HIBERNATE_MODE)
+			result_code = GB_SVC_SETPWRM_PWR_OK;
+		else
+			result_code = GB_SVC_SETPWRM_PWR_LOCAL;
+	}
+	interface_put(intf);
+
+	return result_code;
+}
+
+/* Read a UniPro attribute of an interface, returning the DME result code */
+static uint16_t svc_dme_peer_get(struct gb_svc_dme_peer_get_request *req,
+				 uint32_t *value)
+{
+	struct gbsim_interface *intf;
+	int ret;
+
+	intf = interface_find(req->intf_id);
+	if (!intf)
+		return DME_RESULT_PEER_COMMUNICATION_FAILURE;
+
+	ret = dme_get(intf->dme, le16toh(req->attr), le16toh(req->selector),
+		      value);
+	interface_put(intf);
+
+	return ret ? DME_RESULT_INVALID_MIB_ATTRIBUTE : DME_RESULT_SUCCESS;
+}
+
+/* Write a UniPro attribute of an interface, returning the DME result code */
+static uint16_t svc_dme_peer_set(struct gb_svc_dme_peer_set_request *req)
+{
+	struct gbsim_interface *intf;
+	int ret;
+
+	intf = interface_find(req->intf_id);
+	if (!intf)
+		return DME_RESULT_PEER_COMMUNICATION_FAILURE;
+
+	ret = dme_set(intf->dme, le16toh(req->attr), le16toh(req->selector),
+		      le32toh(req->value));
+	interface_put(intf);
+
+	return ret ? DME_RESULT_FAILURE : DME_RESULT_SUCCESS;
+}
+
 static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 			       void *rbuf, size_t rsize, void *tbuf,
 			       size_t tsize)
@@ -37,13 +249,33 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 	struct gb_svc_route_create_request *svc_route_create;
 	struct gb_svc_route_destroy_request *svc_route_destroy;
 	struct gb_svc_pwrmon_rail_count_get_response *svc_pwrmon_rail_count_get_response;
+	struct gb_svc_pwrmon_rail_names_get_response *svc_pwrmon_rail_names_get_response;
+	struct gb_svc_pwrmon_sample_get_request *svc_pwrmon_sample_get_request;
+	struct gb_svc_pwrmon_sample_get_response *svc_pwrmon_sample_get_response;
+	struct gb_svc_pwrmon_intf_sample_get_request *svc_pwrmon_intf_sample_get_request;
+	struct gb_svc_pwrmon_intf_sample_get_response *svc_pwrmon_intf_sample_get_response;
+	struct gb_svc_intf_vsys_request *svc_intf_vsys_request;
 	struct gb_svc_intf_vsys_response *svc_intf_vsys_response;
+	struct gb_svc_intf_refclk_request *svc_intf_refclk_request;
 	struct gb_svc_intf_refclk_response *svc_intf_refclk_response;
+	struct gb_svc_intf_unipro_request *svc_intf_unipro_request;
 	struct gb_svc_intf_unipro_response *svc_intf_unipro_response;
+	struct gb_svc_intf_activate_request *svc_intf_activate_request;
 	struct gb_svc_intf_activate_response *svc_intf_activate_response;
+	struct gb_svc_intf_set_pwrm_request *svc_intf_set_pwrm_request;
 	struct gb_svc_intf_set_pwrm_response *svc_intf_set_pwrm_response;
 	uint16_t message_size = sizeof(*oph);
 	size_t payload_size = 0;
+	uint8_t result = PROTOCOL_STATUS_SUCCESS;
+	uint16_t dme_result;
+	uint32_t dme_value = 0;
+	uint32_t measurement;
+	struct gb_svc_timesync_wake_pins_acquire_request *svc_timesync_wake_pins_acquire;
+	struct gb_svc_timesync_enable_request *svc_timesync_enable;
+	struct gb_svc_timesync_authoritative_response *svc_timesync_authoritative;
+	struct gb_svc_timesync_ping_response *svc_timesync_ping;
+	uint64_t frame_time[GB_TIMESYNC_MAX_STROBES];
+	int i, ret;
 
 	switch (oph->type) {
 	case GB_REQUEST_TYPE_PROTOCOL_VERSION:
@@ -62,6 +294,9 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 		gbsim_debug("SVC connection create request (%hhu %hu):(%hhu %hu) response\n",
 			    svc_conn_create->intf1_id, svc_conn_create->cport1_id,
 			    svc_conn_create->intf2_id, svc_conn_create->cport2_id);
+
+		if (svc_connection_create(svc_conn_create))
+			result = PROTOCOL_STATUS_INVALID;
 		break;
 	case GB_SVC_TYPE_CONN_DESTROY:
 		svc_conn_destroy = &op_req->svc_conn_destroy_request;
@@ -69,32 +304,40 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 		gbsim_debug("SVC connection destroy request (%hhu %hu):(%hhu %hu) response\n",
 			    svc_conn_destroy->intf1_id, svc_conn_destroy->cport1_id,
 			    svc_conn_destroy->intf2_id, svc_conn_destroy->cport2_id);
+
+		if (svc_connection_destroy(svc_conn_destroy))
+			result = PROTOCOL_STATUS_INVALID;
 		break;
 	case GB_SVC_TYPE_DME_PEER_GET:
 		payload_size = sizeof(*dme_get_response);
 		dme_get_request = &op_req->svc_dme_peer_get_request;
 		dme_get_response = &op_rsp->svc_dme_peer_get_response;
-		dme_get_response->result_code = 0;
-		dme_get_response->attr_value = 0x0126;
+
+		dme_result = svc_dme_peer_get(dme_get_request, &dme_value);
+		dme_get_response->result_code = htole16(dme_result);
+		dme_get_response->attr_value = htole32(dme_value);
 
 		gbsim_debug("SVC dme peer get (%hhu %hu %hu) request\n",
-			    dme_get_request->intf_id, dme_get_request->attr,
-			    dme_get_request->selector);
+			    dme_get_request->intf_id,
+			    le16toh(dme_get_request->attr),
+			    le16toh(dme_get_request->selector));
 		gbsim_debug("SVC dme peer get (%hu %u) response\n",
-			    dme_get_response->result_code,
-			    dme_get_response->attr_value);
+			    dme_result, dme_value);
 		break;
 	case GB_SVC_TYPE_DME_PEER_SET:
 		payload_size = sizeof(*dme_set_response);
 		dme_set_request = &op_req->svc_dme_peer_set_request;
 		dme_set_response = &op_rsp->svc_dme_peer_set_response;
-		dme_set_response->result_code = 0;
+
+		dme_result = svc_dme_peer_set(dme_set_request);
+		dme_set_response->result_code = htole16(dme_result);
 
 		gbsim_debug("SVC dme peer set (%hhu %hu %hu %u) request\n",
-			    dme_set_request->intf_id, dme_set_request->attr,
-			    dme_set_request->selector, dme_set_request->value);
-		gbsim_debug("SVC dme peer set (%hu) response\n",
-			    dme_set_response->result_code);
+			    dme_set_request->intf_id,
+			    le16toh(dme_set_request->attr),
+			    le16toh(dme_set_request->selector),
+			    le32toh(dme_set_request->value));
+		gbsim_debug("SVC dme peer set (%hu) response\n", dme_result);
 		break;
 	case GB_SVC_TYPE_ROUTE_CREATE:
 		svc_route_create = &op_req->svc_route_create_request;
@@ -116,49 +359,151 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 	case GB_SVC_TYPE_PWRMON_RAIL_COUNT_GET:
 		payload_size = sizeof(*svc_pwrmon_rail_count_get_response);
 		svc_pwrmon_rail_count_get_response = &op_rsp->svc_pwrmon_rail_count_get_response;
-		svc_pwrmon_rail_count_get_response->rail_count = 0;
+		svc_pwrmon_rail_count_get_response->rail_count = pwrmon_rail_count_get();
 		break;
-	case GB_SVC_TYPE_INTF_VSYS_ENABLE:
-		payload_size = sizeof(*svc_intf_vsys_response);
-		svc_intf_vsys_response = &op_rsp->svc_intf_vsys_response;
-		svc_intf_vsys_response->result_code = 0;
+	case GB_SVC_TYPE_PWRMON_RAIL_NAMES_GET:
+		svc_pwrmon_rail_names_get_response = &op_rsp->svc_pwrmon_rail_names_get_response;
+		svc_pwrmon_rail_names_get_response->status = GB_SVC_OP_SUCCESS;
+		payload_size = sizeof(*svc_pwrmon_rail_names_get_response) +
+			pwrmon_rail_names_get(svc_pwrmon_rail_names_get_response->name);
+		break;
+	case GB_SVC_TYPE_PWRMON_SAMPLE_GET:
+		payload_size = sizeof(*svc_pwrmon_sample_get_response);
+		svc_pwrmon_sample_get_request = &op_req->svc_pwrmon_sample_get_request;
+		svc_pwrmon_sample_get_response = &op_rsp->svc_pwrmon_sample_get_response;
+
+		svc_pwrmon_sample_get_response->result =
+			pwrmon_sample_get(svc_pwrmon_sample_get_request->rail_id,
+					  svc_pwrmon_sample_get_request->measurement_type,
+					  &measurement);
+		svc_pwrmon_sample_get_response->measurement = htole32(measurement);
+		break;
+	case GB_SVC_TYPE_PWRMON_INTF_SAMPLE_GET:
+		payload_size = sizeof(*svc_pwrmon_intf_sample_get_response);
+		svc_pwrmon_intf_sample_get_request = &op_req->svc_pwrmon_intf_sample_get_request;
+		svc_pwrmon_intf_sample_get_response = &op_rsp->svc_pwrmon_intf_sample_get_response;
+
+		svc_pwrmon_intf_sample_get_response->result =
+			pwrmon_intf_sample_get(svc_pwrmon_intf_sample_get_request->intf_id,
+					       svc_pwrmon_intf_sample_get_request->measurement_type,
+					       &measurement);
+		svc_pwrmon_intf_sample_get_response->measurement = htole32(measurement);
 		break;
+	case GB_SVC_TYPE_INTF_VSYS_ENABLE:
 	case GB_SVC_TYPE_INTF_VSYS_DISABLE:
 		payload_size = sizeof(*svc_intf_vsys_response);
+		svc_intf_vsys_request = &op_req->svc_intf_vsys_request;
 		svc_intf_vsys_response = &op_rsp->svc_intf_vsys_response;
-		svc_intf_vsys_response->result_code = 0;
+
+		if (svc_intf_step(svc_intf_vsys_request->intf_id,
+				  UNIPRO_STEP_VSYS, GBSIM_INTF_VSYS,
+				  oph->type == GB_SVC_TYPE_INTF_VSYS_ENABLE))
+			svc_intf_vsys_response->result_code = GB_SVC_INTF_VSYS_FAIL;
+		else
+			svc_intf_vsys_response->result_code = GB_SVC_INTF_VSYS_OK;
 		break;
 	case GB_SVC_TYPE_INTF_REFCLK_ENABLE:
-		payload_size = sizeof(*svc_intf_refclk_response);
-		svc_intf_refclk_response = &op_rsp->svc_intf_refclk_response;
-		svc_intf_refclk_response->result_code = 0;
-		break;
 	case GB_SVC_TYPE_INTF_REFCLK_DISABLE:
 		payload_size = sizeof(*svc_intf_refclk_response);
+		svc_intf_refclk_request = &op_req->svc_intf_refclk_request;
 		svc_intf_refclk_response = &op_rsp->svc_intf_refclk_response;
-		svc_intf_refclk_response->result_code = 0;
+
+		if (svc_intf_step(svc_intf_refclk_request->intf_id,
+				  UNIPRO_STEP_REFCLK, GBSIM_INTF_REFCLK,
+				  oph->type == GB_SVC_TYPE_INTF_REFCLK_ENABLE))
+			svc_intf_refclk_response->result_code = GB_SVC_INTF_REFCLK_FAIL;
+		else
+			svc_intf_refclk_response->result_code = GB_SVC_INTF_REFCLK_OK;
 		break;
 	case GB_SVC_TYPE_INTF_UNIPRO_ENABLE:
-		payload_size = sizeof(*svc_intf_unipro_response);
-		svc_intf_unipro_response = &op_rsp->svc_intf_unipro_response;
-		svc_intf_unipro_response->result_code = 0;
-		break;
 	case GB_SVC_TYPE_INTF_UNIPRO_DISABLE:
 		payload_size = sizeof(*svc_intf_unipro_response);
+		svc_intf_unipro_request = &op_req->svc_intf_unipro_request;
 		svc_intf_unipro_response = &op_rsp->svc_intf_unipro_response;
-		svc_intf_unipro_response->result_code = 0;
+
+		if (svc_intf_step(svc_intf_unipro_request->intf_id,
+				  UNIPRO_STEP_UNIPRO, GBSIM_INTF_UNIPRO,
+				  oph->type == GB_SVC_TYPE_INTF_UNIPRO_ENABLE))
+			svc_intf_unipro_response->result_code = GB_SVC_INTF_UNIPRO_FAIL;
+		else
+			svc_intf_unipro_response->result_code = GB_SVC_INTF_UNIPRO_OK;
 		break;
 	case GB_SVC_TYPE_INTF_ACTIVATE:
 		payload_size = sizeof(*svc_intf_activate_response);
+		svc_intf_activate_request = &op_req->svc_intf_activate_request;
 		svc_intf_activate_response = &op_rsp->svc_intf_activate_response;
-		svc_intf_activate_response->intf_type = GB_SVC_INTF_TYPE_GREYBUS;
+
+		svc_intf_activate_response->status =
+			svc_intf_activate(svc_intf_activate_request->intf_id);
+		if (svc_intf_activate_response->status == GB_SVC_OP_SUCCESS)
+			svc_intf_activate_response->intf_type = GB_SVC_INTF_TYPE_GREYBUS;
 		break;
 	case GB_SVC_TYPE_INTF_MAILBOX_EVENT:
 		break;
 	case GB_SVC_TYPE_INTF_SET_PWRM:
 		payload_size = sizeof(*svc_intf_set_pwrm_response);
+		svc_intf_set_pwrm_request = &op_req->svc_intf_set_pwrm_request;
 		svc_intf_set_pwrm_response = &op_rsp->svc_intf_set_pwrm_response;
-		svc_intf_set_pwrm_response->result_code = 0;
+
+		svc_intf_set_pwrm_response->result_code =
+			svc_intf_set_pwrm(svc_intf_set_pwrm_request);
+
+		gbsim_debug("SVC set power mode (%hhu tx %hhu %hhu x%hhu rx %hhu %hhu x%hhu) response %hhu\n",
+			    svc_intf_set_pwrm_request->intf_id,
+			    svc_intf_set_pwrm_request->tx_mode,
+			    svc_intf_set_pwrm_request->tx_gear,
+			    svc_intf_set_pwrm_request->tx_nlanes,
+			    svc_intf_set_pwrm_request->rx_mode,
+			    svc_intf_set_pwrm_request->rx_gear,
+			    svc_intf_set_pwrm_request->rx_nlanes,
+			    svc_intf_set_pwrm_response->result_code);
+		break;
+	case GB_SVC_TYPE_TIMESYNC_WAKE_PINS_ACQUIRE:
+		svc_timesync_wake_pins_acquire = &op_req->svc_timesync_wake_pins_acquire_request;
+
+		ret = timesync_wake_pins_acquire(le32toh(svc_timesync_wake_pins_acquire->strobe_mask));
+		if (ret)
+			result = ret == -EBUSY ? PROTOCOL_STATUS_BUSY :
+				 PROTOCOL_STATUS_INVALID;
+		break;
+	case GB_SVC_TYPE_TIMESYNC_WAKE_PINS_RELEASE:
+		timesync_wake_pins_release();
+		break;
+	case GB_SVC_TYPE_TIMESYNC_ENABLE:
+		svc_timesync_enable = &op_req->svc_timesync_enable_request;
+
+		if (timesync_enable(svc_timesync_enable->count,
+				    le64toh(svc_timesync_enable->frame_time),
+				    le32toh(svc_timesync_enable->strobe_delay),
+				    le32toh(svc_timesync_enable->refclk)))
+			result = PROTOCOL_STATUS_INVALID;
+		break;
+	case GB_SVC_TYPE_TIMESYNC_DISABLE:
+		timesync_disable();
+		break;
+	case GB_SVC_TYPE_TIMESYNC_AUTHORITATIVE:
+		svc_timesync_authoritative = &op_rsp->svc_timesync_authoritative_response;
+
+		if (timesync_authoritative(frame_time)) {
+			result = PROTOCOL_STATUS_INVALID;
+			break;
+		}
+
+		payload_size = sizeof(*svc_timesync_authoritative);
+		for (i = 0; i < GB_TIMESYNC_MAX_STROBES; i++)
+			svc_timesync_authoritative->frame_time[i] =
+				htole64(frame_time[i]);
+		break;
+	case GB_SVC_TYPE_TIMESYNC_PING:
+		svc_timesync_ping = &op_rsp->svc_timesync_ping_response;
+
+		if (timesync_ping(&frame_time[0])) {
+			result = PROTOCOL_STATUS_INVALID;
+			break;
+		}
+
+		payload_size = sizeof(*svc_timesync_ping);
+		svc_timesync_ping->frame_time = htole64(frame_time[0]);
 		break;
 	case GB_SVC_TYPE_MODULE_INSERTED:
 	case GB_SVC_TYPE_MODULE_REMOVED:
@@ -171,8 +516,7 @@ static int svc_handler_request(uint16_t cport_id, uint16_t hd_cport_id,
 
 	message_size += payload_size;
 	return send_response(hd_cport_id, op_rsp, message_size,
-				oph->operation_id, oph->type,
-				PROTOCOL_STATUS_SUCCESS);
+				oph->operation_id, oph->type, result);
 }
 
 static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
@@ -205,14 +549,27 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 	case GB_SVC_TYPE_SVC_HELLO:
 		/*
 		 * AP's SVC cport is ready now, start scanning for module
-		 * hotplug.
+		 * hotplug. There's nothing to scan when replaying a capture.
 		 */
+		if (replay_active())
+			break;
+
+		if (storm_enabled()) {
+			ret = storm_start();
+			if (ret < 0)
+				gbsim_error("Failed to start hotplug storm\n");
+		}
+
+		if (!hotplug_basedir)
+			break;
+
 		ret = inotify_start(hotplug_basedir);
 		if (ret < 0)
 			gbsim_error("Failed to start inotify thread\n");
 		break;
 	case GB_SVC_TYPE_MODULE_REMOVED:
-		free_connections();
+		/* Drop what the AP didn't disconnect itself */
+		interfaces_reap();
 		break;
 	case GB_SVC_TYPE_MODULE_INSERTED:
 	case GB_SVC_TYPE_INTF_RESET:
@@ -226,7 +583,7 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 	return 0;
 }
 
-int svc_handler(struct gbsim_connection *connection, void *rbuf,
+static int svc_handler(struct gbsim_connection *connection, void *rbuf,
 		    size_t rsize, void *tbuf, size_t tsize)
 {
 	struct op_msg *op = rbuf;
@@ -241,7 +598,7 @@ int svc_handler(struct gbsim_connection *connection, void *rbuf,
 					   tbuf, tsize);
 }
 
-char *svc_get_operation(uint8_t type)
+static char *svc_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -371,16 +728,28 @@ int svc_request_send(uint8_t type, uint8_t intf_id)
 	}
 
 	message_size += payload_size;
-	return send_request(GB_SVC_CPORT_ID, &msg, message_size, 1, type);
+	return send_operation(GB_SVC_CPORT_ID, &msg, message_size, type, NULL,
+			      NULL);
 }
 
-void svc_init(void)
+static void svc_init(void)
 {
 	/* Allocate cport for svc protocol between AP and SVC */
-	allocate_connection(GB_SVC_CPORT_ID, GB_SVC_CPORT_ID, GREYBUS_PROTOCOL_SVC);
+	allocate_connection(NULL, GB_SVC_CPORT_ID, GB_SVC_CPORT_ID,
+			    GREYBUS_PROTOCOL_SVC);
 }
 
-void svc_exit(void)
+static void svc_exit(void)
 {
 	free_connection(connection_find(GB_SVC_CPORT_ID));
 }
+
+static struct gbsim_protocol svc_protocol = {
+	.id		= GREYBUS_PROTOCOL_SVC,
+	.name		= "SVC",
+	.handler	= svc_handler,
+	.get_operation	= svc_get_operation,
+	.init		= svc_init,
+	.cleanup	= svc_exit,
+};
+GBSIM_PROTOCOL(svc_protocol);
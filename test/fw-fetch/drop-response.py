@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+#
+# Acts as the AP for gbsim -s: hotplugs a bootrom module, leaves one
+# firmware chunk request unanswered and checks that gbsim reports an
+# invalid image once it times out, then fetches the firmware again.
+#
+# Usage: drop-response.py <socket> <hotplug basedir>
+
+import os
+import socket
+import struct
+import sys
+import time
+
+# Interface with a control and a bootrom bundle, CPort 1 on the bootrom
+MANIFEST = bytes.fromhex('1c000001080001000000000008000300'
+                         '010000000800040001000115')
+FIRMWARE = os.urandom(100000)
+
+sock, hp = sys.argv[1], sys.argv[2]
+s = socket.socket(socket.AF_UNIX)
+for i in range(50):
+    try:
+        s.connect(sock)
+        break
+    except OSError:
+        time.sleep(0.1)
+
+def recv(n):
+    b = b''
+    while len(b) < n:
+        c = s.recv(n - len(b))
+        if not c:
+            sys.exit('gbsim went away')
+        b += c
+    return b
+
+def rd():
+    size, op, t, r, cport, pad = struct.unpack('<HHBBBB', recv(8))
+    return op, t, r, cport, recv(size - 8)
+
+def snd(cport, op, t, payload=b'', r=0):
+    s.sendall(struct.pack('<HHBBBB', 8 + len(payload), op, t, r, cport, 0) +
+              payload)
+
+opid = 100
+def req(cport, t, payload=b''):
+    global opid
+    opid += 1
+    snd(cport, opid, t, payload)
+    while True:
+        m = rd()
+        if m[0] == opid and m[1] == t | 0x80:
+            return m
+
+# SVC version and hello, then hotplug the module
+m = rd(); snd(0, m[0], 0x81, b'\x00\x01')
+m = rd(); snd(0, m[0], 0x82)
+time.sleep(0.2)
+with open(os.path.join(hp, 'hotplug-module', 'bootrom.mnfb'), 'wb') as f:
+    f.write(MANIFEST)
+m = rd()
+assert m[3] == 0 and m[1] == 0x1f
+snd(0, m[0], 0x9f)
+intf = m[4][0]
+for t in (0x21, 0x23, 0x25, 0x27):
+    req(0, t, bytes([intf]))
+m = req(0, 0x07, struct.pack('<BHBHBB', 5, 1, intf, 1, 0, 0))
+assert m[2] == 0
+
+def fetch(drop):
+    snd(1, 7, 0x01, b'\x00\x01')
+    while True:
+        try:
+            m = rd()
+        except socket.timeout:
+            return None
+        if m[3] != 1 or m[1] == 0x81:
+            continue
+        if m[1] == 0x02:
+            snd(1, m[0], 0x82, struct.pack('<I', len(FIRMWARE)))
+        elif m[1] == 0x03:
+            off, size = struct.unpack('<II', m[4])
+            if drop and off:
+                # The second chunk is never answered, gbsim must give up
+                # on its own
+                drop = False
+                continue
+            snd(1, m[0], 0x83, FIRMWARE[off:off + size])
+        elif m[1] == 0x04:
+            snd(1, m[0], 0x84)
+            return m[4][0]
+
+# Long enough for the dropped request to time out
+s.settimeout(5)
+status = fetch(True)
+if status != 0:
+    sys.exit('FAIL: failed fetch not reported, ready to boot status %s' %
+             status)
+print('failed fetch: ready to boot status %d' % status)
+status = fetch(False)
+if status != 2:
+    sys.exit('FAIL: fetch did not start over, ready to boot status %s' %
+             status)
+print('PASS: ready to boot status %d' % status)
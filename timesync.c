@@ -0,0 +1,153 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * TimeSync: the SVC keeps the frame time, a counter running at the
+ * reference clock rate, which the AP synchronises the interfaces to.
+ *
+ * The AP first acquires the wake pins of the interfaces taking part, then
+ * enables TimeSync with the frame time to start from, the number of
+ * strobes and the delay between them. The SVC strobes the wake pins right
+ * away, its counter starting at the given frame time on the first strobe,
+ * and reports the frame time it latched at each strobe in the
+ * authoritative response. Once synchronised, each ping strobes the pins
+ * again and returns the frame time of the SVC at that point.
+ *
+ * The frame time is derived from CLOCK_MONOTONIC_RAW, which NTP doesn't
+ * slew, like the free running counter of a real SVC.
+ *
+ * The state is only ever used by the SVC request handler, which handles
+ * one request at a time.
+ */
+
+static uint32_t timesync_wake_pins;
+static bool timesync_enabled;
+static uint8_t timesync_strobes;
+static uint64_t timesync_frame_time;
+static uint32_t timesync_strobe_delay_us;
+static uint32_t timesync_refclk;
+/* Raw time of the first strobe */
+static uint64_t timesync_start_ns;
+
+static uint64_t timesync_raw_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Frame time the given time after the first strobe */
+static uint64_t timesync_frame_time_at(uint64_t ns)
+{
+	/* Split up so as not to overflow after a few hours */
+	return timesync_frame_time + ns / 1000000000ULL * timesync_refclk +
+		ns % 1000000000ULL * timesync_refclk / 1000000000ULL;
+}
+
+int timesync_wake_pins_acquire(uint32_t strobe_mask)
+{
+	if (!strobe_mask)
+		return -EINVAL;
+
+	if (timesync_wake_pins & strobe_mask) {
+		gbsim_error("wake pins %08x already acquired\n",
+			    timesync_wake_pins & strobe_mask);
+		return -EBUSY;
+	}
+
+	timesync_wake_pins |= strobe_mask;
+
+	return 0;
+}
+
+void timesync_wake_pins_release(void)
+{
+	timesync_wake_pins = 0;
+}
+
+int timesync_enable(uint8_t count, uint64_t frame_time,
+		    uint32_t strobe_delay_us, uint32_t refclk)
+{
+	if (!count || count > GB_TIMESYNC_MAX_STROBES || !refclk)
+		return -EINVAL;
+
+	/* There is nothing to strobe without the wake pins */
+	if (!timesync_wake_pins)
+		return -EPERM;
+
+	timesync_strobes = count;
+	timesync_frame_time = frame_time;
+	timesync_strobe_delay_us = strobe_delay_us;
+	timesync_refclk = refclk;
+	timesync_start_ns = timesync_raw_ns();
+	timesync_enabled = true;
+
+	gbsim_debug("timesync enabled: %hhu strobes %u us apart at %u Hz, from frame time %llu\n",
+		    count, strobe_delay_us, refclk,
+		    (unsigned long long)frame_time);
+
+	return 0;
+}
+
+void timesync_disable(void)
+{
+	timesync_enabled = false;
+}
+
+/*
+ * Frame times latched at each strobe, waiting for the strobes still to
+ * come if the AP asks early, as the SVC would.
+ */
+int timesync_authoritative(uint64_t *frame_time)
+{
+	uint64_t last_ns, now;
+	struct timespec ts;
+	unsigned int i;
+
+	if (!timesync_enabled)
+		return -EPERM;
+
+	last_ns = timesync_start_ns + (uint64_t)(timesync_strobes - 1) *
+		timesync_strobe_delay_us * 1000;
+	now = timesync_raw_ns();
+	/* The raw clock can't be slept on, wait for as long instead */
+	if (now < last_ns) {
+		ts.tv_sec = (last_ns - now) / 1000000000ULL;
+		ts.tv_nsec = (last_ns - now) % 1000000000ULL;
+		nanosleep(&ts, NULL);
+	}
+
+	memset(frame_time, 0, GB_TIMESYNC_MAX_STROBES * sizeof(*frame_time));
+	for (i = 0; i < timesync_strobes; i++)
+		frame_time[i] = timesync_frame_time_at((uint64_t)i *
+					timesync_strobe_delay_us * 1000);
+
+	return 0;
+}
+
+/* Strobe the wake pins, returning the frame time at that point */
+int timesync_ping(uint64_t *frame_time)
+{
+	if (!timesync_enabled || !timesync_wake_pins)
+		return -EPERM;
+
+	*frame_time = timesync_frame_time_at(timesync_raw_ns() -
+					     timesync_start_ns);
+
+	return 0;
+}
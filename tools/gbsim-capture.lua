@@ -0,0 +1,102 @@
+-- Wireshark dissector for gbsim capture files (gbsim -c)
+--
+-- Frames use the LINKTYPE_USER0 link type: a gbsim capture header
+-- followed by the greybus operation message as sent on the wire.
+--
+-- Usage: wireshark -X lua_script:gbsim-capture.lua capture.pcap
+
+local gbsim = Proto("gbsim", "Greybus Simulator")
+
+local directions = {
+	[0] = "AP -> Module",
+	[1] = "Module -> AP",
+}
+
+local protocols = {
+	[0x00] = "Control",
+	[0x02] = "GPIO",
+	[0x03] = "I2C",
+	[0x04] = "UART",
+	[0x05] = "HID",
+	[0x06] = "USB",
+	[0x07] = "SDIO",
+	[0x08] = "Power Supply",
+	[0x09] = "PWM",
+	[0x0b] = "SPI",
+	[0x0c] = "Display",
+	[0x0d] = "Camera Management",
+	[0x0e] = "Sensor",
+	[0x0f] = "Lights",
+	[0x10] = "Vibrator",
+	[0x11] = "Loopback",
+	[0x12] = "Audio Management",
+	[0x13] = "Audio Data",
+	[0x14] = "SVC",
+	[0x15] = "Bootrom",
+	[0x16] = "Camera Data",
+	[0x17] = "Firmware Download",
+	[0x18] = "Firmware Management",
+	[0x19] = "Authentication",
+	[0x1a] = "Log",
+	[0xfe] = "Raw",
+	[0xff] = "Unknown",
+}
+
+local f = gbsim.fields
+f.direction = ProtoField.uint8("gbsim.direction", "Direction", base.DEC, directions)
+f.protocol = ProtoField.uint8("gbsim.protocol", "Protocol", base.HEX, protocols)
+f.hd_cport = ProtoField.uint16("gbsim.hd_cport", "HD CPort", base.DEC)
+f.cport = ProtoField.uint16("gbsim.cport", "CPort", base.DEC)
+f.size = ProtoField.uint16("gbsim.size", "Size", base.DEC)
+f.operation_id = ProtoField.uint16("gbsim.operation_id", "Operation ID", base.DEC)
+f.type = ProtoField.uint8("gbsim.type", "Type", base.HEX)
+f.response = ProtoField.bool("gbsim.response", "Response", 8, nil, 0x80)
+f.result = ProtoField.uint8("gbsim.result", "Result", base.DEC)
+f.pad = ProtoField.bytes("gbsim.pad", "Pad")
+f.payload = ProtoField.bytes("gbsim.payload", "Payload")
+
+local CAPTURE_HDR_LEN = 8
+local MSG_HDR_LEN = 8
+
+function gbsim.dissector(tvb, pinfo, tree)
+	if tvb:len() < CAPTURE_HDR_LEN + MSG_HDR_LEN then
+		return 0
+	end
+
+	local direction = tvb(0, 1):uint()
+	local protocol = tvb(1, 1):uint()
+	local hd_cport = tvb(2, 2):le_uint()
+	local type = tvb(CAPTURE_HDR_LEN + 4, 1):uint()
+	local kind = bit.band(type, 0x80) ~= 0 and "response" or "request"
+
+	pinfo.cols.protocol = "Greybus"
+	pinfo.cols.src = direction == 0 and "AP" or "Module"
+	pinfo.cols.dst = direction == 0 and "Module" or "AP"
+	pinfo.cols.info = string.format("%s hd cport %u type 0x%02x %s",
+		protocols[protocol] or string.format("protocol 0x%02x", protocol),
+		hd_cport, bit.band(type, 0x7f), kind)
+
+	local t = tree:add(gbsim, tvb(), "Greybus Simulator")
+	t:add(f.direction, tvb(0, 1))
+	t:add(f.protocol, tvb(1, 1))
+	t:add_le(f.hd_cport, tvb(2, 2))
+	t:add_le(f.cport, tvb(4, 2))
+
+	local m = tvb(CAPTURE_HDR_LEN):tvb()
+	local op = t:add(gbsim, m(0, MSG_HDR_LEN), "Operation Header")
+	op:add_le(f.size, m(0, 2))
+	op:add_le(f.operation_id, m(2, 2))
+	op:add(f.type, m(4, 1))
+	op:add(f.response, m(4, 1))
+	op:add(f.result, m(5, 1))
+	op:add(f.pad, m(6, 2))
+
+	if m:len() > MSG_HDR_LEN then
+		t:add(f.payload, m(MSG_HDR_LEN))
+	end
+
+	return tvb:len()
+end
+
+local wtap_encap = DissectorTable.get("wtap_encap")
+wtap_encap:add(wtap.USER0, gbsim)
@@ -139,7 +139,7 @@ static void tty_poll_modem_state(int i)
 		tiocm_bits |= up[i].tiocm_bits & TIOCM_RI  ? GB_UART_CTRL_RI  : 0;
 		gb_uart_send(i, &tiocm_bits, sizeof(tiocm_bits),
 			     GB_UART_TYPE_SERIAL_STATE, 0);
-		if (verbose)
+		if (gbsim_tracing())
 			gbsim_debug("UART DCD=%d DSR=%d RI=%d",
 				    tiocm_bits & GB_UART_CTRL_DCD,
 				    tiocm_bits & GB_UART_CTRL_DSR,
@@ -258,7 +258,7 @@ static int tty_write(uint8_t module_id, uint16_t cport_id, void *tbuf, size_t ts
 		gbsim_error("UART write -> %s failed errno=%d\n",
 			    up[i].name, errno);
 
-	if (verbose) {
+	if (gbsim_tracing()) {
 		gbsim_debug("AP -> UART %s length %zu\n", up[i].name, tsize);
 		gbsim_dump(tbuf, tsize);
 	}
@@ -523,7 +523,7 @@ static int uart_init_port(uint8_t module_id, uint16_t cport_id,
 	return i;
 }
 
-int uart_handler(struct gbsim_connection *connection, void *rbuf,
+static int uart_handler(struct gbsim_connection *connection, void *rbuf,
 		 size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
@@ -542,7 +542,7 @@ int uart_handler(struct gbsim_connection *connection, void *rbuf,
 	int i;
 	extern int errno;
 
-	module_id = cport_to_module_id(cport_id);
+	module_id = connection_module_id(connection);
 
 	op_rsp = (struct op_msg *)tbuf;
 	oph = (struct gb_operation_msg_hdr *)&op_req->header;
@@ -555,7 +555,10 @@ int uart_handler(struct gbsim_connection *connection, void *rbuf,
 	switch (oph->type) {
 	case GB_UART_TYPE_SEND_DATA:
 		send_data = &op_req->uart_send_data_req;
-		if (tty_write(module_id, cport_id, send_data->data, send_data->size) < send_data->size)
+		if (sizeof(*oph) + sizeof(*send_data) +
+		    le16toh(send_data->size) > rsize)
+			result = PROTOCOL_STATUS_INVALID;
+		else if (tty_write(module_id, cport_id, send_data->data, send_data->size) < send_data->size)
 			result = PROTOCOL_STATUS_INVALID;
 		gbsim_debug("UART send len %hu\n", send_data->size);
 		break;
@@ -649,7 +652,7 @@ static void *uart_thread(void *param)
 	return NULL;
 }
 
-void uart_cleanup(void)
+static void uart_cleanup(void)
 {
 	int i;
 	char c;
@@ -695,7 +698,7 @@ static int uart_open(int idx)
 	return 0;
 }
 
-char *uart_get_operation(uint8_t type)
+static char *uart_get_operation(uint8_t type)
 {
 	switch (type) {
 	case GB_REQUEST_TYPE_INVALID:
@@ -717,7 +720,7 @@ char *uart_get_operation(uint8_t type)
 	}
 }
 
-void uart_init(void)
+static void uart_init(void)
 {
 	extern int errno;
 	int i, ret;
@@ -748,3 +751,13 @@ void uart_init(void)
 	thread_started = 1;
 	pthread_barrier_wait(&uart_barrier);
 }
+
+static struct gbsim_protocol uart_protocol = {
+	.id		= GREYBUS_PROTOCOL_UART,
+	.name		= "UART",
+	.handler	= uart_handler,
+	.get_operation	= uart_get_operation,
+	.init		= uart_init,
+	.cleanup	= uart_cleanup,
+};
+GBSIM_PROTOCOL(uart_protocol);
@@ -0,0 +1,246 @@
+/*
+ * Greybus Simulator
+ *
+ * Copyright 2016 Google Inc.
+ * Copyright 2016 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * UniPro links between the interfaces and the switch.
+ *
+ * The SVC takes an interface through its power up steps, V_SYS, RefClk,
+ * UniPro link up and activation, each taking the time set with -L, given
+ * as a comma separated list of settings in microseconds:
+ *
+ *   vsys=<us>		switching V_SYS on or off
+ *   refclk=<us>	switching the reference clock on or off
+ *   unipro=<us>	bringing the UniPro link up or down
+ *   activate=<us>	activating the interface
+ *   pwrm=<us>		switching the power mode of the link
+ *
+ * The power mode the AP sets on the link gives its bandwidth in each
+ * direction, which the messages exchanged with the interface's CPorts are
+ * then paced to. Until the AP sets one, or while the link is hibernated,
+ * messages aren't held back.
+ */
+
+/* Backlog of the link messages don't wait for */
+#define UNIPRO_THROTTLE_SLACK_NS	200000
+
+static unsigned int unipro_latency_us[UNIPRO_STEP_COUNT];
+static bool unipro_throttling;
+
+static const char * const unipro_step_names[UNIPRO_STEP_COUNT] = {
+	[UNIPRO_STEP_VSYS]	= "vsys",
+	[UNIPRO_STEP_REFCLK]	= "refclk",
+	[UNIPRO_STEP_UNIPRO]	= "unipro",
+	[UNIPRO_STEP_ACTIVATE]	= "activate",
+	[UNIPRO_STEP_PWRM]	= "pwrm",
+};
+
+int unipro_latency_parse(const char *spec)
+{
+	char *settings, *setting, *value, *end, *save;
+	unsigned long us;
+	int ret = 0, i;
+
+	settings = strdup(spec);
+	if (!settings)
+		return -ENOMEM;
+
+	for (setting = strtok_r(settings, ",", &save); setting;
+	     setting = strtok_r(NULL, ",", &save)) {
+		value = strchr(setting, '=');
+		if (!value) {
+			ret = -EINVAL;
+			break;
+		}
+		*value++ = '\0';
+
+		us = strtoul(value, &end, 0);
+		if (end == value || *end) {
+			ret = -EINVAL;
+			break;
+		}
+
+		for (i = 0; i < UNIPRO_STEP_COUNT; i++)
+			if (!strcmp(setting, unipro_step_names[i]))
+				break;
+
+		if (i == UNIPRO_STEP_COUNT) {
+			ret = -EINVAL;
+			break;
+		}
+		unipro_latency_us[i] = us;
+	}
+	free(settings);
+
+	return ret;
+}
+
+/* Take the time the step takes on real hardware */
+void unipro_step_delay(enum unipro_step step)
+{
+	unsigned int us = unipro_latency_us[step];
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * 1000,
+	};
+
+	if (us)
+		nanosleep(&ts, NULL);
+}
+
+/*
+ * Bytes per second a direction of the link carries in the given mode, 0 if
+ * none, or -EINVAL if the link can't do it. Gears give the line rate of
+ * each lane, of which 8b10b coding leaves 80%.
+ */
+static int unipro_link_rate(uint8_t series, uint8_t mode, uint8_t gear,
+			    uint8_t nlanes, uint64_t *rate)
+{
+	uint64_t kbps;
+
+	*rate = 0;
+
+	switch (mode) {
+	case GB_SVC_UNIPRO_MODE_UNCHANGED:
+	case GB_SVC_UNIPRO_HIBERNATE_MODE:
+	case GB_SVC_UNIPRO_OFF_MODE:
+		return 0;
+	case GB_SVC_UNIPRO_FAST_MODE:
+	case GB_SVC_UNIPRO_FAST_AUTO_MODE:
+		if (gear < 1 || gear > UNIPRO_HS_GEAR_MAX)
+			return -EINVAL;
+		if (series == GB_SVC_UNIPRO_HS_SERIES_A)
+			kbps = 1248000;
+		else if (series == GB_SVC_UNIPRO_HS_SERIES_B)
+			kbps = 1457600;
+		else
+			return -EINVAL;
+		break;
+	case GB_SVC_UNIPRO_SLOW_MODE:
+	case GB_SVC_UNIPRO_SLOW_AUTO_MODE:
+		if (gear < 1 || gear > UNIPRO_PWM_GEAR_MAX)
+			return -EINVAL;
+		kbps = 9000;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (nlanes < 1 || nlanes > UNIPRO_LANES_MAX)
+		return -EINVAL;
+
+	*rate = (kbps << (gear - 1)) * 1000 / 10 * nlanes;
+
+	return 0;
+}
+
+static void unipro_link_set(struct gbsim_link *link, uint8_t mode,
+			    uint8_t gear, uint8_t nlanes, uint64_t rate)
+{
+	if (mode == GB_SVC_UNIPRO_MODE_UNCHANGED)
+		return;
+
+	link->mode = mode;
+	link->gear = gear;
+	link->nlanes = nlanes;
+	__atomic_store_n(&link->bytes_per_s, rate, __ATOMIC_RELAXED);
+
+	if (rate)
+		__atomic_store_n(&unipro_throttling, true, __ATOMIC_RELAXED);
+}
+
+/*
+ * Switch the link of the interface to the power mode the AP asked for,
+ * both directions or none. Returns -EINVAL if the link can't do it.
+ */
+int unipro_link_set_mode(struct gbsim_interface *intf,
+			 struct gb_svc_intf_set_pwrm_request *req)
+{
+	uint64_t tx_rate, rx_rate;
+
+	if (unipro_link_rate(req->hs_series, req->tx_mode, req->tx_gear,
+			     req->tx_nlanes, &tx_rate) ||
+	    unipro_link_rate(req->hs_series, req->rx_mode, req->rx_gear,
+			     req->rx_nlanes, &rx_rate))
+		return -EINVAL;
+
+	intf->hs_series = req->hs_series;
+	unipro_link_set(&intf->tx, req->tx_mode, req->tx_gear, req->tx_nlanes,
+			tx_rate);
+	unipro_link_set(&intf->rx, req->rx_mode, req->rx_gear, req->rx_nlanes,
+			rx_rate);
+
+	/* As the PHY adapter of the interface reports it */
+	dme_set(intf->dme, PA_HS_SERIES, 0, intf->hs_series);
+	dme_set(intf->dme, PA_TX_GEAR, 0, intf->rx.gear);
+	dme_set(intf->dme, PA_ACTIVE_TX_DATA_LANES, 0, intf->rx.nlanes);
+	dme_set(intf->dme, PA_RX_GEAR, 0, intf->tx.gear);
+	dme_set(intf->dme, PA_ACTIVE_RX_DATA_LANES, 0, intf->tx.nlanes);
+	dme_set(intf->dme, PA_PWR_MODE, 0, intf->tx.mode << 4 | intf->rx.mode);
+
+	gbsim_debug("interface %hhu link at %llu bytes/s to it, %llu from it\n",
+		    intf->id, (unsigned long long)intf->tx.bytes_per_s,
+		    (unsigned long long)intf->rx.bytes_per_s);
+
+	return 0;
+}
+
+/* Take the link of the interface down, it carries nothing anymore */
+void unipro_link_down(struct gbsim_interface *intf)
+{
+	unipro_link_set(&intf->tx, GB_SVC_UNIPRO_OFF_MODE, 0, 0, 0);
+	unipro_link_set(&intf->rx, GB_SVC_UNIPRO_OFF_MODE, 0, 0, 0);
+}
+
+/* Whether any link has been given a bandwidth to pace the messages to */
+bool unipro_throttled(void)
+{
+	return __atomic_load_n(&unipro_throttling, __ATOMIC_RELAXED);
+}
+
+/*
+ * Wait for a message of the given size to have gone over the link. Messages
+ * queue up behind each other: the link keeps the time it is busy until,
+ * which each one pushes further. They are let through as long as the link
+ * is less than UNIPRO_THROTTLE_SLACK_NS behind, so that fast gears don't
+ * pay for a timer wakeup on each message.
+ */
+void unipro_link_throttle(struct gbsim_link *link, size_t size)
+{
+	uint64_t rate = __atomic_load_n(&link->bytes_per_s, __ATOMIC_RELAXED);
+	uint64_t now, start, done, busy;
+	struct timespec ts;
+
+	if (!rate)
+		return;
+
+	now = gbsim_now_ns();
+	busy = __atomic_load_n(&link->busy_ns, __ATOMIC_RELAXED);
+	do {
+		start = busy > now ? busy : now;
+		done = start + size * 1000000000ULL / rate;
+	} while (!__atomic_compare_exchange_n(&link->busy_ns, &busy, done,
+					      false, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	if (done <= now + UNIPRO_THROTTLE_SLACK_NS)
+		return;
+
+	done -= UNIPRO_THROTTLE_SLACK_NS;
+	ts.tv_sec = done / 1000000000ULL;
+	ts.tv_nsec = done % 1000000000ULL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}